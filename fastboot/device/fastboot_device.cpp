@@ -31,9 +31,12 @@
 #include "flashing.h"
 #include "tcp_client.h"
 #include "usb_client.h"
+#include "utility.h"
 
 using android::fs_mgr::EnsurePathUnmounted;
 using android::fs_mgr::Fstab;
+using android::fs_mgr::LpMetadataView;
+using android::fs_mgr::ReadMetadataView;
 using ::android::hardware::hidl_string;
 using ::android::hardware::boot::V1_0::IBootControl;
 using ::android::hardware::boot::V1_0::Slot;
@@ -183,12 +186,29 @@ void FastbootDevice::ExecuteCommands() {
             WriteStatus(FastbootResult::FAIL, "Unrecognized command " + args[0]);
             continue;
         }
+        // The metadata may have been changed by the previous command, or from
+        // the host in between.
+        InvalidateMetadataViews();
         if (!found_command->second(this, args)) {
             return;
         }
     }
 }
 
+const LpMetadataView* FastbootDevice::GetMetadataView(uint32_t slot_number) {
+    auto it = metadata_views_.find(slot_number);
+    if (it != metadata_views_.end()) {
+        return it->second.get();
+    }
+
+    std::unique_ptr<LpMetadataView> metadata;
+    auto path = FindPhysicalPartition(fs_mgr_get_super_partition_name(slot_number));
+    if (path) {
+        metadata = ReadMetadataView(path->c_str(), slot_number);
+    }
+    return metadata_views_.emplace(slot_number, std::move(metadata)).first->second.get();
+}
+
 bool FastbootDevice::WriteOkay(const std::string& message) {
     return WriteStatus(FastbootResult::OKAY, message);
 }
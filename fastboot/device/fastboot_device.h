@@ -26,6 +26,7 @@
 #include <android/hardware/boot/1.1/IBootControl.h>
 #include <android/hardware/fastboot/1.1/IFastboot.h>
 #include <android/hardware/health/2.0/IHealth.h>
+#include <liblp/liblp.h>
 
 #include "commands.h"
 #include "transport.h"
@@ -61,6 +62,12 @@ class FastbootDevice {
 
     void set_active_slot(const std::string& active_slot) { active_slot_ = active_slot; }
 
+    // Returns the logical partition metadata of |slot_number|, or null if it
+    // cannot be read. It is read at most once per command, and must be
+    // invalidated whenever it is written.
+    const android::fs_mgr::LpMetadataView* GetMetadataView(uint32_t slot_number);
+    void InvalidateMetadataViews() { metadata_views_.clear(); }
+
   private:
     const std::unordered_map<std::string, CommandHandler> kCommandMap;
 
@@ -71,4 +78,5 @@ class FastbootDevice {
     android::sp<android::hardware::fastboot::V1_1::IFastboot> fastboot_hal_;
     std::vector<char> download_data_;
     std::string active_slot_;
+    std::unordered_map<uint32_t, std::unique_ptr<android::fs_mgr::LpMetadataView>> metadata_views_;
 };
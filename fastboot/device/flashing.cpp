@@ -194,7 +194,9 @@ bool UpdateSuper(FastbootDevice* device, const std::string& super_name, bool wip
     uint32_t slot_number = SlotNumberForSlotSuffix(slot_suffix);
     std::unique_ptr<LpMetadata> old_metadata = ReadMetadata(super_name, slot_number);
     if (wipe || !old_metadata) {
-        if (!FlashPartitionTable(super_name, *new_metadata.get())) {
+        bool flashed = FlashPartitionTable(super_name, *new_metadata.get());
+        device->InvalidateMetadataViews();
+        if (!flashed) {
             return device->WriteFail("Unable to flash new partition table");
         }
         android::fs_mgr::TeardownAllOverlayForMountPoint();
@@ -113,29 +113,17 @@ std::optional<std::string> FindPhysicalPartition(const std::string& name) {
     return path;
 }
 
-static const LpMetadataPartition* FindLogicalPartition(const LpMetadata& metadata,
-                                                       const std::string& name) {
-    for (const auto& partition : metadata.partitions) {
-        if (GetPartitionName(partition) == name) {
-            return &partition;
-        }
-    }
-    return nullptr;
-}
-
 bool LogicalPartitionExists(FastbootDevice* device, const std::string& name, bool* is_zero_length) {
     std::string slot_suffix = GetSuperSlotSuffix(device, name);
     uint32_t slot_number = SlotNumberForSlotSuffix(slot_suffix);
-    auto path = FindPhysicalPartition(fs_mgr_get_super_partition_name(slot_number));
-    if (!path) {
-        return false;
-    }
 
-    std::unique_ptr<LpMetadata> metadata = ReadMetadata(path->c_str(), slot_number);
+    // This runs for every partition in "getvar all", so the metadata is only
+    // read once per command and the name is looked up in place.
+    const LpMetadataView* metadata = device->GetMetadataView(slot_number);
     if (!metadata) {
         return false;
     }
-    const LpMetadataPartition* partition = FindLogicalPartition(*metadata.get(), name);
+    const LpMetadataPartition* partition = metadata->FindPartition(name);
     if (!partition) {
         return false;
     }
@@ -219,6 +207,7 @@ bool UpdateAllPartitionMetadata(FastbootDevice* device, const std::string& super
     for (size_t i = 0; i < num_slots; i++) {
         ok &= UpdatePartitionTable(super_name, metadata, i);
     }
+    device->InvalidateMetadataViews();
     return ok;
 }
 
@@ -820,13 +820,13 @@ static struct sparse_file** load_sparse_files(int fd, int64_t max_size) {
       die("invalid max size %" PRId64, max_size);
     }
 
-    int files = sparse_file_resparse(s, max_size, nullptr, 0);
+    int files = sparse_file_resparse_packed(s, max_size, nullptr, 0);
     if (files < 0) die("Failed to resparse");
 
     sparse_file** out_s = reinterpret_cast<sparse_file**>(calloc(sizeof(struct sparse_file *), files + 1));
     if (!out_s) die("Failed to allocate sparse file array");
 
-    files = sparse_file_resparse(s, max_size, out_s, files);
+    files = sparse_file_resparse_packed(s, max_size, out_s, files);
     if (files < 0) die("Failed to resparse");
 
     return out_s;
@@ -14,11 +14,6 @@
 
 #include <fs_mgr/file_wait.h>
 
-#include <limits.h>
-#if defined(__linux__)
-#include <poll.h>
-#include <sys/inotify.h>
-#endif
 #if defined(WIN32)
 #include <io.h>
 #else
@@ -28,17 +23,20 @@
 #include <functional>
 #include <thread>
 
-#include <android-base/file.h>
-#include <android-base/logging.h>
-#include <android-base/unique_fd.h>
+#if defined(__linux__)
+#include <libdm/file_waiter.h>
+#endif
 
 namespace android {
 namespace fs_mgr {
 
 using namespace std::literals;
-using android::base::unique_fd;
+#if defined(__linux__)
+using android::dm::FileWaiter;
+#endif
 
-bool PollForFile(const std::string& path, const std::chrono::milliseconds relative_timeout) {
+#if !defined(__linux__)
+static bool PollForFile(const std::string& path, const std::chrono::milliseconds relative_timeout) {
     auto start_time = std::chrono::steady_clock::now();
 
     while (true) {
@@ -52,7 +50,8 @@ bool PollForFile(const std::string& path, const std::chrono::milliseconds relati
     }
 }
 
-bool PollForFileDeleted(const std::string& path, const std::chrono::milliseconds relative_timeout) {
+static bool PollForFileDeleted(const std::string& path,
+                               const std::chrono::milliseconds relative_timeout) {
     auto start_time = std::chrono::steady_clock::now();
 
     while (true) {
@@ -65,157 +64,11 @@ bool PollForFileDeleted(const std::string& path, const std::chrono::milliseconds
         if (time_elapsed > relative_timeout) return false;
     }
 }
-
-#if defined(__linux__)
-class OneShotInotify {
-  public:
-    OneShotInotify(const std::string& path, uint32_t mask,
-                   const std::chrono::milliseconds relative_timeout);
-
-    bool Wait();
-
-  private:
-    bool CheckCompleted();
-    int64_t RemainingMs() const;
-    bool ConsumeEvents();
-
-    enum class Result { Success, Timeout, Error };
-    Result WaitImpl();
-
-    unique_fd inotify_fd_;
-    std::string path_;
-    uint32_t mask_;
-    std::chrono::time_point<std::chrono::steady_clock> start_time_;
-    std::chrono::milliseconds relative_timeout_;
-    bool finished_;
-};
-
-OneShotInotify::OneShotInotify(const std::string& path, uint32_t mask,
-                               const std::chrono::milliseconds relative_timeout)
-    : path_(path),
-      mask_(mask),
-      start_time_(std::chrono::steady_clock::now()),
-      relative_timeout_(relative_timeout),
-      finished_(false) {
-    // If the condition is already met, don't bother creating an inotify.
-    if (CheckCompleted()) return;
-
-    unique_fd inotify_fd(inotify_init1(IN_CLOEXEC | IN_NONBLOCK));
-    if (inotify_fd < 0) {
-        PLOG(ERROR) << "inotify_init1 failed";
-        return;
-    }
-
-    std::string watch_path;
-    if (mask == IN_CREATE) {
-        watch_path = android::base::Dirname(path);
-    } else {
-        watch_path = path;
-    }
-    if (inotify_add_watch(inotify_fd, watch_path.c_str(), mask) < 0) {
-        PLOG(ERROR) << "inotify_add_watch failed";
-        return;
-    }
-
-    // It's possible the condition was met before the add_watch. Check for
-    // this and abort early if so.
-    if (CheckCompleted()) return;
-
-    inotify_fd_ = std::move(inotify_fd);
-}
-
-bool OneShotInotify::Wait() {
-    Result result = WaitImpl();
-    if (result == Result::Success) return true;
-    if (result == Result::Timeout) return false;
-
-    // Some kind of error with inotify occurred, so fallback to a poll.
-    std::chrono::milliseconds timeout(RemainingMs());
-    if (mask_ == IN_CREATE) {
-        return PollForFile(path_, timeout);
-    } else if (mask_ == IN_DELETE_SELF) {
-        return PollForFileDeleted(path_, timeout);
-    } else {
-        LOG(ERROR) << "Unknown inotify mask: " << mask_;
-        return false;
-    }
-}
-
-OneShotInotify::Result OneShotInotify::WaitImpl() {
-    // If the operation completed super early, we'll never have created an
-    // inotify instance.
-    if (finished_) return Result::Success;
-    if (inotify_fd_ < 0) return Result::Error;
-
-    while (true) {
-        auto remaining_ms = RemainingMs();
-        if (remaining_ms <= 0) return Result::Timeout;
-
-        struct pollfd event = {
-                .fd = inotify_fd_,
-                .events = POLLIN,
-                .revents = 0,
-        };
-        int rv = poll(&event, 1, static_cast<int>(remaining_ms));
-        if (rv <= 0) {
-            if (rv == 0 || errno == EINTR) {
-                continue;
-            }
-            PLOG(ERROR) << "poll for inotify failed";
-            return Result::Error;
-        }
-        if (event.revents & POLLERR) {
-            LOG(ERROR) << "error reading inotify for " << path_;
-            return Result::Error;
-        }
-
-        // Note that we don't bother checking what kind of event it is, since
-        // it's cheap enough to just see if the initial condition is satisified.
-        // If it's not, we consume all the events available and continue.
-        if (CheckCompleted()) return Result::Success;
-        if (!ConsumeEvents()) return Result::Error;
-    }
-}
-
-bool OneShotInotify::CheckCompleted() {
-    if (mask_ == IN_CREATE) {
-        finished_ = !access(path_.c_str(), F_OK) || errno != ENOENT;
-    } else if (mask_ == IN_DELETE_SELF) {
-        finished_ = access(path_.c_str(), F_OK) && errno == ENOENT;
-    } else {
-        LOG(ERROR) << "Unexpected mask: " << mask_;
-    }
-    return finished_;
-}
-
-bool OneShotInotify::ConsumeEvents() {
-    // According to the manpage, this is enough to read at least one event.
-    static constexpr size_t kBufferSize = sizeof(struct inotify_event) + NAME_MAX + 1;
-    char buffer[kBufferSize];
-
-    do {
-        ssize_t rv = TEMP_FAILURE_RETRY(read(inotify_fd_, buffer, sizeof(buffer)));
-        if (rv <= 0) {
-            if (rv == 0 || errno == EAGAIN) {
-                return true;
-            }
-            PLOG(ERROR) << "read inotify failed";
-            return false;
-        }
-    } while (true);
-}
-
-int64_t OneShotInotify::RemainingMs() const {
-    auto remaining = (std::chrono::steady_clock::now() - start_time_);
-    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(remaining);
-    return (relative_timeout_ - elapsed).count();
-}
 #endif
 
 bool WaitForFile(const std::string& path, const std::chrono::milliseconds relative_timeout) {
 #if defined(__linux__)
-    OneShotInotify inotify(path, IN_CREATE, relative_timeout);
-    return inotify.Wait();
+    return FileWaiter::Instance().Wait({path}, FileWaiter::Mode::kExists, relative_timeout);
 #else
     return PollForFile(path, relative_timeout);
 #endif
@@ -224,8 +77,7 @@ bool WaitForFile(const std::string& path, const std::chrono::milliseconds relati
 // Wait at most |relative_timeout| milliseconds for |path| to stop existing.
 bool WaitForFileDeleted(const std::string& path, const std::chrono::milliseconds relative_timeout) {
 #if defined(__linux__)
-    OneShotInotify inotify(path, IN_DELETE_SELF, relative_timeout);
-    return inotify.Wait();
+    return FileWaiter::Instance().Wait({path}, FileWaiter::Mode::kDeleted, relative_timeout);
 #else
     return PollForFileDeleted(path, relative_timeout);
 #endif
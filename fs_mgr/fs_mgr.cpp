@@ -34,10 +34,13 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <utility>
@@ -1361,9 +1364,147 @@ static bool IsMountPointMounted(const std::string& mount_point) {
     return GetEntryForMountPoint(&fstab, mount_point) != nullptr;
 }
 
+// Logs a failure to mount an entry that is neither formattable nor
+// encryptable. Returns true if the failure can be ignored.
+static bool report_mount_failure(const FstabEntry& attempted_entry) {
+    // fs_options might be null so we cannot use PERROR << directly.
+    // Use StringPrintf to output "(null)" instead.
+    if (attempted_entry.fs_mgr_flags.no_fail) {
+        PERROR << android::base::StringPrintf(
+                "Ignoring failure to mount an un-encryptable or wiped "
+                "partition on %s at %s options: %s",
+                attempted_entry.blk_device.c_str(), attempted_entry.mount_point.c_str(),
+                attempted_entry.fs_options.c_str());
+        return true;
+    }
+    PERROR << android::base::StringPrintf(
+            "Failed to mount an un-encryptable or wiped partition "
+            "on %s at %s options: %s",
+            attempted_entry.blk_device.c_str(), attempted_entry.mount_point.c_str(),
+            attempted_entry.fs_options.c_str());
+    return false;
+}
+
+// Returns the index of the last consecutive fstab entry sharing the mount point of |start_idx|.
+static int last_alternative_idx(const Fstab& fstab, int start_idx) {
+    int i = start_idx;
+    while (i + 1 < static_cast<int>(fstab.size()) &&
+           fstab[i + 1].mount_point == fstab[start_idx].mount_point) {
+        i++;
+    }
+    return i;
+}
+
+// Entries whose mount result only matters as success or failure. Anything that
+// can be formatted, or that vold needs to know about, still goes through the
+// serial path in fs_mgr_mount_all().
+static bool can_mount_in_parallel(const Fstab& fstab, int start_idx) {
+    for (int i = start_idx; i <= last_alternative_idx(fstab, start_idx); i++) {
+        const auto& entry = fstab[i];
+        if (entry.mount_point == "/data" || entry.fs_mgr_flags.formattable ||
+            entry.is_encryptable() || entry.fs_mgr_flags.file_encryption ||
+            entry.fs_mgr_flags.force_fde_or_fbe || should_use_metadata_encryption(entry)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_path_within(const std::string& path, const std::string& dir) {
+    if (!StartsWith(path, dir)) {
+        return false;
+    }
+    return path.size() == dir.size() || dir.back() == '/' || path[dir.size()] == '/';
+}
+
+// Two entries must be mounted in fstab order if one is nested under the
+// other, if one's block device (e.g. a loop image) lives under the other's
+// mount point, or if they share a block device.
+static bool mounts_conflict(const FstabEntry& a, const FstabEntry& b) {
+    return is_path_within(a.mount_point, b.mount_point) ||
+           is_path_within(b.mount_point, a.mount_point) ||
+           is_path_within(a.blk_device, b.mount_point) ||
+           is_path_within(b.blk_device, a.mount_point) ||
+           realpath(a.blk_device) == realpath(b.blk_device);
+}
+
+static bool mount_groups_conflict(const Fstab& fstab, int a_idx, int b_idx) {
+    for (int i = a_idx; i <= last_alternative_idx(fstab, a_idx); i++) {
+        for (int j = b_idx; j <= last_alternative_idx(fstab, b_idx); j++) {
+            if (mounts_conflict(fstab[i], fstab[j])) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// A mount point whose mount_with_alternatives() call was deferred by
+// fs_mgr_mount_all() so it can run alongside others.
+struct ParallelMount {
+    int top_idx;
+    int attempted_idx = -1;
+    bool mounted = false;
+    int mount_errno = 0;
+};
+
+// Runs mount_with_alternatives() for each of |mounts|, on up to one thread per
+// CPU. A mount only starts once every earlier mount it conflicts with has
+// finished, so nested mount points still come up parent first.
+static void mount_all_in_parallel(const Fstab& fstab, std::vector<ParallelMount>* mounts) {
+    std::vector<std::vector<size_t>> deps(mounts->size());
+    for (size_t i = 0; i < mounts->size(); i++) {
+        for (size_t j = 0; j < i; j++) {
+            if (mount_groups_conflict(fstab, (*mounts)[j].top_idx, (*mounts)[i].top_idx)) {
+                deps[i].emplace_back(j);
+            }
+        }
+    }
+
+    const size_t max_running = std::max(std::thread::hardware_concurrency(), 1u);
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<bool> done(mounts->size(), false);
+    size_t running = 0;
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < mounts->size(); i++) {
+        threads.emplace_back([&, i]() -> void {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cv.wait(guard, [&]() -> bool {
+                    if (running >= max_running) return false;
+                    return std::all_of(deps[i].begin(), deps[i].end(),
+                                       [&](size_t dep) -> bool { return done[dep]; });
+                });
+                running++;
+            }
+
+            auto& mount = (*mounts)[i];
+            int last_idx_inspected;
+            mount.mounted =
+                    mount_with_alternatives(fstab, mount.top_idx, &last_idx_inspected,
+                                            &mount.attempted_idx);
+            mount.mount_errno = errno;
+
+            std::lock_guard<std::mutex> guard(lock);
+            running--;
+            done[i] = true;
+            cv.notify_all();
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
 // When multiple fstab records share the same mount_point, it will try to mount each
 // one in turn, and ignore any duplicates after a first successful mount.
 // Returns -1 on error, and  FS_MGR_MNTALL_* otherwise.
+//
+// If ro.fs_mgr.parallel_mount_all is true, mount points that need no
+// encryption or format handling are checked and mounted concurrently. Failures
+// are still reported in fstab order.
 MountAllResult fs_mgr_mount_all(Fstab* fstab, int mount_mode) {
     int encryptable = FS_MGR_MNTALL_DEV_NOT_ENCRYPTABLE;
     int error_count = 0;
@@ -1376,6 +1517,28 @@ MountAllResult fs_mgr_mount_all(Fstab* fstab, int mount_mode) {
         return {FS_MGR_MNTALL_FAIL, userdata_mounted};
     }
 
+    bool parallel = GetBoolProperty("ro.fs_mgr.parallel_mount_all", false);
+    std::vector<ParallelMount> pending_mounts;
+    auto finish_pending_mounts = [&]() -> void {
+        if (pending_mounts.empty()) {
+            return;
+        }
+        mount_all_in_parallel(*fstab, &pending_mounts);
+        for (const auto& mount : pending_mounts) {
+            if (mount.mounted) {
+                continue;
+            }
+            const auto& top_entry = (*fstab)[mount.top_idx];
+            const auto& attempted_entry = (*fstab)[mount.attempted_idx];
+            wiped = partition_wiped(top_entry.blk_device.c_str());
+            errno = mount.mount_errno;
+            if (!report_mount_failure(attempted_entry)) {
+                ++error_count;
+            }
+        }
+        pending_mounts.clear();
+    };
+
     // Keep i int to prevent unsigned integer overflow from (i = top_idx - 1),
     // where top_idx is 0. It will give SIGABRT
     for (int i = 0; i < static_cast<int>(fstab->size()); i++) {
@@ -1418,6 +1581,14 @@ MountAllResult fs_mgr_mount_all(Fstab* fstab, int mount_mode) {
             continue;
         }
 
+        // Anything below a deferred mount point must wait for it to be mounted.
+        for (const auto& mount : pending_mounts) {
+            if (mount_groups_conflict(*fstab, mount.top_idx, i)) {
+                finish_pending_mounts();
+                break;
+            }
+        }
+
         // Translate LABEL= file system labels into block devices.
         if (is_extfs(current_entry.fs_type)) {
             if (!TranslateExtLabels(&current_entry)) {
@@ -1449,6 +1620,7 @@ MountAllResult fs_mgr_mount_all(Fstab* fstab, int mount_mode) {
                 avb_handle = AvbHandle::Open();
                 if (!avb_handle) {
                     LERROR << "Failed to open AvbHandle";
+                    finish_pending_mounts();
                     set_type_property(encryptable);
                     return {FS_MGR_MNTALL_FAIL, userdata_mounted};
                 }
@@ -1477,6 +1649,14 @@ MountAllResult fs_mgr_mount_all(Fstab* fstab, int mount_mode) {
             }
         }
 
+        if (parallel && can_mount_in_parallel(*fstab, i)) {
+            pending_mounts.push_back({.top_idx = i});
+            i = last_alternative_idx(*fstab, i);
+            continue;
+        }
+        // Keep everything else ordered after the mounts that came before it.
+        finish_pending_mounts();
+
         int last_idx_inspected;
         int top_idx = i;
         int attempted_idx = -1;
@@ -1611,25 +1791,13 @@ MountAllResult fs_mgr_mount_all(Fstab* fstab, int mount_mode) {
             encryptable = FS_MGR_MNTALL_DEV_IS_METADATA_ENCRYPTED;
             continue;
         } else {
-            // fs_options might be null so we cannot use PERROR << directly.
-            // Use StringPrintf to output "(null)" instead.
-            if (attempted_entry.fs_mgr_flags.no_fail) {
-                PERROR << android::base::StringPrintf(
-                        "Ignoring failure to mount an un-encryptable or wiped "
-                        "partition on %s at %s options: %s",
-                        attempted_entry.blk_device.c_str(), attempted_entry.mount_point.c_str(),
-                        attempted_entry.fs_options.c_str());
-            } else {
-                PERROR << android::base::StringPrintf(
-                        "Failed to mount an un-encryptable or wiped partition "
-                        "on %s at %s options: %s",
-                        attempted_entry.blk_device.c_str(), attempted_entry.mount_point.c_str(),
-                        attempted_entry.fs_options.c_str());
+            if (!report_mount_failure(attempted_entry)) {
                 ++error_count;
             }
             continue;
         }
     }
+    finish_pending_mounts();
 
     set_type_property(encryptable);
 
@@ -136,14 +136,15 @@ bool CreateDmTable(CreateLogicalPartitionParams params, DmTable* table) {
     return CreateDmTableInternal(params, table);
 }
 
-bool CreateLogicalPartitions(const std::string& block_device) {
+bool CreateLogicalPartitions(const std::string& block_device,
+                             const std::chrono::milliseconds& timeout_ms) {
     uint32_t slot = SlotNumberForSlotSuffix(fs_mgr_get_slot_suffix());
     auto metadata = ReadMetadata(block_device.c_str(), slot);
     if (!metadata) {
         LOG(ERROR) << "Could not read partition table.";
         return true;
     }
-    return CreateLogicalPartitions(*metadata.get(), block_device);
+    return CreateLogicalPartitions(*metadata.get(), block_device, timeout_ms);
 }
 
 std::unique_ptr<LpMetadata> ReadCurrentMetadata(const std::string& block_device) {
@@ -151,11 +152,19 @@ std::unique_ptr<LpMetadata> ReadCurrentMetadata(const std::string& block_device)
     return ReadMetadata(block_device.c_str(), slot);
 }
 
-bool CreateLogicalPartitions(const LpMetadata& metadata, const std::string& super_device) {
+bool CreateLogicalPartitions(const LpMetadata& metadata, const std::string& super_device,
+                             const std::chrono::milliseconds& timeout_ms) {
+    PartitionOpener opener;
     CreateLogicalPartitionParams params = {
             .block_device = super_device,
             .metadata = &metadata,
+            .partition_opener = &opener,
     };
+
+    // Build every table first, so that all of the devices can be created in a
+    // single batch.
+    std::vector<std::unique_ptr<DmTable>> tables;
+    std::vector<DeviceMapper::DeviceSpec> devices;
     for (const auto& partition : metadata.partitions) {
         if (!partition.num_extents) {
             LINFO << "Skipping zero-length logical partition: " << GetPartitionName(partition);
@@ -168,11 +177,23 @@ bool CreateLogicalPartitions(const LpMetadata& metadata, const std::string& supe
 
         params.partition = &partition;
 
-        std::string ignore_path;
-        if (!CreateLogicalPartition(params, &ignore_path)) {
+        auto table = std::make_unique<DmTable>();
+        if (!CreateDmTableInternal(params, table.get())) {
             LERROR << "Could not create logical partition: " << GetPartitionName(partition);
             return false;
         }
+        devices.emplace_back(DeviceMapper::DeviceSpec{GetPartitionName(partition), table.get()});
+        tables.emplace_back(std::move(table));
+    }
+
+    std::vector<std::string> paths;
+    DeviceMapper& dm = DeviceMapper::Instance();
+    if (!dm.CreateDevices(devices, &paths, timeout_ms)) {
+        LERROR << "Could not create logical partitions on " << super_device;
+        return false;
+    }
+    for (size_t i = 0; i < devices.size(); i++) {
+        LINFO << "Created logical partition " << devices[i].name << " on device " << paths[i];
     }
     return true;
 }
@@ -90,7 +90,8 @@ bool EnsurePathMounted(Fstab* fstab, const std::string& path, const std::string&
             return false;
         }
         std::string super_name = fs_mgr_get_super_partition_name();
-        if (!android::fs_mgr::CreateLogicalPartitions("/dev/block/by-name/" + super_name)) {
+        // ueventd is running, so wait for the devices before mounting one.
+        if (!android::fs_mgr::CreateLogicalPartitions("/dev/block/by-name/" + super_name, 5s)) {
             LERROR << "Failed to create logical partitions";
             return false;
         }
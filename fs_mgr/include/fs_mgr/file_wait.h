@@ -20,9 +20,10 @@
 namespace android {
 namespace fs_mgr {
 
-// Wait at most |relative_timeout| milliseconds for |path| to exist. dirname(path)
-// must already exist. For example, to wait on /dev/block/dm-6, /dev/block must
-// be a valid directory.
+// Wait at most |relative_timeout| milliseconds for |path| to exist. Missing
+// parent directories are waited for as well. Waits are event-driven via
+// android::dm::FileWaiter, which also keeps latency stats for all waits in the
+// process.
 bool WaitForFile(const std::string& path, const std::chrono::milliseconds relative_timeout);
 
 // Wait at most |relative_timeout| milliseconds for |path| to stop existing.
@@ -44,11 +44,18 @@ std::unique_ptr<LpMetadata> ReadCurrentMetadata(const std::string& block_device)
 
 // Create block devices for all logical partitions in the given metadata. The
 // metadata must have been read from the current slot.
-bool CreateLogicalPartitions(const LpMetadata& metadata, const std::string& block_device);
+//
+// If |timeout_ms| is non-zero, this blocks until every device path is
+// available, or the timeout elapses. It must be zero when nothing is running
+// ueventd, e.g. in first-stage init, where the caller creates the device
+// nodes itself.
+bool CreateLogicalPartitions(const LpMetadata& metadata, const std::string& block_device,
+                             const std::chrono::milliseconds& timeout_ms = {});
 
 // Create block devices for all logical partitions. This is a convenience
 // method for ReadMetadata and CreateLogicalPartitions.
-bool CreateLogicalPartitions(const std::string& block_device);
+bool CreateLogicalPartitions(const std::string& block_device,
+                             const std::chrono::milliseconds& timeout_ms = {});
 
 struct CreateLogicalPartitionParams {
     // Block device of the super partition.
@@ -170,6 +170,21 @@ static bool IsRecovery() {
     return access("/system/bin/recovery", F_OK) == 0;
 }
 
+// Recovery images from older non-A/B releases ship a ueventd that does not
+// create unique paths, so the dm-N path must be waited on instead.
+static bool UseLegacyDevicePaths() {
+    if (!IsRecovery()) {
+        return false;
+    }
+    bool non_ab_device = android::base::GetProperty("ro.build.ab_update", "").empty();
+    int sdk = android::base::GetIntProperty("ro.build.version.sdk", 0);
+    if (non_ab_device && sdk && sdk <= 29) {
+        LOG(INFO) << "Detected ueventd incompatibility, reverting to legacy libdm behavior.";
+        return true;
+    }
+    return false;
+}
+
 bool DeviceMapper::CreateEmptyDevice(const std::string& name) {
     std::string uuid = GenerateUuid();
     return CreateDevice(name, uuid);
@@ -190,13 +205,8 @@ bool DeviceMapper::WaitForDevice(const std::string& name,
         return true;
     }
 
-    if (IsRecovery()) {
-        bool non_ab_device = android::base::GetProperty("ro.build.ab_update", "").empty();
-        int sdk = android::base::GetIntProperty("ro.build.version.sdk", 0);
-        if (non_ab_device && sdk && sdk <= 29) {
-            LOG(INFO) << "Detected ueventd incompatibility, reverting to legacy libdm behavior.";
-            unique_path = *path;
-        }
+    if (UseLegacyDevicePaths()) {
+        unique_path = *path;
     }
 
     if (!WaitForFile(unique_path, timeout_ms)) {
@@ -226,6 +236,55 @@ bool DeviceMapper::CreateDevice(const std::string& name, const DmTable& table, s
     return true;
 }
 
+bool DeviceMapper::CreateDevices(const std::vector<DeviceSpec>& devices,
+                                 std::vector<std::string>* paths,
+                                 const std::chrono::milliseconds& timeout_ms) {
+    std::vector<std::string> created;
+    auto delete_created = [&]() {
+        for (auto iter = created.rbegin(); iter != created.rend(); iter++) {
+            DeleteDevice(*iter);
+        }
+    };
+
+    for (const auto& device : devices) {
+        if (!CreateEmptyDevice(device.name)) {
+            delete_created();
+            return false;
+        }
+        created.emplace_back(device.name);
+        if (!LoadTableAndActivate(device.name, *device.table)) {
+            delete_created();
+            return false;
+        }
+    }
+
+    paths->clear();
+    std::vector<std::string> unique_paths;
+    for (const auto& device : devices) {
+        std::string path, unique_path;
+        if (!GetDeviceUniquePath(device.name, &unique_path) ||
+            !GetDmDevicePathByName(device.name, &path)) {
+            delete_created();
+            return false;
+        }
+        paths->emplace_back(std::move(path));
+        unique_paths.emplace_back(std::move(unique_path));
+    }
+
+    if (timeout_ms <= std::chrono::milliseconds::zero()) {
+        return true;
+    }
+    if (UseLegacyDevicePaths()) {
+        unique_paths = *paths;
+    }
+    if (!WaitForFiles(unique_paths, timeout_ms)) {
+        LOG(ERROR) << "Failed waiting for paths of " << devices.size() << " devices";
+        delete_created();
+        return false;
+    }
+    return true;
+}
+
 bool DeviceMapper::GetDeviceUniquePath(const std::string& name, std::string* path) {
     struct dm_ioctl io;
     InitIo(&io, name);
@@ -694,3 +694,56 @@ TEST(libdm, CreateEmptyDevice) {
     // Path should exist.
     ASSERT_EQ(0, access(path.c_str(), F_OK));
 }
+
+TEST(libdm, CreateDevices) {
+    unique_fd tmp(CreateTempFile("file_1", 4096));
+    ASSERT_GE(tmp, 0);
+    LoopDevice loop(tmp, 10s);
+    ASSERT_TRUE(loop.valid());
+
+    DmTable table_a;
+    ASSERT_TRUE(table_a.Emplace<DmTargetLinear>(0, 1, loop.device(), 0));
+    DmTable table_b;
+    ASSERT_TRUE(table_b.Emplace<DmTargetLinear>(0, 1, loop.device(), 1));
+
+    DeviceMapper& dm = DeviceMapper::Instance();
+    std::vector<DeviceMapper::DeviceSpec> devices = {
+            {"libdm-test-batch-a", &table_a},
+            {"libdm-test-batch-b", &table_b},
+    };
+    std::vector<std::string> paths;
+    ASSERT_TRUE(dm.CreateDevices(devices, &paths, 5s));
+    auto guard = android::base::make_scope_guard([&]() {
+        dm.DeleteDevice("libdm-test-batch-a", 5s);
+        dm.DeleteDevice("libdm-test-batch-b", 5s);
+    });
+
+    ASSERT_EQ(paths.size(), 2);
+    for (size_t i = 0; i < devices.size(); i++) {
+        ASSERT_EQ(DmDeviceState::ACTIVE, dm.GetState(devices[i].name));
+        ASSERT_EQ(0, access(paths[i].c_str(), F_OK));
+    }
+}
+
+TEST(libdm, CreateDevicesFailureDeletesBatch) {
+    unique_fd tmp(CreateTempFile("file_1", 4096));
+    ASSERT_GE(tmp, 0);
+    LoopDevice loop(tmp, 10s);
+    ASSERT_TRUE(loop.valid());
+
+    DmTable good;
+    ASSERT_TRUE(good.Emplace<DmTargetLinear>(0, 1, loop.device(), 0));
+    // A table whose first target does not start at sector 0 cannot be loaded.
+    DmTable bad;
+    ASSERT_TRUE(bad.Emplace<DmTargetLinear>(1, 1, loop.device(), 0));
+
+    DeviceMapper& dm = DeviceMapper::Instance();
+    std::vector<DeviceMapper::DeviceSpec> devices = {
+            {"libdm-test-batch-good", &good},
+            {"libdm-test-batch-bad", &bad},
+    };
+    std::vector<std::string> paths;
+    ASSERT_FALSE(dm.CreateDevices(devices, &paths, 5s));
+    ASSERT_EQ(DmDeviceState::INVALID, dm.GetState("libdm-test-batch-good"));
+    ASSERT_EQ(DmDeviceState::INVALID, dm.GetState("libdm-test-batch-bad"));
+}
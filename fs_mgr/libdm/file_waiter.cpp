@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libdm/file_waiter.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+namespace android {
+namespace dm {
+
+using namespace std::literals;
+using std::chrono::steady_clock;
+
+// Only used if inotify is unavailable.
+static constexpr auto kPollInterval = 20ms;
+
+static constexpr uint32_t kWatchMask = IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM |
+                                       IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+FileWaiter& FileWaiter::Instance() {
+    static FileWaiter instance;
+    return instance;
+}
+
+FileWaiter::FileWaiter() {
+    inotify_fd_.reset(inotify_init1(IN_CLOEXEC | IN_NONBLOCK));
+    if (inotify_fd_ < 0) {
+        PLOG(WARNING) << "inotify_init1 failed, file waits will poll";
+    }
+}
+
+bool FileWaiter::Wait(const std::vector<std::string>& paths, Mode mode,
+                      const std::chrono::milliseconds& timeout) {
+    auto start_time = steady_clock::now();
+    std::vector<std::string> pending = paths;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    waiters_++;
+    bool ok = WaitLocked(&lock, &pending, mode, start_time + timeout);
+
+    // Callers may inspect errno from the final access() check.
+    int saved_errno = errno;
+    if (--waiters_ == 0) {
+        // Don't let events queue up while nobody is waiting.
+        RemoveWatchesLocked();
+    }
+    auto elapsed =
+            std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - start_time);
+    stats_.waits++;
+    stats_.timeouts += !ok;
+    stats_.total_time += elapsed;
+    stats_.max_time = std::max(stats_.max_time, elapsed);
+    errno = saved_errno;
+    return ok;
+}
+
+bool FileWaiter::WaitLocked(std::unique_lock<std::mutex>* lock, std::vector<std::string>* pending,
+                            Mode mode, steady_clock::time_point deadline) {
+    while (true) {
+        // Watches are added before checking, so that a change in between
+        // still wakes us up.
+        bool all_watched = inotify_fd_ >= 0;
+        if (all_watched) {
+            for (const auto& path : *pending) {
+                all_watched &= AddWatchLocked(path);
+            }
+        }
+
+        for (auto iter = pending->begin(); iter != pending->end();) {
+            bool exists = access(iter->c_str(), F_OK) == 0 || errno != ENOENT;
+            if (exists == (mode == Mode::kExists)) {
+                iter = pending->erase(iter);
+            } else {
+                iter++;
+            }
+        }
+        if (pending->empty()) {
+            return true;
+        }
+
+        auto now = steady_clock::now();
+        if (now >= deadline) {
+            return false;
+        }
+        auto wake_time = all_watched ? deadline : std::min(deadline, now + kPollInterval);
+
+        uint64_t generation = generation_;
+        if (inotify_fd_ >= 0 && !polling_) {
+            // Read events on behalf of every waiter, then wake them all up to
+            // re-check their paths.
+            polling_ = true;
+            lock->unlock();
+            std::vector<int> removed;
+            bool ok = PollInotify(wake_time, &removed);
+            lock->lock();
+            polling_ = false;
+            generation_++;
+            for (int wd : removed) {
+                auto iter = watch_paths_.find(wd);
+                if (iter != watch_paths_.end()) {
+                    watches_.erase(iter->second);
+                    watch_paths_.erase(iter);
+                }
+            }
+            cv_.notify_all();
+            if (!ok) {
+                return false;
+            }
+        } else {
+            cv_.wait_until(*lock, wake_time,
+                           [&, this]() { return generation_ != generation || !polling_; });
+        }
+    }
+}
+
+// Watch the parent directory of |path|, or if it does not exist, the
+// nearest ancestor that does. Returns false if nothing could be watched.
+bool FileWaiter::AddWatchLocked(const std::string& path) {
+    std::string dir = android::base::Dirname(path);
+    while (true) {
+        if (watches_.count(dir)) {
+            return true;
+        }
+        int wd = inotify_add_watch(inotify_fd_, dir.c_str(), kWatchMask);
+        if (wd >= 0) {
+            watches_[dir] = wd;
+            watch_paths_[wd] = dir;
+            return true;
+        }
+        if (errno != ENOENT && errno != ENOTDIR) {
+            PLOG(ERROR) << "inotify_add_watch failed: " << dir;
+            return false;
+        }
+        std::string parent = android::base::Dirname(dir);
+        if (parent == dir) {
+            return false;
+        }
+        dir = std::move(parent);
+    }
+}
+
+void FileWaiter::RemoveWatchesLocked() {
+    for (const auto& [wd, path] : watch_paths_) {
+        inotify_rm_watch(inotify_fd_, wd);
+    }
+    watches_.clear();
+    watch_paths_.clear();
+
+    if (inotify_fd_ >= 0) {
+        std::vector<int> ignored;
+        PollInotify(steady_clock::now(), &ignored);
+    }
+}
+
+// Block until inotify has events or |deadline| passes, then consume all
+// pending events. Watches that the kernel dropped (because their directory
+// was removed) are returned in |removed|.
+bool FileWaiter::PollInotify(steady_clock::time_point deadline, std::vector<int>* removed) {
+    auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - steady_clock::now());
+    remaining = std::max(remaining, 0ms);
+
+    struct pollfd event = {
+            .fd = inotify_fd_,
+            .events = POLLIN,
+            .revents = 0,
+    };
+    int rv = poll(&event, 1, static_cast<int>(remaining.count()));
+    if (rv <= 0) {
+        if (rv == 0 || errno == EINTR) {
+            return true;
+        }
+        PLOG(ERROR) << "poll for inotify failed";
+        return false;
+    }
+
+    alignas(struct inotify_event) char buffer[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+    while (true) {
+        ssize_t len = TEMP_FAILURE_RETRY(read(inotify_fd_, buffer, sizeof(buffer)));
+        if (len <= 0) {
+            if (len == 0 || errno == EAGAIN) {
+                return true;
+            }
+            PLOG(ERROR) << "read inotify failed";
+            return false;
+        }
+        for (ssize_t offset = 0; offset < len;) {
+            auto event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+            if (event->mask & IN_IGNORED) {
+                removed->emplace_back(event->wd);
+            }
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+FileWaitStats FileWaiter::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void FileWaiter::ResetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_ = {};
+}
+
+}  // namespace dm
+}  // namespace android
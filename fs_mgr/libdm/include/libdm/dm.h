@@ -159,6 +159,22 @@ class DeviceMapper final {
     // use the timeout variant above.
     bool CreateDevice(const std::string& name, const DmTable& table);
 
+    // A device to be created by CreateDevices().
+    struct DeviceSpec {
+        std::string name;
+        const DmTable* table;
+    };
+
+    // Creates each device in |devices| and activates its table, in order, and
+    // then waits for all of their paths at once, so that ueventd processes
+    // the devices concurrently rather than one per CreateDevice() call. On
+    // success, |paths| holds the GetDmDevicePathByName result for each device.
+    // If any step fails, every device created by this call is deleted.
+    //
+    // |timeout_ms| has the same meaning as for CreateDevice().
+    bool CreateDevices(const std::vector<DeviceSpec>& devices, std::vector<std::string>* paths,
+                       const std::chrono::milliseconds& timeout_ms);
+
     // Loads the device mapper table from parameter into the underlying device
     // mapper device with given name and activate / resumes the device in the
     // process. A device with the given name must already exist.
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBDM_FILE_WAITER_H_
+#define _LIBDM_FILE_WAITER_H_
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace dm {
+
+// Latency of the waits completed by a FileWaiter, including ones that timed
+// out.
+struct FileWaitStats {
+    uint64_t waits = 0;
+    uint64_t timeouts = 0;
+    std::chrono::microseconds total_time = {};
+    std::chrono::microseconds max_time = {};
+};
+
+// Waits for paths to be created or removed, such as device nodes from
+// ueventd. One inotify instance is shared by every caller in the process.
+// Each directory of interest is watched once, and every event wakes all
+// waiters to re-check their own paths, so any number of waits across
+// threads are resolved without sleep-polling.
+//
+// If a path's parent directory does not exist yet, its nearest existing
+// ancestor is watched instead, and the watch moves down as directories
+// appear.
+class FileWaiter final {
+  public:
+    enum class Mode { kExists, kDeleted };
+
+    static FileWaiter& Instance();
+
+    // Wait at most |timeout| for every path in |paths| to exist (kExists), or
+    // to not exist (kDeleted). A path that exists but cannot be accessed, for
+    // example due to EPERM, counts as existing.
+    bool Wait(const std::vector<std::string>& paths, Mode mode,
+              const std::chrono::milliseconds& timeout);
+
+    FileWaitStats GetStats();
+    void ResetStats();
+
+  private:
+    FileWaiter();
+
+    bool WaitLocked(std::unique_lock<std::mutex>* lock, std::vector<std::string>* pending,
+                    Mode mode, std::chrono::steady_clock::time_point deadline);
+    bool AddWatchLocked(const std::string& path);
+    void RemoveWatchesLocked();
+    bool PollInotify(std::chrono::steady_clock::time_point deadline, std::vector<int>* removed);
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    android::base::unique_fd inotify_fd_;
+    std::map<std::string, int> watches_;
+    std::map<int, std::string> watch_paths_;
+    size_t waiters_ = 0;
+    // Set while one waiter is blocked reading |inotify_fd_| on behalf of all.
+    bool polling_ = false;
+    // Incremented each time inotify events are read.
+    uint64_t generation_ = 0;
+    FileWaitStats stats_;
+
+    FileWaiter(const FileWaiter&) = delete;
+    FileWaiter& operator=(const FileWaiter&) = delete;
+};
+
+}  // namespace dm
+}  // namespace android
+
+#endif /* _LIBDM_FILE_WAITER_H_ */
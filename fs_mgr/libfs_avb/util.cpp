@@ -20,15 +20,16 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 
-#include <thread>
-
 #include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
+#include <libdm/file_waiter.h>
 #include <linux/fs.h>
 
 namespace android {
 namespace fs_mgr {
 
+using android::dm::FileWaiter;
+
 bool NibbleValue(const char& c, uint8_t* value) {
     CHECK(value != nullptr);
 
@@ -85,25 +86,11 @@ std::string BytesToHex(const uint8_t* bytes, size_t bytes_len) {
     return hex;
 }
 
-// TODO: remove duplicate code with fs_mgr_wait_for_file
 bool WaitForFile(const std::string& filename, const std::chrono::milliseconds relative_timeout,
                  FileWaitMode file_wait_mode) {
-    auto start_time = std::chrono::steady_clock::now();
-
-    while (true) {
-        int rv = access(filename.c_str(), F_OK);
-        if (file_wait_mode == FileWaitMode::Exists) {
-            if (!rv || errno != ENOENT) return true;
-        } else if (file_wait_mode == FileWaitMode::DoesNotExist) {
-            if (rv && errno == ENOENT) return true;
-        }
-
-        std::this_thread::sleep_for(50ms);
-
-        auto now = std::chrono::steady_clock::now();
-        auto time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time);
-        if (time_elapsed > relative_timeout) return false;
-    }
+    auto mode = file_wait_mode == FileWaitMode::Exists ? FileWaiter::Mode::kExists
+                                                       : FileWaiter::Mode::kDeleted;
+    return FileWaiter::Instance().Wait({filename}, mode, relative_timeout);
 }
 
 bool IsDeviceUnlocked() {
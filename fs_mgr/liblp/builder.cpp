@@ -19,7 +19,9 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
 #include <limits>
+#include <tuple>
 
 #include <android-base/unique_fd.h>
 
@@ -95,10 +97,24 @@ bool ZeroExtent::operator==(const android::fs_mgr::Extent& other) const {
     return other.GetExtentType() == ExtentType::kZero && num_sectors_ == other.num_sectors();
 }
 
+static uint64_t NextPartitionGeneration() {
+    static std::atomic<uint64_t> next_generation(1);
+    return next_generation++;
+}
+
 Partition::Partition(std::string_view name, std::string_view group_name, uint32_t attributes)
-    : name_(name), group_name_(group_name), attributes_(attributes), size_(0) {}
+    : name_(name),
+      group_name_(group_name),
+      attributes_(attributes),
+      size_(0),
+      generation_(NextPartitionGeneration()) {}
+
+void Partition::BumpGeneration() {
+    generation_ = NextPartitionGeneration();
+}
 
 void Partition::AddExtent(std::unique_ptr<Extent>&& extent) {
+    BumpGeneration();
     size_ += extent->num_sectors() * LP_SECTOR_SIZE;
 
     if (LinearExtent* new_extent = extent->AsLinearExtent()) {
@@ -119,6 +135,7 @@ void Partition::AddExtent(std::unique_ptr<Extent>&& extent) {
 }
 
 void Partition::RemoveExtents() {
+    BumpGeneration();
     size_ = 0;
     extents_.clear();
 }
@@ -131,6 +148,7 @@ void Partition::ShrinkTo(uint64_t aligned_size) {
 
     // Remove or shrink extents of any kind until the total partition size is
     // equal to the requested size.
+    BumpGeneration();
     uint64_t sectors_to_remove = (size_ - aligned_size) / LP_SECTOR_SIZE;
     while (sectors_to_remove) {
         Extent* extent = extents_.back().get();
@@ -297,7 +315,8 @@ bool MetadataBuilder::UpdateMetadataForOtherSuper(LpMetadata* metadata, uint32_t
     return true;
 }
 
-MetadataBuilder::MetadataBuilder() : auto_slot_suffixing_(false) {
+MetadataBuilder::MetadataBuilder()
+    : auto_slot_suffixing_(false), allocation_policy_(AllocationPolicy::kFirstFit) {
     memset(&geometry_, 0, sizeof(geometry_));
     geometry_.magic = LP_METADATA_GEOMETRY_MAGIC;
     geometry_.struct_size = sizeof(geometry_);
@@ -582,65 +601,189 @@ void MetadataBuilder::RemovePartition(std::string_view name) {
     }
 }
 
-void MetadataBuilder::ExtentsToFreeList(const std::vector<Interval>& extents,
-                                        std::vector<Interval>* free_regions) const {
-    // Convert the extent list into a list of gaps between the extents; i.e.,
-    // the list of ranges that are free on the disk.
-    for (size_t i = 1; i < extents.size(); i++) {
-        const Interval& previous = extents[i - 1];
-        const Interval& current = extents[i];
-        DCHECK(previous.device_index == current.device_index);
+std::optional<Interval> MetadataBuilder::FreeRegionBetween(const Interval& previous,
+                                                           const Interval& next) const {
+    DCHECK(previous.device_index == next.device_index);
 
-        uint64_t aligned;
-        if (!AlignSector(block_devices_[current.device_index], previous.end, &aligned)) {
-            LERROR << "Sector " << previous.end << " caused integer overflow.";
-            continue;
-        }
-        if (aligned >= current.start) {
-            // There is no gap between these two extents, try the next one.
-            // Note that we check with >= instead of >, since alignment may
-            // bump the ending sector past the beginning of the next extent.
-            continue;
+    uint64_t aligned;
+    if (!AlignSector(block_devices_[next.device_index], previous.end, &aligned)) {
+        LERROR << "Sector " << previous.end << " caused integer overflow.";
+        return {};
+    }
+    if (aligned >= next.start) {
+        // There is no gap between these two extents. Note that we check with
+        // >= instead of >, since alignment may bump the ending sector past the
+        // beginning of the next extent.
+        return {};
+    }
+
+    // The new interval represents the free space starting at the end of the
+    // previous interval, and ending at the start of the next interval.
+    return Interval(next.device_index, aligned, next.start);
+}
+
+static bool SameInterval(const Interval& a, const Interval& b) {
+    return a.device_index == b.device_index && a.start == b.start && a.end == b.end;
+}
+
+static bool SameBlockDeviceLayout(const LpMetadataBlockDevice& a, const LpMetadataBlockDevice& b) {
+    return a.first_logical_sector == b.first_logical_sector && a.alignment == b.alignment &&
+           a.alignment_offset == b.alignment_offset && a.size == b.size;
+}
+
+static void EraseFreeRegion(std::multimap<Interval, Interval>* free_regions, const Interval& next,
+                            const Interval& region) {
+    auto [begin, end] = free_regions->equal_range(next);
+    for (auto iter = begin; iter != end; iter++) {
+        if (SameInterval(iter->second, region)) {
+            free_regions->erase(iter);
+            return;
         }
+    }
+}
 
-        // The new interval represents the free space starting at the end of
-        // the previous interval, and ending at the start of the next interval.
-        free_regions->emplace_back(current.device_index, aligned, current.start);
+void MetadataBuilder::IndexExtent(const Interval& interval) const {
+    auto& index = device_indices_[interval.device_index];
+    auto add_free_region = [&](const Interval& previous, const Interval& next) -> void {
+        if (auto region = FreeRegionBetween(previous, next)) {
+            index.free_regions.emplace(next, *region);
+        }
+    };
+    auto remove_free_region = [&](const Interval& previous, const Interval& next) -> void {
+        if (auto region = FreeRegionBetween(previous, next)) {
+            EraseFreeRegion(&index.free_regions, next, *region);
+        }
+    };
+
+    // The new extent splits the free region between its neighbors.
+    auto iter = index.extents.emplace(interval);
+    auto next = std::next(iter);
+    if (iter != index.extents.begin()) {
+        auto previous = std::prev(iter);
+        if (next != index.extents.end()) {
+            remove_free_region(*previous, *next);
+        }
+        add_free_region(*previous, *iter);
+    }
+    if (next != index.extents.end()) {
+        add_free_region(*iter, *next);
     }
 }
 
-auto MetadataBuilder::GetFreeRegions() const -> std::vector<Interval> {
-    std::vector<Interval> free_regions;
+void MetadataBuilder::UnindexExtent(const Interval& interval) const {
+    auto& index = device_indices_[interval.device_index];
+    auto iter = index.extents.find(interval);
+    if (iter == index.extents.end()) {
+        return;
+    }
+    auto remove_free_region = [&](const Interval& previous, const Interval& next) -> void {
+        if (auto region = FreeRegionBetween(previous, next)) {
+            EraseFreeRegion(&index.free_regions, next, *region);
+        }
+    };
+
+    // Merge the free regions on either side of the extent.
+    auto next = std::next(iter);
+    if (next != index.extents.end()) {
+        remove_free_region(*iter, *next);
+    }
+    if (iter != index.extents.begin()) {
+        auto previous = std::prev(iter);
+        remove_free_region(*previous, *iter);
+        if (next != index.extents.end()) {
+            if (auto region = FreeRegionBetween(*previous, *next)) {
+                index.free_regions.emplace(*next, *region);
+            }
+        }
+    }
+    index.extents.erase(iter);
+}
+
+void MetadataBuilder::SyncAllocatedExtents() const {
+    // Block devices can be inserted during Init() and resized by
+    // UpdateBlockDeviceInfo(), which moves every free region, so start over if
+    // they changed.
+    bool reset = device_indices_.size() != block_devices_.size();
+    for (size_t i = 0; !reset && i < block_devices_.size(); i++) {
+        reset = !SameBlockDeviceLayout(device_indices_[i].block_device, block_devices_[i]);
+    }
+    if (reset) {
+        device_indices_.clear();
+        device_indices_.resize(block_devices_.size());
+        indexed_partitions_.clear();
+        for (size_t i = 0; i < block_devices_.size(); i++) {
+            // Add 0-length intervals for the first and last sectors, so that
+            // the space in between is treated as available.
+            const auto& block_device = block_devices_[i];
+            uint64_t first_sector = block_device.first_logical_sector;
+            uint64_t last_sector = block_device.size / LP_SECTOR_SIZE;
+            device_indices_[i].block_device = block_device;
+            IndexExtent(Interval(i, first_sector, first_sector));
+            IndexExtent(Interval(i, last_sector, last_sector));
+        }
+    }
 
-    // Collect all extents in the partition table, per-device, then sort them
-    // by starting sector.
-    std::vector<std::vector<Interval>> device_extents(block_devices_.size());
     for (const auto& partition : partitions_) {
+        // New entries have generation 0, which no partition ever has.
+        IndexedPartition& indexed = indexed_partitions_[partition.get()];
+        if (indexed.generation == partition->generation_) {
+            continue;
+        }
+
+        std::vector<Interval> intervals;
         for (const auto& extent : partition->extents()) {
             LinearExtent* linear = extent->AsLinearExtent();
             if (!linear) {
                 continue;
             }
-            CHECK(linear->device_index() < device_extents.size());
-            auto& extents = device_extents[linear->device_index()];
-            extents.emplace_back(linear->device_index(), linear->physical_sector(),
-                                 linear->physical_sector() + extent->num_sectors());
+            CHECK(linear->device_index() < device_indices_.size());
+            intervals.emplace_back(linear->AsInterval());
+        }
+
+        // Partitions almost always change at their end, so only re-index the
+        // extents past the common prefix.
+        size_t common = 0;
+        while (common < intervals.size() && common < indexed.intervals.size() &&
+               SameInterval(intervals[common], indexed.intervals[common])) {
+            common++;
+        }
+        for (size_t i = common; i < indexed.intervals.size(); i++) {
+            UnindexExtent(indexed.intervals[i]);
+        }
+        for (size_t i = common; i < intervals.size(); i++) {
+            IndexExtent(intervals[i]);
         }
+        indexed.generation = partition->generation_;
+        indexed.intervals = std::move(intervals);
     }
 
-    // Add 0-length intervals for the first and last sectors. This will cause
-    // ExtentToFreeList() to treat the space in between as available.
-    for (size_t i = 0; i < device_extents.size(); i++) {
-        auto& extents = device_extents[i];
-        const auto& block_device = block_devices_[i];
+    // Drop partitions that have since been removed.
+    if (indexed_partitions_.size() != partitions_.size()) {
+        std::set<const Partition*> live;
+        for (const auto& partition : partitions_) {
+            live.emplace(partition.get());
+        }
+        for (auto iter = indexed_partitions_.begin(); iter != indexed_partitions_.end();) {
+            if (live.count(iter->first)) {
+                iter++;
+                continue;
+            }
+            for (const auto& interval : iter->second.intervals) {
+                UnindexExtent(interval);
+            }
+            iter = indexed_partitions_.erase(iter);
+        }
+    }
+}
 
-        uint64_t first_sector = block_device.first_logical_sector;
-        uint64_t last_sector = block_device.size / LP_SECTOR_SIZE;
-        extents.emplace_back(i, first_sector, first_sector);
-        extents.emplace_back(i, last_sector, last_sector);
+auto MetadataBuilder::GetFreeRegions() const -> std::vector<Interval> {
+    std::vector<Interval> free_regions;
 
-        std::sort(extents.begin(), extents.end());
-        ExtentsToFreeList(extents, &free_regions);
+    SyncAllocatedExtents();
+    for (const auto& index : device_indices_) {
+        for (const auto& [next, region] : index.free_regions) {
+            free_regions.emplace_back(region);
+        }
     }
     return free_regions;
 }
@@ -683,10 +826,41 @@ Interval Interval::Intersect(const Interval& a, const Interval& b) {
 
 std::vector<Interval> Interval::Intersect(const std::vector<Interval>& a,
                                           const std::vector<Interval>& b) {
+    // Sort |b| by device and start sector, so that each interval of |a| only
+    // visits the intervals of |b| that can overlap it.
+    auto by_device_and_start = [](const Interval& x, const Interval& y) -> bool {
+        return std::tie(x.device_index, x.start, x.end) < std::tie(y.device_index, y.start, y.end);
+    };
+    std::vector<Interval> sorted_b = b;
+    std::sort(sorted_b.begin(), sorted_b.end(), by_device_and_start);
+
+    // |max_end[i]| is the furthest end sector of sorted_b[0..i] on the same
+    // device. It never decreases within a device, so it can be searched.
+    std::vector<uint64_t> max_end(sorted_b.size());
+    for (size_t i = 0; i < sorted_b.size(); i++) {
+        max_end[i] = sorted_b[i].end;
+        if (i > 0 && sorted_b[i - 1].device_index == sorted_b[i].device_index) {
+            max_end[i] = std::max(max_end[i], max_end[i - 1]);
+        }
+    }
+
     std::vector<Interval> ret;
     for (const Interval& a_interval : a) {
-        for (const Interval& b_interval : b) {
-            auto intersect = Intersect(a_interval, b_interval);
+        auto device_begin = std::lower_bound(sorted_b.begin(), sorted_b.end(),
+                                             Interval(a_interval.device_index, 0, 0),
+                                             by_device_and_start);
+        size_t i = device_begin - sorted_b.begin();
+        size_t device_end = i;
+        while (device_end < sorted_b.size() &&
+               sorted_b[device_end].device_index == a_interval.device_index) {
+            device_end++;
+        }
+        // Skip intervals that all end before |a_interval| starts.
+        i = std::partition_point(max_end.begin() + i, max_end.begin() + device_end,
+                                 [&](uint64_t end) -> bool { return end <= a_interval.start; }) -
+            max_end.begin();
+        for (; i < device_end && sorted_b[i].start < a_interval.end; i++) {
+            auto intersect = Intersect(a_interval, sorted_b[i]);
             if (intersect.length() > 0) ret.emplace_back(std::move(intersect));
         }
     }
@@ -711,10 +885,13 @@ bool MetadataBuilder::GrowPartition(Partition* partition, uint64_t aligned_size,
     CHECK_NE(sectors_per_block, 0);
     CHECK(sectors_needed % sectors_per_block == 0);
 
+    // Regions before |num_preferred| are tried first by non-default allocation
+    // policies.
+    size_t num_preferred = free_regions.size();
     if (IsABDevice() && ShouldHalveSuper() && GetPartitionSlotSuffix(partition->name()) == "_b") {
         // Allocate "a" partitions top-down and "b" partitions bottom-up, to
         // minimize fragmentation during OTA.
-        free_regions = PrioritizeSecondHalfOfSuper(free_regions);
+        free_regions = PrioritizeSecondHalfOfSuper(free_regions, &num_preferred);
     }
 
     // Note we store new extents in a temporary vector, and only commit them
@@ -729,6 +906,20 @@ bool MetadataBuilder::GrowPartition(Partition* partition, uint64_t aligned_size,
         new_extents.emplace_back(std::move(extent));
     }
 
+    if (sectors_needed && allocation_policy_ != AllocationPolicy::kFirstFit) {
+        const Interval* region =
+                FindContiguousRegion(free_regions, 0, num_preferred, sectors_needed);
+        if (!region) {
+            region = FindContiguousRegion(free_regions, num_preferred, free_regions.size(),
+                                          sectors_needed);
+        }
+        if (region) {
+            new_extents.push_back(std::make_unique<LinearExtent>(
+                    sectors_needed, region->device_index, region->start));
+            sectors_needed = 0;
+        }
+    }
+
     for (auto& region : free_regions) {
         // Note: this comes first, since we may enter the loop not needing any
         // more sectors.
@@ -772,7 +963,7 @@ bool MetadataBuilder::GrowPartition(Partition* partition, uint64_t aligned_size,
 }
 
 std::vector<Interval> MetadataBuilder::PrioritizeSecondHalfOfSuper(
-        const std::vector<Interval>& free_list) {
+        const std::vector<Interval>& free_list, size_t* num_preferred) {
     const auto& super = block_devices_[0];
     uint64_t first_sector = super.first_logical_sector;
     uint64_t last_sector = super.size / LP_SECTOR_SIZE;
@@ -783,6 +974,9 @@ std::vector<Interval> MetadataBuilder::PrioritizeSecondHalfOfSuper(
     // size of partitions (it might lead to one extra extent if "B" overflows).
     if (!AlignSector(super, midpoint, &midpoint)) {
         LERROR << "Unexpected integer overflow aligning midpoint " << midpoint;
+        if (num_preferred) {
+            *num_preferred = free_list.size();
+        }
         return free_list;
     }
 
@@ -804,6 +998,9 @@ std::vector<Interval> MetadataBuilder::PrioritizeSecondHalfOfSuper(
             second_half.emplace_back(region);
         }
     }
+    if (num_preferred) {
+        *num_preferred = second_half.size();
+    }
     second_half.insert(second_half.end(), first_half.begin(), first_half.end());
     return second_half;
 }
@@ -843,6 +1040,26 @@ std::unique_ptr<LinearExtent> MetadataBuilder::ExtendFinalExtent(
     return new_extent;
 }
 
+const Interval* MetadataBuilder::FindContiguousRegion(const std::vector<Interval>& free_list,
+                                                      size_t begin, size_t end,
+                                                      uint64_t sectors_needed) const {
+    const uint64_t sectors_per_block = geometry_.logical_block_size / LP_SECTOR_SIZE;
+    const Interval* best = nullptr;
+    for (size_t i = begin; i < end; i++) {
+        const Interval& region = free_list[i];
+        if ((region.length() / sectors_per_block) * sectors_per_block < sectors_needed) {
+            continue;
+        }
+        if (allocation_policy_ == AllocationPolicy::kContiguousFirst) {
+            return &region;
+        }
+        if (!best || region.length() < best->length()) {
+            best = &region;
+        }
+    }
+    return best;
+}
+
 bool MetadataBuilder::IsAnyRegionCovered(const std::vector<Interval>& regions,
                                          const LinearExtent& candidate) const {
     for (const auto& region : regions) {
@@ -854,15 +1071,22 @@ bool MetadataBuilder::IsAnyRegionCovered(const std::vector<Interval>& regions,
 }
 
 bool MetadataBuilder::IsAnyRegionAllocated(const LinearExtent& candidate) const {
-    for (const auto& partition : partitions_) {
-        for (const auto& extent : partition->extents()) {
-            LinearExtent* linear = extent->AsLinearExtent();
-            if (!linear) {
-                continue;
-            }
-            if (linear->OverlapsWith(candidate)) {
-                return true;
-            }
+    SyncAllocatedExtents();
+    if (candidate.device_index() >= device_indices_.size()) {
+        return false;
+    }
+    const auto& allocated = device_indices_[candidate.device_index()].extents;
+
+    // Allocated extents do not overlap each other, so only the last extent
+    // starting before |candidate| and those starting inside it can overlap it.
+    auto iter = allocated.lower_bound(
+            Interval(candidate.device_index(), candidate.physical_sector(), 0));
+    if (iter != allocated.begin() && candidate.OverlapsWith(*std::prev(iter))) {
+        return true;
+    }
+    for (; iter != allocated.end() && iter->start < candidate.end_sector(); iter++) {
+        if (candidate.OverlapsWith(*iter)) {
+            return true;
         }
     }
     return false;
@@ -1206,6 +1430,10 @@ void MetadataBuilder::SetAutoSlotSuffixing() {
     auto_slot_suffixing_ = true;
 }
 
+void MetadataBuilder::SetAllocationPolicy(AllocationPolicy policy) {
+    allocation_policy_ = policy;
+}
+
 void MetadataBuilder::SetVirtualABDeviceFlag() {
     RequireExpandedMetadataHeader();
     header_.flags |= LP_HEADER_FLAG_VIRTUAL_AB_DEVICE;
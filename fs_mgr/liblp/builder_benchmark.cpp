@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+#include <liblp/builder.h>
+
+using namespace android::fs_mgr;
+
+static constexpr uint32_t kBlockSize = 4096;
+static constexpr uint64_t kSuperSize = 8ULL * 1024 * 1024 * 1024;
+static constexpr int kRounds = 16;
+
+// Grow |num_partitions| partitions one block at a time in round-robin order,
+// so that every partition ends up with |kRounds| extents interleaved with
+// everyone else's.
+static std::unique_ptr<MetadataBuilder> CreateFragmentedBuilder(
+        int num_partitions, std::vector<Partition*>* partitions) {
+    BlockDeviceInfo super("super", kSuperSize, 0, 0, kBlockSize);
+    auto builder = MetadataBuilder::New(super, 65536, 2);
+    if (!builder) {
+        return nullptr;
+    }
+    for (int i = 0; i < num_partitions; i++) {
+        partitions->push_back(builder->AddPartition("partition" + std::to_string(i), 0));
+    }
+    for (int round = 1; round <= kRounds; round++) {
+        for (auto partition : *partitions) {
+            if (!builder->ResizePartition(partition, round * kBlockSize)) {
+                return nullptr;
+            }
+        }
+    }
+    return builder;
+}
+
+static void BM_ResizeFragmented(benchmark::State& state) {
+    std::vector<Partition*> partitions;
+    auto builder = CreateFragmentedBuilder(state.range(0), &partitions);
+    if (!builder) {
+        state.SkipWithError("Could not create builder");
+        return;
+    }
+    for (auto _ : state) {
+        // Each grow allocates a new extent at the end of super; the shrink
+        // releases it again, so every iteration sees the same layout.
+        for (auto partition : partitions) {
+            builder->ResizePartition(partition, (kRounds + 1) * kBlockSize);
+        }
+        for (auto partition : partitions) {
+            builder->ResizePartition(partition, kRounds * kBlockSize);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * partitions.size());
+}
+BENCHMARK(BM_ResizeFragmented)->Arg(100)->Arg(300)->Arg(1000);
+
+static void BM_AllocationPolicy(benchmark::State& state, AllocationPolicy policy) {
+    std::vector<Partition*> partitions;
+    auto builder = CreateFragmentedBuilder(state.range(0), &partitions);
+    if (!builder) {
+        state.SkipWithError("Could not create builder");
+        return;
+    }
+    // Punch holes of one block all over super, then grow into them.
+    for (size_t i = 0; i < partitions.size(); i += 2) {
+        builder->ResizePartition(partitions[i], (kRounds - 1) * kBlockSize);
+    }
+    builder->SetAllocationPolicy(policy);
+    for (auto _ : state) {
+        for (size_t i = 1; i < partitions.size(); i += 2) {
+            builder->ResizePartition(partitions[i], (kRounds + 4) * kBlockSize);
+        }
+        for (size_t i = 1; i < partitions.size(); i += 2) {
+            builder->ResizePartition(partitions[i], kRounds * kBlockSize);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * partitions.size() / 2);
+}
+BENCHMARK_CAPTURE(BM_AllocationPolicy, first_fit, AllocationPolicy::kFirstFit)->Arg(300);
+BENCHMARK_CAPTURE(BM_AllocationPolicy, contiguous_first, AllocationPolicy::kContiguousFirst)
+        ->Arg(300);
+BENCHMARK_CAPTURE(BM_AllocationPolicy, best_fit, AllocationPolicy::kBestFit)->Arg(300);
+
+int main(int argc, char** argv) {
+    // ResizePartition() logs every size change.
+    android::base::SetMinimumLogSeverity(android::base::WARNING);
+    ::benchmark::Initialize(&argc, argv);
+    ::benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
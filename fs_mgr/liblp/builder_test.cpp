@@ -1089,3 +1089,113 @@ TEST_F(BuilderTest, VerifyExtent) {
     ASSERT_FALSE(target_builder->VerifyExtentsAgainstSourceMetadata(
             *source_builder, 0, *target_builder, 1, std::vector<std::string>{"vendor"}));
 }
+
+// Lay out free regions of 16KiB, 48KiB and 32KiB, in that order.
+static unique_ptr<MetadataBuilder> CreateFragmentedBuilder(std::vector<Interval>* free_regions) {
+    BlockDeviceInfo device_info("super", 1_MiB, 0, 0, 4096);
+    unique_ptr<MetadataBuilder> builder = MetadataBuilder::New(device_info, 4096, 1);
+    if (!builder) {
+        return nullptr;
+    }
+    for (const auto& [name, size] : std::vector<std::pair<std::string, uint64_t>>{
+                 {"a", 16_KiB}, {"b", 16_KiB}, {"c", 48_KiB}, {"d", 16_KiB}}) {
+        Partition* partition = builder->AddPartition(name, 0);
+        if (!partition || !builder->ResizePartition(partition, size)) {
+            return nullptr;
+        }
+    }
+    Partition* tail = builder->AddPartition("e", 0);
+    auto regions = builder->GetFreeRegions();
+    if (!tail || regions.size() != 1 ||
+        !builder->ResizePartition(tail, regions[0].length() * LP_SECTOR_SIZE - 32_KiB)) {
+        return nullptr;
+    }
+    builder->RemovePartition("a");
+    builder->RemovePartition("c");
+    *free_regions = builder->GetFreeRegions();
+    return builder;
+}
+
+TEST_F(BuilderTest, AllocationPolicy) {
+    std::vector<Interval> regions;
+    auto builder = CreateFragmentedBuilder(&regions);
+    ASSERT_NE(builder, nullptr);
+    ASSERT_EQ(regions.size(), 3);
+    EXPECT_EQ(regions[0].length() * LP_SECTOR_SIZE, 16_KiB);
+    EXPECT_EQ(regions[1].length() * LP_SECTOR_SIZE, 48_KiB);
+    EXPECT_EQ(regions[2].length() * LP_SECTOR_SIZE, 32_KiB);
+
+    // First fit spans the first two regions.
+    Partition* p = builder->AddPartition("first_fit", 0);
+    ASSERT_NE(p, nullptr);
+    ASSERT_TRUE(builder->ResizePartition(p, 32_KiB));
+    ASSERT_EQ(p->extents().size(), 2);
+    EXPECT_EQ(p->extents()[0]->AsLinearExtent()->physical_sector(), regions[0].start);
+    EXPECT_EQ(p->extents()[1]->AsLinearExtent()->physical_sector(), regions[1].start);
+
+    builder = CreateFragmentedBuilder(&regions);
+    ASSERT_NE(builder, nullptr);
+    builder->SetAllocationPolicy(AllocationPolicy::kContiguousFirst);
+    p = builder->AddPartition("contiguous", 0);
+    ASSERT_NE(p, nullptr);
+    ASSERT_TRUE(builder->ResizePartition(p, 32_KiB));
+    ASSERT_EQ(p->extents().size(), 1);
+    EXPECT_EQ(p->extents()[0]->AsLinearExtent()->physical_sector(), regions[1].start);
+
+    builder = CreateFragmentedBuilder(&regions);
+    ASSERT_NE(builder, nullptr);
+    builder->SetAllocationPolicy(AllocationPolicy::kBestFit);
+    p = builder->AddPartition("best_fit", 0);
+    ASSERT_NE(p, nullptr);
+    ASSERT_TRUE(builder->ResizePartition(p, 32_KiB));
+    ASSERT_EQ(p->extents().size(), 1);
+    EXPECT_EQ(p->extents()[0]->AsLinearExtent()->physical_sector(), regions[2].start);
+
+    // Nothing fits in one piece, so fall back to first fit.
+    p = builder->AddPartition("fallback", 0);
+    ASSERT_NE(p, nullptr);
+    ASSERT_TRUE(builder->ResizePartition(p, 64_KiB));
+    ASSERT_EQ(p->extents().size(), 2);
+    EXPECT_EQ(p->extents()[0]->AsLinearExtent()->physical_sector(), regions[0].start);
+}
+
+TEST_F(BuilderTest, FreeRegionsTrackExtentChanges) {
+    BlockDeviceInfo device_info("super", 1_MiB, 0, 0, 4096);
+    unique_ptr<MetadataBuilder> builder = MetadataBuilder::New(device_info, 4096, 1);
+    ASSERT_NE(builder, nullptr);
+    auto empty = builder->GetFreeRegions();
+    ASSERT_EQ(empty.size(), 1);
+
+    Partition* system = builder->AddPartition("system", 0);
+    ASSERT_NE(system, nullptr);
+    ASSERT_TRUE(builder->ResizePartition(system, 64_KiB));
+    Partition* vendor = builder->AddPartition("vendor", 0);
+    ASSERT_NE(vendor, nullptr);
+    ASSERT_TRUE(builder->ResizePartition(vendor, 64_KiB));
+    auto regions = builder->GetFreeRegions();
+    ASSERT_EQ(regions.size(), 1);
+    EXPECT_EQ(regions[0].start, empty[0].start + 256);
+
+    // Extents changed directly on a partition must be picked up too.
+    system->RemoveExtents();
+    regions = builder->GetFreeRegions();
+    ASSERT_EQ(regions.size(), 2);
+    EXPECT_EQ(regions[0], Interval(0, empty[0].start, empty[0].start + 128));
+
+    builder->RemovePartition("vendor");
+    regions = builder->GetFreeRegions();
+    ASSERT_EQ(regions.size(), 1);
+    EXPECT_EQ(regions[0], empty[0]);
+}
+
+TEST_F(BuilderTest, IntersectUnsorted) {
+    auto v = Interval::Intersect(
+            std::vector<Interval>{Interval(0, 0, 100), Interval(1, 0, 100)},
+            std::vector<Interval>{Interval(0, 80, 120), Interval(1, 10, 20), Interval(0, 0, 10),
+                                  Interval(0, 5, 50)});
+    ASSERT_EQ(4, v.size());
+    EXPECT_EQ(Interval(0, 0, 10), v[0]);
+    EXPECT_EQ(Interval(0, 5, 50), v[1]);
+    EXPECT_EQ(Interval(0, 80, 100), v[2]);
+    EXPECT_EQ(Interval(1, 10, 20), v[3]);
+}
@@ -18,6 +18,14 @@
 
 #include <limits.h>
 #include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <thread>
 
 #include <android-base/file.h>
 
@@ -35,6 +43,9 @@ using android::base::unique_fd;
 static const int O_NOFOLLOW = 0;
 #endif
 
+// How much of a partition image is read at a time when building images.
+static constexpr size_t kScanBufferSize = 1024 * 1024;
+
 static bool IsEmptySuperImage(borrowed_fd fd) {
     struct stat s;
     if (fstat(fd.get(), &s) < 0) {
@@ -177,6 +188,7 @@ ImageBuilder::ImageBuilder(const LpMetadata& metadata, uint32_t block_size,
         }
         device_images_.emplace_back(std::move(file));
     }
+    device_chunks_.resize(device_images_.size());
 }
 
 bool ImageBuilder::IsValid() const {
@@ -193,13 +205,7 @@ bool ImageBuilder::Export(const std::string& file) {
         LERROR << "Cannot export to a single image on retrofit builds.";
         return false;
     }
-    // No gzip compression; no checksum.
-    int ret = sparse_file_write(device_images_[0].get(), fd, false, sparsify_, false);
-    if (ret != 0) {
-        LERROR << "sparse_file_write failed (error code " << ret << ")";
-        return false;
-    }
-    return true;
+    return WriteDeviceImage(0, fd);
 }
 
 bool ImageBuilder::ExportFiles(const std::string& output_dir) {
@@ -214,31 +220,174 @@ bool ImageBuilder::ExportFiles(const std::string& output_dir) {
             PERROR << "open failed: " << file_path;
             return false;
         }
-        // No gzip compression; no checksum.
-        int ret = sparse_file_write(device_images_[i].get(), fd, false, sparsify_, false);
-        if (ret != 0) {
-            LERROR << "sparse_file_write failed (error code " << ret << ")";
+        if (!WriteDeviceImage(i, fd)) {
             return false;
         }
     }
     return true;
 }
 
-bool ImageBuilder::AddData(sparse_file* file, const std::string& blob, uint64_t sector) {
-    uint32_t block;
-    if (!SectorToBlock(sector, &block)) {
+bool ImageBuilder::WriteDeviceImage(size_t device_index, int fd) {
+#if defined(__linux__)
+    struct stat s;
+    if (!sparsify_ && fstat(fd, &s) == 0 && S_ISREG(s.st_mode)) {
+        return WriteRawDeviceImage(device_index, fd);
+    }
+#endif
+    // No gzip compression; no checksum.
+    int ret = sparse_file_write(device_images_[device_index].get(), fd, false, sparsify_, false);
+    if (ret != 0) {
+        LERROR << "sparse_file_write failed (error code " << ret << ")";
         return false;
     }
-    void* data = const_cast<char*>(blob.data());
-    int ret = sparse_file_add_data(file, data, blob.size(), block);
+    return true;
+}
+
+#if defined(__linux__)
+static constexpr size_t kCopyBufferSize = 1024 * 1024;
+
+static bool WriteFullyAtOffset(int fd, const void* data, size_t size, uint64_t offset) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    while (size) {
+        ssize_t rv = TEMP_FAILURE_RETRY(pwrite64(fd, p, size, offset));
+        if (rv <= 0) {
+            return false;
+        }
+        p += rv;
+        size -= rv;
+        offset += rv;
+    }
+    return true;
+}
+
+static bool CopyFileRange(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset,
+                          uint64_t size, std::vector<uint8_t>* buffer) {
+#if defined(__NR_copy_file_range)
+    // The kernel copies without a round trip through user space, and can share
+    // extents on file systems that support reflinks.
+    while (size) {
+        loff_t in = in_offset;
+        loff_t out = out_offset;
+        ssize_t rv = syscall(__NR_copy_file_range, in_fd, &in, out_fd, &out, size, 0);
+        if (rv <= 0) {
+            break;
+        }
+        in_offset += rv;
+        out_offset += rv;
+        size -= rv;
+    }
+#endif
+
+    // Fall back to copying through a buffer, for example across file systems
+    // on older kernels.
+    buffer->resize(kCopyBufferSize);
+    while (size) {
+        size_t chunk = std::min(size, uint64_t(buffer->size()));
+        if (!android::base::ReadFullyAtOffset(in_fd, buffer->data(), chunk, in_offset)) {
+            PERROR << "read failed";
+            return false;
+        }
+        if (!WriteFullyAtOffset(out_fd, buffer->data(), chunk, out_offset)) {
+            PERROR << "write failed";
+            return false;
+        }
+        in_offset += chunk;
+        out_offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// Write an unsparsed image straight from |device_chunks_|, rather than through
+// libsparse, which reads every fd-backed chunk into a buffer. The output file
+// starts out empty, so zero fills are left as holes.
+bool ImageBuilder::WriteRawDeviceImage(size_t device_index, int fd) {
+    std::vector<uint8_t> buffer;
+    for (const auto& chunk : device_chunks_[device_index]) {
+        uint64_t offset = uint64_t(chunk.block) * block_size_;
+        switch (chunk.type) {
+            case Chunk::Type::kData:
+                if (!WriteFullyAtOffset(fd, chunk.data, chunk.length, offset)) {
+                    PERROR << "write failed";
+                    return false;
+                }
+                break;
+            case Chunk::Type::kFd:
+                if (!CopyFileRange(chunk.fd, chunk.fd_offset, fd, offset, chunk.length, &buffer)) {
+                    return false;
+                }
+                break;
+            case Chunk::Type::kFill: {
+                if (!chunk.fill_value) {
+                    break;
+                }
+                buffer.resize(kCopyBufferSize);
+                uint32_t* words = reinterpret_cast<uint32_t*>(buffer.data());
+                std::fill(words, words + buffer.size() / sizeof(uint32_t), chunk.fill_value);
+                for (uint64_t done = 0; done < chunk.length;) {
+                    size_t size = std::min(chunk.length - done, uint64_t(buffer.size()));
+                    if (!WriteFullyAtOffset(fd, buffer.data(), size, offset + done)) {
+                        PERROR << "write failed";
+                        return false;
+                    }
+                    done += size;
+                }
+                break;
+            }
+        }
+    }
+    if (ftruncate64(fd, metadata_.block_devices[device_index].size) < 0) {
+        PERROR << "ftruncate failed";
+        return false;
+    }
+    return true;
+}
+#endif
+
+bool ImageBuilder::AddChunk(const Chunk& chunk) {
+    sparse_file* file = device_images_[chunk.device_index].get();
+    int ret = 0;
+    switch (chunk.type) {
+        case Chunk::Type::kData:
+            ret = sparse_file_add_data(file, const_cast<void*>(chunk.data), chunk.length,
+                                       chunk.block);
+            if (ret != 0) {
+                LERROR << "sparse_file_add_data failed (error code " << ret << ")";
+            }
+            break;
+        case Chunk::Type::kFd:
+            ret = sparse_file_add_fd(file, chunk.fd, chunk.fd_offset, chunk.length, chunk.block);
+            if (ret != 0) {
+                LERROR << "sparse_file_add_fd failed with code: " << ret;
+            }
+            break;
+        case Chunk::Type::kFill:
+            ret = sparse_file_add_fill(file, chunk.fill_value, chunk.length, chunk.block);
+            if (ret != 0) {
+                LERROR << "sparse_file_add_fill failed with code: " << ret;
+            }
+            break;
+    }
     if (ret != 0) {
-        LERROR << "sparse_file_add_data failed (error code " << ret << ")";
         return false;
     }
+    device_chunks_[chunk.device_index].push_back(chunk);
     return true;
 }
 
-bool ImageBuilder::SectorToBlock(uint64_t sector, uint32_t* block) {
+bool ImageBuilder::AddData(uint32_t device_index, const std::string& blob, uint64_t sector) {
+    Chunk chunk = {};
+    chunk.type = Chunk::Type::kData;
+    chunk.device_index = device_index;
+    chunk.length = blob.size();
+    chunk.data = blob.data();
+    if (!SectorToBlock(sector, &chunk.block)) {
+        return false;
+    }
+    return AddChunk(chunk);
+}
+
+bool ImageBuilder::SectorToBlock(uint64_t sector, uint32_t* block) const {
     // The caller must ensure that the metadata has an alignment that is a
     // multiple of the block size. liblp will take care of the rest, ensuring
     // that all partitions are on an aligned boundary. Therefore all writes
@@ -258,7 +407,10 @@ uint64_t ImageBuilder::BlockToSector(uint64_t block) const {
 }
 
 bool ImageBuilder::Build() {
-    if (sparse_file_add_fill(device_images_[0].get(), 0, LP_PARTITION_RESERVED_BYTES, 0) < 0) {
+    Chunk reserved = {};
+    reserved.type = Chunk::Type::kFill;
+    reserved.length = LP_PARTITION_RESERVED_BYTES;
+    if (!AddChunk(reserved)) {
         LERROR << "Could not add initial sparse block for reserved zeroes";
         return false;
     }
@@ -274,7 +426,7 @@ bool ImageBuilder::Build() {
     }
 
     uint64_t first_sector = LP_PARTITION_RESERVED_BYTES / LP_SECTOR_SIZE;
-    if (!AddData(device_images_[0].get(), all_metadata_, first_sector)) {
+    if (!AddData(0, all_metadata_, first_sector)) {
         return false;
     }
 
@@ -282,15 +434,8 @@ bool ImageBuilder::Build() {
         return false;
     }
 
-    for (const auto& partition : metadata_.partitions) {
-        auto iter = images_.find(GetPartitionName(partition));
-        if (iter == images_.end()) {
-            continue;
-        }
-        if (!AddPartitionImage(partition, iter->second)) {
-            return false;
-        }
-        images_.erase(iter);
+    if (!AddPartitionImages()) {
+        return false;
     }
 
     if (!images_.empty()) {
@@ -300,109 +445,173 @@ bool ImageBuilder::Build() {
     return true;
 }
 
-static inline bool HasFillValue(uint32_t* buffer, size_t count) {
-    uint32_t fill_value = buffer[0];
-    for (size_t i = 1; i < count; i++) {
-        if (fill_value != buffer[i]) {
+// Returns true if |block| is a single repeated 32-bit value. Words are compared
+// 256 bytes at a time without branching, which compiles to vector compares.
+static bool IsFillBlock(const uint8_t* block, size_t size, uint32_t* fill_value) {
+    static constexpr size_t kStride = 256;
+    uint32_t value;
+    memcpy(&value, block, sizeof(value));
+    uint64_t pattern = (uint64_t(value) << 32) | value;
+
+    size_t i = 0;
+    for (; i + kStride <= size; i += kStride) {
+        uint64_t diff = 0;
+        for (size_t j = 0; j < kStride; j += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, block + i + j, sizeof(word));
+            diff |= word ^ pattern;
+        }
+        if (diff) {
             return false;
         }
     }
+    for (; i < size; i += sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, block + i, sizeof(word));
+        if (word != value) {
+            return false;
+        }
+    }
+    *fill_value = value;
     return true;
 }
 
-bool ImageBuilder::AddPartitionImage(const LpMetadataPartition& partition,
-                                     const std::string& file) {
-    // Track which extent we're processing.
-    uint32_t extent_index = partition.first_extent_index;
-
-    const LpMetadataExtent& extent = metadata_.extents[extent_index];
-    if (extent.target_type != LP_TARGET_TYPE_LINEAR) {
+struct ImageBuilder::ScannedImage {
+    bool ok = false;
+    unique_fd fd;
+    std::vector<Chunk> chunks;
+};
+
+// Read a partition image and split it into runs of data blocks and runs of
+// blocks with the same fill value, following the partition's extents. This
+// does not modify the builder, so images can be scanned concurrently.
+auto ImageBuilder::ScanPartitionImage(const LpMetadataPartition& partition,
+                                      const std::string& file) const -> ScannedImage {
+    ScannedImage image;
+
+    const LpMetadataExtent& first_extent = metadata_.extents[partition.first_extent_index];
+    if (first_extent.target_type != LP_TARGET_TYPE_LINEAR) {
         LERROR << "Partition should only have linear extents: " << GetPartitionName(partition);
-        return false;
+        return image;
     }
 
-    int fd = OpenImageFile(file);
-    if (fd < 0) {
+    image.fd = OpenImageFile(file);
+    if (image.fd < 0) {
         LERROR << "Could not open image for partition: " << GetPartitionName(partition);
-        return false;
+        return image;
     }
 
     // Make sure the image does not exceed the partition size.
     uint64_t file_length;
-    if (!GetDescriptorSize(fd, &file_length)) {
+    if (!GetDescriptorSize(image.fd, &file_length)) {
         LERROR << "Could not compute image size";
-        return false;
+        return image;
     }
     uint64_t partition_size = ComputePartitionSize(partition);
     if (file_length > partition_size) {
         LERROR << "Image for partition '" << GetPartitionName(partition)
                << "' is greater than its size (" << file_length << ", expected " << partition_size
                << ")";
-        return false;
-    }
-    if (SeekFile64(fd, 0, SEEK_SET)) {
-        PERROR << "lseek failed";
-        return false;
+        return image;
     }
 
-    // We track the current logical sector and the position the current extent
-    // ends at.
-    uint64_t output_sector = 0;
-    uint64_t extent_last_sector = extent.num_sectors;
-
-    // We also track the output device and the current output block within that
-    // device.
-    uint32_t output_block;
-    if (!SectorToBlock(extent.target_data, &output_block)) {
-        return false;
-    }
-    sparse_file* output_device = device_images_[extent.target_source].get();
+    // Read many blocks at a time. Extents are a multiple of the block size, so
+    // only the final block of the image can be partial.
+    const size_t buffer_size = std::max<size_t>(kScanBufferSize / block_size_, 1) * block_size_;
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[buffer_size]);
 
-    // Proceed to read the file and build sparse images.
+    uint32_t extent_index = partition.first_extent_index;
     uint64_t pos = 0;
-    uint64_t remaining = file_length;
-    while (remaining) {
-        // Check if we need to advance to the next extent.
-        if (output_sector == extent_last_sector) {
-            extent_index++;
-            if (extent_index >= partition.first_extent_index + partition.num_extents) {
-                LERROR << "image is larger than extent table";
-                return false;
+    while (pos < file_length) {
+        if (extent_index >= partition.first_extent_index + partition.num_extents) {
+            LERROR << "image is larger than extent table";
+            return image;
+        }
+        const LpMetadataExtent& extent = metadata_.extents[extent_index++];
+        uint32_t output_block;
+        if (!SectorToBlock(extent.target_data, &output_block)) {
+            return image;
+        }
+        uint64_t extent_end = std::min(file_length, pos + extent.num_sectors * LP_SECTOR_SIZE);
+
+        Chunk run = {};
+        run.device_index = extent.target_source;
+        run.fd = image.fd.get();
+        while (pos < extent_end) {
+            size_t read_size = std::min(uint64_t(buffer_size), extent_end - pos);
+            if (!android::base::ReadFullyAtOffset(image.fd, buffer.get(), read_size, pos)) {
+                PERROR << "read failed";
+                return image;
             }
-
-            const LpMetadataExtent& extent = metadata_.extents[extent_index];
-            extent_last_sector += extent.num_sectors;
-            output_device = device_images_[extent.target_source].get();
-            if (!SectorToBlock(extent.target_data, &output_block)) {
-                return false;
+            for (size_t offset = 0; offset < read_size; offset += block_size_) {
+                size_t length = std::min(size_t(block_size_), read_size - offset);
+                uint32_t fill_value = 0;
+                Chunk::Type type = Chunk::Type::kFd;
+                if (length == block_size_ &&
+                    IsFillBlock(buffer.get() + offset, length, &fill_value)) {
+                    type = Chunk::Type::kFill;
+                }
+                if (run.length && (type != run.type || fill_value != run.fill_value)) {
+                    image.chunks.push_back(run);
+                    run.length = 0;
+                }
+                if (!run.length) {
+                    run.type = type;
+                    run.block = output_block;
+                    run.fd_offset = pos + offset;
+                    run.fill_value = fill_value;
+                }
+                run.length += length;
+                output_block++;
             }
+            pos += read_size;
+        }
+        if (run.length) {
+            image.chunks.push_back(run);
         }
+    }
+    image.ok = true;
+    return image;
+}
 
-        uint32_t buffer[block_size_ / sizeof(uint32_t)];
-        size_t read_size = remaining >= sizeof(buffer) ? sizeof(buffer) : size_t(remaining);
-        if (!android::base::ReadFully(fd, buffer, sizeof(buffer))) {
-            PERROR << "read failed";
+bool ImageBuilder::AddPartitionImages() {
+    // Images are opened and scanned concurrently, but their chunks are added
+    // in partition order so the output does not depend on scheduling.
+    static const size_t kMaxScans = std::max(std::thread::hardware_concurrency(), 1U);
+    std::deque<std::future<ScannedImage>> scans;
+
+    auto add_next_scan = [&]() -> bool {
+        ScannedImage image = scans.front().get();
+        scans.pop_front();
+        if (!image.ok) {
             return false;
         }
-        if (read_size != sizeof(buffer) || !HasFillValue(buffer, read_size / sizeof(uint32_t))) {
-            int rv = sparse_file_add_fd(output_device, fd, pos, read_size, output_block);
-            if (rv) {
-                LERROR << "sparse_file_add_fd failed with code: " << rv;
-                return false;
-            }
-        } else {
-            int rv = sparse_file_add_fill(output_device, buffer[0], read_size, output_block);
-            if (rv) {
-                LERROR << "sparse_file_add_fill failed with code: " << rv;
+        temp_fds_.push_back(std::move(image.fd));
+        for (const auto& chunk : image.chunks) {
+            if (!AddChunk(chunk)) {
                 return false;
             }
         }
-        pos += read_size;
-        remaining -= read_size;
-        output_sector += block_size_ / LP_SECTOR_SIZE;
-        output_block++;
-    }
+        return true;
+    };
 
+    for (const auto& partition : metadata_.partitions) {
+        auto iter = images_.find(GetPartitionName(partition));
+        if (iter == images_.end()) {
+            continue;
+        }
+        if (scans.size() >= kMaxScans && !add_next_scan()) {
+            return false;
+        }
+        scans.push_back(std::async(std::launch::async, &ImageBuilder::ScanPartitionImage, this,
+                                   std::cref(partition), iter->second));
+        images_.erase(iter);
+    }
+    while (!scans.empty()) {
+        if (!add_next_scan()) {
+            return false;
+        }
+    }
     return true;
 }
 
@@ -442,34 +651,31 @@ bool ImageBuilder::CheckExtentOrdering() {
     return true;
 }
 
-int ImageBuilder::OpenImageFile(const std::string& file) {
+unique_fd ImageBuilder::OpenImageFile(const std::string& file) const {
     unique_fd source_fd = GetControlFileOrOpen(file.c_str(), O_RDONLY | O_CLOEXEC | O_BINARY);
     if (source_fd < 0) {
         PERROR << "open image file failed: " << file;
-        return -1;
+        return {};
     }
 
     SparsePtr source(sparse_file_import(source_fd, true, true), sparse_file_destroy);
     if (!source) {
-        int fd = source_fd.get();
-        temp_fds_.push_back(std::move(source_fd));
-        return fd;
+        return source_fd;
     }
 
     TemporaryFile tf;
     if (tf.fd < 0) {
         PERROR << "make temporary file failed";
-        return -1;
+        return {};
     }
 
     // We temporarily unsparse the file, rather than try to merge its chunks.
     int rv = sparse_file_write(source.get(), tf.fd, false, false, false);
     if (rv) {
         LERROR << "sparse_file_write failed with code: " << rv;
-        return -1;
+        return {};
     }
-    temp_fds_.push_back(android::base::unique_fd(tf.release()));
-    return temp_fds_.back().get();
+    return unique_fd(tf.release());
 }
 
 bool WriteToImageFile(const std::string& file, const LpMetadata& metadata, uint32_t block_size,
@@ -18,6 +18,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 #include <liblp/liblp.h>
@@ -47,13 +48,33 @@ class ImageBuilder {
     const std::vector<SparsePtr>& device_images() const { return device_images_; }
 
   private:
-    bool AddData(sparse_file* file, const std::string& blob, uint64_t sector);
-    bool AddPartitionImage(const LpMetadataPartition& partition, const std::string& file);
-    int OpenImageFile(const std::string& file);
-    bool SectorToBlock(uint64_t sector, uint32_t* block);
+    // A run of blocks destined for one block device: either a buffer, a
+    // range of an image file, or a repeated 32-bit value.
+    struct Chunk {
+        enum class Type { kData, kFd, kFill };
+        Type type;
+        uint32_t device_index;
+        uint32_t block;
+        uint64_t length;
+        const void* data;
+        int fd;
+        uint64_t fd_offset;
+        uint32_t fill_value;
+    };
+    struct ScannedImage;
+
+    bool AddChunk(const Chunk& chunk);
+    bool AddData(uint32_t device_index, const std::string& blob, uint64_t sector);
+    ScannedImage ScanPartitionImage(const LpMetadataPartition& partition,
+                                    const std::string& file) const;
+    bool AddPartitionImages();
+    android::base::unique_fd OpenImageFile(const std::string& file) const;
+    bool SectorToBlock(uint64_t sector, uint32_t* block) const;
     uint64_t BlockToSector(uint64_t block) const;
     bool CheckExtentOrdering();
     uint64_t ComputePartitionSize(const LpMetadataPartition& partition) const;
+    bool WriteDeviceImage(size_t device_index, int fd);
+    bool WriteRawDeviceImage(size_t device_index, int fd);
 
     const LpMetadata& metadata_;
     const LpMetadataGeometry& geometry_;
@@ -61,6 +82,9 @@ class ImageBuilder {
     bool sparsify_;
 
     std::vector<SparsePtr> device_images_;
+    // Everything added to |device_images_|, so that raw images can be written
+    // without reading fd-backed chunks through libsparse.
+    std::vector<std::vector<Chunk>> device_chunks_;
     std::string all_metadata_;
     std::map<std::string, std::string> images_;
     std::vector<android::base::unique_fd> temp_fds_;
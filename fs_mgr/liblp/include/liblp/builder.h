@@ -25,6 +25,7 @@
 #include <optional>
 #include <set>
 #include <string_view>
+#include <unordered_map>
 
 #include "liblp.h"
 #include "partition_opener.h"
@@ -155,12 +156,17 @@ class Partition final {
   private:
     void ShrinkTo(uint64_t aligned_size);
     void set_group_name(std::string_view group_name) { group_name_ = group_name; }
+    // Called whenever |extents_| changes.
+    void BumpGeneration();
 
     std::string name_;
     std::string group_name_;
     std::vector<std::unique_ptr<Extent>> extents_;
     uint32_t attributes_;
     uint64_t size_;
+    // Unique across all partitions, so MetadataBuilder can tell whether the
+    // extents changed since it last indexed them.
+    uint64_t generation_;
 };
 
 // An interval in the metadata. This is similar to a LinearExtent with one difference.
@@ -187,11 +193,27 @@ struct Interval {
     // If no intersection, result has 0 length().
     static Interval Intersect(const Interval& a, const Interval& b);
 
-    // Intersect two lists of intervals, and store result to |a|.
+    // Intersect two lists of intervals, and store result to |a|. The result
+    // follows the order of |a|; intersections with a single interval of |a|
+    // are ordered by start sector.
     static std::vector<Interval> Intersect(const std::vector<Interval>& a,
                                            const std::vector<Interval>& b);
 };
 
+// How GrowPartition() picks free regions. Regardless of the policy, regions
+// in the preferred half of super are tried first (see ShouldHalveSuper()).
+enum class AllocationPolicy {
+    // Take free regions in order until the partition is large enough. This is
+    // the default.
+    kFirstFit,
+    // Use the first free region that can hold all of the new space, so the
+    // partition only gains one extent. Falls back to kFirstFit.
+    kContiguousFirst,
+    // Use the smallest free region that can hold all of the new space, which
+    // keeps large regions intact. Falls back to kFirstFit.
+    kBestFit,
+};
+
 class MetadataBuilder {
   public:
     // Construct an empty logical partition table builder given the specified
@@ -344,6 +366,8 @@ class MetadataBuilder {
 
     // Set the LP_METADATA_AUTO_SLOT_SUFFIXING flag.
     void SetAutoSlotSuffixing();
+    // Set how free regions are chosen when growing partitions.
+    void SetAllocationPolicy(AllocationPolicy policy);
     // Set the LP_HEADER_FLAG_VIRTUAL_AB_DEVICE flag.
     void SetVirtualABDeviceFlag();
 
@@ -406,12 +430,18 @@ class MetadataBuilder {
     bool IsAnyRegionCovered(const std::vector<Interval>& regions,
                             const LinearExtent& candidate) const;
     bool IsAnyRegionAllocated(const LinearExtent& candidate) const;
-    void ExtentsToFreeList(const std::vector<Interval>& extents,
-                           std::vector<Interval>* free_regions) const;
-    std::vector<Interval> PrioritizeSecondHalfOfSuper(const std::vector<Interval>& free_list);
+    std::vector<Interval> PrioritizeSecondHalfOfSuper(const std::vector<Interval>& free_list,
+                                                      size_t* num_preferred = nullptr);
     std::unique_ptr<LinearExtent> ExtendFinalExtent(Partition* partition,
                                                     const std::vector<Interval>& free_list,
                                                     uint64_t sectors_needed) const;
+    const Interval* FindContiguousRegion(const std::vector<Interval>& free_list, size_t begin,
+                                         size_t end, uint64_t sectors_needed) const;
+    void SyncAllocatedExtents() const;
+    void IndexExtent(const Interval& interval) const;
+    void UnindexExtent(const Interval& interval) const;
+    std::optional<Interval> FreeRegionBetween(const Interval& previous,
+                                              const Interval& next) const;
 
     static bool UpdateMetadataForOtherSuper(LpMetadata* metadata, uint32_t source_slot_number,
                                             uint32_t target_slot_number);
@@ -422,6 +452,25 @@ class MetadataBuilder {
     std::vector<std::unique_ptr<PartitionGroup>> groups_;
     std::vector<LpMetadataBlockDevice> block_devices_;
     bool auto_slot_suffixing_;
+    AllocationPolicy allocation_policy_;
+
+    // Index of the linear extents of all partitions, and of the free regions
+    // between them, per block device. SyncAllocatedExtents() brings it up to
+    // date before use, and only re-indexes partitions whose generation changed.
+    struct DeviceIndex {
+        LpMetadataBlockDevice block_device;
+        // Extents sorted by start sector, plus 0-length intervals at the first
+        // and last logical sectors.
+        std::multiset<Interval> extents;
+        // Free space between two consecutive extents, keyed by the second one.
+        std::multimap<Interval, Interval> free_regions;
+    };
+    struct IndexedPartition {
+        uint64_t generation;
+        std::vector<Interval> intervals;
+    };
+    mutable std::vector<DeviceIndex> device_indices_;
+    mutable std::unordered_map<const Partition*, IndexedPartition> indexed_partitions_;
 };
 
 // Read BlockDeviceInfo for a given block device. This always returns false
@@ -22,7 +22,11 @@
 
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 
@@ -43,6 +47,77 @@ struct LpMetadata {
     std::vector<LpMetadataBlockDevice> block_devices;
 };
 
+class Reader;
+
+// Read-only view of validated metadata. Unlike LpMetadata, the tables are not
+// copied out of the buffer they were read into, and partitions can be looked
+// up by name without a linear scan.
+//
+// Table entries are exposed exactly as stored on disk. If the view was read
+// for a slot, the name helpers below apply the slot suffix to entries flagged
+// as slot-suffixed, matching what ReadMetadata() returns.
+class LpMetadataView final {
+  public:
+    const LpMetadataGeometry& geometry() const { return geometry_; }
+    const LpMetadataHeader& header() const { return header_; }
+
+    uint32_t partition_count() const { return header_.partitions.num_entries; }
+    uint32_t extent_count() const { return header_.extents.num_entries; }
+    uint32_t group_count() const { return header_.groups.num_entries; }
+    uint32_t block_device_count() const { return header_.block_devices.num_entries; }
+
+    const LpMetadataPartition& partition(uint32_t index) const {
+        return Entry<LpMetadataPartition>(header_.partitions, index);
+    }
+    const LpMetadataExtent& extent(uint32_t index) const {
+        return Entry<LpMetadataExtent>(header_.extents, index);
+    }
+    const LpMetadataPartitionGroup& group(uint32_t index) const {
+        return Entry<LpMetadataPartitionGroup>(header_.groups, index);
+    }
+    const LpMetadataBlockDevice& block_device(uint32_t index) const {
+        return Entry<LpMetadataBlockDevice>(header_.block_devices, index);
+    }
+
+    // Names with the slot suffix applied, if any.
+    std::string GetPartitionName(const LpMetadataPartition& partition) const;
+    std::string GetPartitionGroupName(const LpMetadataPartitionGroup& group) const;
+    std::string GetBlockDevicePartitionName(const LpMetadataBlockDevice& block_device) const;
+
+    // Find a partition by its (slot-suffixed) name; returns null if none
+    // matches. The first call builds a name index, so views that are only
+    // converted with ToLpMetadata() never pay for it.
+    const LpMetadataPartition* FindPartition(std::string_view name) const;
+    uint64_t GetPartitionSize(const LpMetadataPartition& partition) const;
+
+    // Copy the view into an LpMetadata, with slot suffixes applied.
+    std::unique_ptr<LpMetadata> ToLpMetadata() const;
+
+  private:
+    friend std::unique_ptr<LpMetadataView> ParseMetadataView(const LpMetadataGeometry& geometry,
+                                                             Reader* reader,
+                                                             const std::string& slot_suffix);
+
+    LpMetadataView() = default;
+
+    void BuildPartitionIndex() const;
+
+    template <typename T>
+    const T& Entry(const LpMetadataTableDescriptor& table, uint32_t index) const {
+        return *reinterpret_cast<const T*>(tables_.get() + table.offset +
+                                           size_t(index) * table.entry_size);
+    }
+
+    LpMetadataGeometry geometry_;
+    LpMetadataHeader header_;
+    std::unique_ptr<uint8_t[]> tables_;
+    std::string slot_suffix_;
+    // Unsuffixed partition name, pointing into |tables_|, to partition index.
+    // Built by the first FindPartition().
+    mutable std::once_flag partition_index_once_;
+    mutable std::unordered_map<std::string_view, uint32_t> partition_index_;
+};
+
 // Place an initial partition table on the device. This will overwrite the
 // existing geometry, and should not be used for normal partition table
 // updates. False can be returned if the geometry is incompatible with the
@@ -70,6 +145,14 @@ bool UpdatePartitionTable(const std::string& super_partition, const LpMetadata&
                           uint32_t slot_number);
 std::unique_ptr<LpMetadata> ReadMetadata(const std::string& super_partition, uint32_t slot_number);
 
+// Same as ReadMetadata(), but returns a view over the tables as read from
+// disk instead of copying them into an LpMetadata.
+std::unique_ptr<LpMetadataView> ReadMetadataView(const IPartitionOpener& opener,
+                                                 const std::string& super_partition,
+                                                 uint32_t slot_number);
+std::unique_ptr<LpMetadataView> ReadMetadataView(const std::string& super_partition,
+                                                 uint32_t slot_number);
+
 // Returns whether an image is an "empty" image or not. An empty image contains
 // only metadata. Unlike a flashed block device, there are no reserved bytes or
 // backup sections, and only one slot is stored (even if multiple slots are
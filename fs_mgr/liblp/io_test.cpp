@@ -623,6 +623,53 @@ TEST_F(LiblpTest, FlashSparseImage) {
     ASSERT_NE(ReadBackupMetadata(fd.get(), geometry, 0), nullptr);
 }
 
+// Test that an unsparsed image matches the sparse image, including partition
+// contents that end with a partial block.
+TEST_F(LiblpTest, ExportRawImage) {
+    BlockDeviceInfo device_info("super", kDiskSize, 0, 0, 512);
+    unique_ptr<MetadataBuilder> builder =
+            MetadataBuilder::New(device_info, kMetadataSize, kMetadataSlots);
+    ASSERT_NE(builder, nullptr);
+    ASSERT_TRUE(AddDefaultPartitions(builder.get()));
+    unique_ptr<LpMetadata> exported = builder->Export();
+    ASSERT_NE(exported, nullptr);
+
+    // Zeroes, a fill pattern, then data ending mid-block.
+    std::string contents(4096, '\0');
+    contents += std::string(4096, '\x11');
+    for (size_t i = 0; i < 10000; i++) {
+        contents += static_cast<char>(i * 7);
+    }
+    TemporaryFile image;
+    ASSERT_GE(image.fd, 0);
+    ASSERT_TRUE(android::base::WriteFully(image.fd, contents.data(), contents.size()));
+
+    std::map<std::string, std::string> images = {{"system", image.path}};
+    ImageBuilder raw(*exported.get(), 512, images, false /* sparsify */);
+    ASSERT_TRUE(raw.IsValid());
+    ASSERT_TRUE(raw.Build());
+    TemporaryFile raw_file;
+    ASSERT_TRUE(raw.Export(raw_file.path));
+
+    ImageBuilder sparse(*exported.get(), 512, images, true /* sparsify */);
+    ASSERT_TRUE(sparse.IsValid());
+    ASSERT_TRUE(sparse.Build());
+    unique_fd sparse_fd(syscall(__NR_memfd_create, "sparse_image", 0));
+    ASSERT_GE(sparse_fd, 0);
+    ASSERT_EQ(sparse_file_write(sparse.device_images()[0].get(), sparse_fd, false, false, false), 0);
+
+    unique_fd raw_fd(open(raw_file.path, O_RDONLY | O_CLOEXEC));
+    ASSERT_GE(raw_fd, 0);
+    std::string raw_data(kDiskSize, '\0');
+    std::string sparse_data(kDiskSize, '\0');
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(raw_fd, raw_data.data(), kDiskSize, 0));
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(sparse_fd, sparse_data.data(), kDiskSize, 0));
+    EXPECT_EQ(raw_data, sparse_data);
+
+    const auto& extent = exported->extents[exported->partitions[0].first_extent_index];
+    EXPECT_EQ(raw_data.substr(extent.target_data * LP_SECTOR_SIZE, contents.size()), contents);
+}
+
 TEST_F(LiblpTest, AutoSlotSuffixing) {
     unique_ptr<MetadataBuilder> builder = CreateDefaultBuilder();
     ASSERT_NE(builder, nullptr);
@@ -666,6 +713,54 @@ TEST_F(LiblpTest, AutoSlotSuffixing) {
     EXPECT_EQ(metadata->groups[1].flags, 0);
 }
 
+TEST_F(LiblpTest, ReadMetadataView) {
+    unique_ptr<MetadataBuilder> builder = CreateDefaultBuilder();
+    ASSERT_NE(builder, nullptr);
+    ASSERT_TRUE(AddDefaultPartitions(builder.get()));
+    ASSERT_TRUE(builder->AddGroup("example", 0));
+    ASSERT_NE(builder->AddPartition("vendor_b", "example", LP_PARTITION_ATTR_READONLY), nullptr);
+    builder->SetAutoSlotSuffixing();
+
+    auto fd = CreateFakeDisk();
+    ASSERT_GE(fd, 0);
+
+    TestPartitionOpener opener({{"super_a", fd}, {"super_b", fd}},
+                               {{"super_a", kSuperInfo}, {"super_b", kSuperInfo}});
+    auto exported = builder->Export();
+    ASSERT_NE(exported, nullptr);
+    ASSERT_TRUE(FlashPartitionTable(opener, "super_a", *exported.get()));
+
+    auto view = ReadMetadataView(opener, "super_a", 0);
+    ASSERT_NE(view, nullptr);
+    ASSERT_EQ(view->partition_count(), 2u);
+    ASSERT_EQ(view->group_count(), 2u);
+    ASSERT_EQ(view->block_device_count(), 1u);
+
+    // Entries are in place and keep their on-disk names and flags.
+    EXPECT_EQ(GetPartitionName(view->partition(0)), "system");
+    EXPECT_EQ(view->GetPartitionName(view->partition(0)), "system_a");
+    EXPECT_EQ(view->GetPartitionGroupName(view->group(1)), "example_a");
+    EXPECT_EQ(view->GetBlockDevicePartitionName(view->block_device(0)), "super_a");
+
+    EXPECT_EQ(view->FindPartition("system_a"), &view->partition(0));
+    EXPECT_EQ(view->FindPartition("system"), nullptr);
+    EXPECT_EQ(view->FindPartition("system_b"), nullptr);
+    EXPECT_EQ(view->FindPartition("vendor_b_a"), &view->partition(1));
+    EXPECT_EQ(view->FindPartition("vendor_b"), nullptr);
+
+    // Copying the view out must match ReadMetadata() exactly.
+    auto metadata = ReadMetadata(opener, "super_a", 0);
+    ASSERT_NE(metadata, nullptr);
+    auto copied = view->ToLpMetadata();
+    ASSERT_NE(copied, nullptr);
+    EXPECT_EQ(SerializeMetadata(*copied.get()), SerializeMetadata(*metadata.get()));
+    for (const auto& partition : metadata->partitions) {
+        auto found = view->FindPartition(GetPartitionName(partition));
+        ASSERT_NE(found, nullptr);
+        EXPECT_EQ(view->GetPartitionSize(*found), GetPartitionSize(*metadata.get(), partition));
+    }
+}
+
 TEST_F(LiblpTest, UpdateRetrofit) {
     ON_CALL(*GetMockedPropertyFetcher(), GetBoolProperty("ro.boot.dynamic_partitions_retrofit", _))
             .WillByDefault(Return(true));
@@ -22,6 +22,7 @@
 #include <unistd.h>
 
 #include <functional>
+#include <string_view>
 
 #include <android-base/file.h>
 #include <android-base/unique_fd.h>
@@ -164,9 +165,9 @@ static bool ValidateTableBounds(const LpMetadataHeader& header,
     return true;
 }
 
-static bool ReadMetadataHeader(Reader* reader, LpMetadata* metadata) {
+static bool ReadMetadataHeader(Reader* reader, LpMetadataHeader* out) {
     // Note we zero the struct since older files will result in a partial read.
-    LpMetadataHeader& header = metadata->header;
+    LpMetadataHeader& header = *out;
     memset(&header, 0, sizeof(header));
 
     if (!reader->ReadFully(&header, sizeof(LpMetadataHeaderV1_0))) {
@@ -238,22 +239,41 @@ static bool ReadMetadataHeader(Reader* reader, LpMetadata* metadata) {
         LERROR << "Logical partition metadata has invalid group table entry size.";
         return false;
     }
+    // Block device entries are read in place, so they must be at least as
+    // large as the struct.
+    if (header.block_devices.num_entries &&
+        header.block_devices.entry_size < sizeof(LpMetadataBlockDevice)) {
+        LERROR << "Logical partition metadata has invalid block device table entry size.";
+        return false;
+    }
     return true;
 }
 
+static std::string_view NameFromFixedArrayView(const char* name, size_t buffer_size) {
+    return std::string_view(name, strnlen(name, buffer_size));
+}
+
+static bool CheckSuffixedNameLength(const char* name, size_t buffer_size,
+                                    const std::string& slot_suffix) {
+    return NameFromFixedArrayView(name, buffer_size).size() + slot_suffix.size() <= buffer_size;
+}
+
 // Parse and validate all metadata at the current position in the given file
-// descriptor.
-static std::unique_ptr<LpMetadata> ParseMetadata(const LpMetadataGeometry& geometry,
-                                                 Reader* reader) {
+// descriptor. The tables are read with a single read and validated in place.
+// If |slot_suffix| is not empty, names of slot-suffixed entries must have room
+// for the suffix.
+std::unique_ptr<LpMetadataView> ParseMetadataView(const LpMetadataGeometry& geometry,
+                                                  Reader* reader, const std::string& slot_suffix) {
     // First read and validate the header.
-    std::unique_ptr<LpMetadata> metadata = std::make_unique<LpMetadata>();
+    std::unique_ptr<LpMetadataView> view(new LpMetadataView());
 
-    metadata->geometry = geometry;
-    if (!ReadMetadataHeader(reader, metadata.get())) {
+    view->geometry_ = geometry;
+    view->slot_suffix_ = slot_suffix;
+    if (!ReadMetadataHeader(reader, &view->header_)) {
         return nullptr;
     }
 
-    LpMetadataHeader& header = metadata->header;
+    const LpMetadataHeader& header = view->header_;
 
     // Check the table size.
     if (header.tables_size > geometry.metadata_max_size) {
@@ -263,35 +283,32 @@ static std::unique_ptr<LpMetadata> ParseMetadata(const LpMetadataGeometry& geome
 
     // Read the metadata payload. Allocation is fallible since the table size
     // could be large.
-    std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[header.tables_size]);
-    if (!buffer) {
+    view->tables_.reset(new (std::nothrow) uint8_t[header.tables_size]);
+    if (!view->tables_) {
         LERROR << "Out of memory reading logical partition tables.";
         return nullptr;
     }
-    if (!reader->ReadFully(buffer.get(), header.tables_size)) {
+    if (!reader->ReadFully(view->tables_.get(), header.tables_size)) {
         PERROR << __PRETTY_FUNCTION__ << " read " << header.tables_size << "bytes failed";
         return nullptr;
     }
 
     uint8_t checksum[32];
-    SHA256(buffer.get(), header.tables_size, checksum);
+    SHA256(view->tables_.get(), header.tables_size, checksum);
     if (memcmp(checksum, header.tables_checksum, sizeof(checksum)) != 0) {
         LERROR << "Logical partition metadata has invalid table checksum.";
         return nullptr;
     }
 
     uint32_t valid_attributes = LP_PARTITION_ATTRIBUTE_MASK_V0;
-    if (metadata->header.minor_version >= LP_METADATA_VERSION_FOR_UPDATED_ATTR) {
+    if (header.minor_version >= LP_METADATA_VERSION_FOR_UPDATED_ATTR) {
         valid_attributes |= LP_PARTITION_ATTRIBUTE_MASK_V1;
     }
 
-    // ValidateTableSize ensured that |cursor| is valid for the number of
-    // entries in the table.
-    uint8_t* cursor = buffer.get() + header.partitions.offset;
-    for (size_t i = 0; i < header.partitions.num_entries; i++) {
-        LpMetadataPartition partition;
-        memcpy(&partition, cursor, sizeof(partition));
-        cursor += header.partitions.entry_size;
+    // ReadMetadataHeader validated the table bounds and entry sizes, so every
+    // entry below lies within |tables_|.
+    for (uint32_t i = 0; i < header.partitions.num_entries; i++) {
+        const LpMetadataPartition& partition = view->partition(i);
 
         if (partition.attributes & ~valid_attributes) {
             LERROR << "Logical partition has invalid attribute set.";
@@ -309,57 +326,67 @@ static std::unique_ptr<LpMetadata> ParseMetadata(const LpMetadataGeometry& geome
             LERROR << "Logical partition has invalid group index.";
             return nullptr;
         }
-
-        metadata->partitions.push_back(partition);
+        if ((partition.attributes & LP_PARTITION_ATTR_SLOT_SUFFIXED) &&
+            !CheckSuffixedNameLength(partition.name, sizeof(partition.name), slot_suffix)) {
+            LERROR << __PRETTY_FUNCTION__ << " partition name too long: "
+                   << view->GetPartitionName(partition);
+            return nullptr;
+        }
     }
 
-    cursor = buffer.get() + header.extents.offset;
-    for (size_t i = 0; i < header.extents.num_entries; i++) {
-        LpMetadataExtent extent;
-        memcpy(&extent, cursor, sizeof(extent));
-        cursor += header.extents.entry_size;
-
+    for (uint32_t i = 0; i < header.extents.num_entries; i++) {
+        const LpMetadataExtent& extent = view->extent(i);
         if (extent.target_type == LP_TARGET_TYPE_LINEAR &&
             extent.target_source >= header.block_devices.num_entries) {
             LERROR << "Logical partition extent has invalid block device.";
             return nullptr;
         }
-
-        metadata->extents.push_back(extent);
     }
 
-    cursor = buffer.get() + header.groups.offset;
-    for (size_t i = 0; i < header.groups.num_entries; i++) {
-        LpMetadataPartitionGroup group = {};
-        memcpy(&group, cursor, sizeof(group));
-        cursor += header.groups.entry_size;
-
-        metadata->groups.push_back(group);
+    for (uint32_t i = 0; i < header.groups.num_entries; i++) {
+        const LpMetadataPartitionGroup& group = view->group(i);
+        if ((group.flags & LP_GROUP_SLOT_SUFFIXED) &&
+            !CheckSuffixedNameLength(group.name, sizeof(group.name), slot_suffix)) {
+            LERROR << __PRETTY_FUNCTION__ << " group name too long: "
+                   << view->GetPartitionGroupName(group);
+            return nullptr;
+        }
     }
 
-    cursor = buffer.get() + header.block_devices.offset;
-    for (size_t i = 0; i < header.block_devices.num_entries; i++) {
-        LpMetadataBlockDevice device = {};
-        memcpy(&device, cursor, sizeof(device));
-        cursor += header.block_devices.entry_size;
-
-        metadata->block_devices.push_back(device);
+    for (uint32_t i = 0; i < header.block_devices.num_entries; i++) {
+        const LpMetadataBlockDevice& device = view->block_device(i);
+        if ((device.flags & LP_BLOCK_DEVICE_SLOT_SUFFIXED) &&
+            !CheckSuffixedNameLength(device.partition_name, sizeof(device.partition_name),
+                                     slot_suffix)) {
+            LERROR << __PRETTY_FUNCTION__ << " partition name too long: "
+                   << view->GetBlockDevicePartitionName(device);
+            return nullptr;
+        }
     }
 
-    const LpMetadataBlockDevice* super_device = GetMetadataSuperBlockDevice(*metadata.get());
-    if (!super_device) {
+    if (!header.block_devices.num_entries) {
         LERROR << "Metadata does not specify a super device.";
         return nullptr;
     }
+    const LpMetadataBlockDevice& super_device = view->block_device(0);
 
     // Check that the metadata area and logical partition areas don't overlap.
     uint64_t metadata_region =
             GetTotalMetadataSize(geometry.metadata_max_size, geometry.metadata_slot_count);
-    if (metadata_region > super_device->first_logical_sector * LP_SECTOR_SIZE) {
+    if (metadata_region > super_device.first_logical_sector * LP_SECTOR_SIZE) {
         LERROR << "Logical partition metadata overlaps with logical partition contents.";
         return nullptr;
     }
-    return metadata;
+    return view;
+}
+
+static std::unique_ptr<LpMetadata> ParseMetadata(const LpMetadataGeometry& geometry,
+                                                 Reader* reader) {
+    std::unique_ptr<LpMetadataView> view = ParseMetadataView(geometry, reader, {});
+    if (!view) {
+        return nullptr;
+    }
+    return view->ToLpMetadata();
 }
 
 std::unique_ptr<LpMetadata> ParseMetadata(const LpMetadataGeometry& geometry, const void* buffer,
@@ -395,8 +422,7 @@ std::unique_ptr<LpMetadata> ReadBackupMetadata(int fd, const LpMetadataGeometry&
 
 namespace {
 
-bool AdjustMetadataForSlot(LpMetadata* metadata, uint32_t slot_number) {
-    std::string slot_suffix = SlotSuffixForSlotNumber(slot_number);
+bool AdjustMetadataForSlot(LpMetadata* metadata, const std::string& slot_suffix) {
     for (auto& partition : metadata->partitions) {
         if (!(partition.attributes & LP_PARTITION_ATTR_SLOT_SUFFIXED)) {
             continue;
@@ -436,8 +462,9 @@ bool AdjustMetadataForSlot(LpMetadata* metadata, uint32_t slot_number) {
 
 }  // namespace
 
-std::unique_ptr<LpMetadata> ReadMetadata(const IPartitionOpener& opener,
-                                         const std::string& super_partition, uint32_t slot_number) {
+std::unique_ptr<LpMetadataView> ReadMetadataView(const IPartitionOpener& opener,
+                                                 const std::string& super_partition,
+                                                 uint32_t slot_number) {
     android::base::unique_fd fd = opener.Open(super_partition, O_RDONLY);
     if (fd < 0) {
         PERROR << __PRETTY_FUNCTION__ << " open failed: " << super_partition;
@@ -457,21 +484,33 @@ std::unique_ptr<LpMetadata> ReadMetadata(const IPartitionOpener& opener,
             GetPrimaryMetadataOffset(geometry, slot_number),
             GetBackupMetadataOffset(geometry, slot_number),
     };
-    std::unique_ptr<LpMetadata> metadata;
+    std::string slot_suffix = SlotSuffixForSlotNumber(slot_number);
 
     for (const auto& offset : offsets) {
         if (SeekFile64(fd, offset, SEEK_SET) < 0) {
             PERROR << __PRETTY_FUNCTION__ << " lseek failed, offset " << offset;
             continue;
         }
-        if ((metadata = ParseMetadata(geometry, fd)) != nullptr) {
-            break;
+        FileReader reader(fd);
+        if (auto view = ParseMetadataView(geometry, &reader, slot_suffix)) {
+            return view;
         }
     }
-    if (!metadata || !AdjustMetadataForSlot(metadata.get(), slot_number)) {
+    return nullptr;
+}
+
+std::unique_ptr<LpMetadataView> ReadMetadataView(const std::string& super_partition,
+                                                 uint32_t slot_number) {
+    return ReadMetadataView(PartitionOpener(), super_partition, slot_number);
+}
+
+std::unique_ptr<LpMetadata> ReadMetadata(const IPartitionOpener& opener,
+                                         const std::string& super_partition, uint32_t slot_number) {
+    std::unique_ptr<LpMetadataView> view = ReadMetadataView(opener, super_partition, slot_number);
+    if (!view) {
         return nullptr;
     }
-    return metadata;
+    return view->ToLpMetadata();
 }
 
 std::unique_ptr<LpMetadata> ReadMetadata(const std::string& super_partition, uint32_t slot_number) {
@@ -500,5 +539,102 @@ std::string GetBlockDevicePartitionName(const LpMetadataBlockDevice& block_devic
     return NameFromFixedArray(block_device.partition_name, sizeof(block_device.partition_name));
 }
 
+std::string LpMetadataView::GetPartitionName(const LpMetadataPartition& partition) const {
+    std::string name = fs_mgr::GetPartitionName(partition);
+    if (partition.attributes & LP_PARTITION_ATTR_SLOT_SUFFIXED) {
+        name += slot_suffix_;
+    }
+    return name;
+}
+
+std::string LpMetadataView::GetPartitionGroupName(const LpMetadataPartitionGroup& group) const {
+    std::string name = fs_mgr::GetPartitionGroupName(group);
+    if (group.flags & LP_GROUP_SLOT_SUFFIXED) {
+        name += slot_suffix_;
+    }
+    return name;
+}
+
+std::string LpMetadataView::GetBlockDevicePartitionName(
+        const LpMetadataBlockDevice& block_device) const {
+    std::string name = fs_mgr::GetBlockDevicePartitionName(block_device);
+    if (block_device.flags & LP_BLOCK_DEVICE_SLOT_SUFFIXED) {
+        name += slot_suffix_;
+    }
+    return name;
+}
+
+void LpMetadataView::BuildPartitionIndex() const {
+    partition_index_.reserve(partition_count());
+    for (uint32_t i = 0; i < partition_count(); i++) {
+        const LpMetadataPartition& entry = partition(i);
+        // Like a linear search, the first partition with a given name wins.
+        partition_index_.emplace(NameFromFixedArrayView(entry.name, sizeof(entry.name)), i);
+    }
+}
+
+const LpMetadataPartition* LpMetadataView::FindPartition(std::string_view name) const {
+    std::call_once(partition_index_once_, [this]() { BuildPartitionIndex(); });
+
+    // A partition matches either by its plain name, or, if it is slot-suffixed,
+    // by its name plus the suffix. With no suffix both forms are the same.
+    auto it = partition_index_.find(name);
+    if (it != partition_index_.end()) {
+        const LpMetadataPartition& candidate = partition(it->second);
+        if (slot_suffix_.empty() || !(candidate.attributes & LP_PARTITION_ATTR_SLOT_SUFFIXED)) {
+            return &candidate;
+        }
+    }
+    if (slot_suffix_.empty() || name.size() < slot_suffix_.size() ||
+        name.substr(name.size() - slot_suffix_.size()) != slot_suffix_) {
+        return nullptr;
+    }
+    it = partition_index_.find(name.substr(0, name.size() - slot_suffix_.size()));
+    if (it != partition_index_.end()) {
+        const LpMetadataPartition& candidate = partition(it->second);
+        if (candidate.attributes & LP_PARTITION_ATTR_SLOT_SUFFIXED) {
+            return &candidate;
+        }
+    }
+    return nullptr;
+}
+
+uint64_t LpMetadataView::GetPartitionSize(const LpMetadataPartition& partition) const {
+    uint64_t total_size = 0;
+    for (uint32_t i = 0; i < partition.num_extents; i++) {
+        total_size += extent(partition.first_extent_index + i).num_sectors * LP_SECTOR_SIZE;
+    }
+    return total_size;
+}
+
+std::unique_ptr<LpMetadata> LpMetadataView::ToLpMetadata() const {
+    std::unique_ptr<LpMetadata> metadata = std::make_unique<LpMetadata>();
+    metadata->geometry = geometry_;
+    metadata->header = header_;
+
+    metadata->partitions.reserve(partition_count());
+    for (uint32_t i = 0; i < partition_count(); i++) {
+        metadata->partitions.push_back(partition(i));
+    }
+    metadata->extents.reserve(extent_count());
+    for (uint32_t i = 0; i < extent_count(); i++) {
+        metadata->extents.push_back(extent(i));
+    }
+    metadata->groups.reserve(group_count());
+    for (uint32_t i = 0; i < group_count(); i++) {
+        metadata->groups.push_back(group(i));
+    }
+    metadata->block_devices.reserve(block_device_count());
+    for (uint32_t i = 0; i < block_device_count(); i++) {
+        metadata->block_devices.push_back(block_device(i));
+    }
+
+    // Name lengths were checked when the view was parsed, so this cannot fail.
+    if (!slot_suffix_.empty() && !AdjustMetadataForSlot(metadata.get(), slot_suffix_)) {
+        return nullptr;
+    }
+    return metadata;
+}
+
 }  // namespace fs_mgr
 }  // namespace android
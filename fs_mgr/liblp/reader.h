@@ -38,6 +38,12 @@ bool ReadLogicalPartitionGeometry(int fd, LpMetadataGeometry* geometry);
 bool ReadPrimaryGeometry(int fd, LpMetadataGeometry* geometry);
 bool ReadBackupGeometry(int fd, LpMetadataGeometry* geometry);
 
+// Read and validate metadata at the current position of |reader| into a view.
+// Slot-suffixed names are reported with |slot_suffix| appended.
+class Reader;
+std::unique_ptr<LpMetadataView> ParseMetadataView(const LpMetadataGeometry& geometry,
+                                                  Reader* reader, const std::string& slot_suffix);
+
 // These functions assume a valid geometry and slot number, and do not obey
 // auto-slot-suffixing. They are used for tests and for checking whether
 // the metadata is coherent across primary and backup copies.
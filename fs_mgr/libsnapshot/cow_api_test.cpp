@@ -17,7 +17,9 @@
 #include <cstdio>
 #include <iostream>
 #include <memory>
+#include <random>
 #include <string_view>
+#include <tuple>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -87,7 +89,8 @@ TEST_F(CowTest, ReadWrite) {
     ASSERT_TRUE(reader.GetFooter(&footer));
     ASSERT_EQ(header.magic, kCowMagicNumber);
     ASSERT_EQ(header.major_version, kCowVersionMajor);
-    ASSERT_EQ(header.minor_version, kCowVersionMinor);
+    // Minor version 1 is only used when deduplicating.
+    ASSERT_EQ(header.minor_version, 0);
     ASSERT_EQ(header.block_size, options.block_size);
     ASSERT_EQ(footer.op.num_ops, 4);
 
@@ -313,7 +316,154 @@ TEST_P(CompressionTest, HorribleSink) {
     ASSERT_EQ(sink.stream(), data);
 }
 
-INSTANTIATE_TEST_SUITE_P(CowApi, CompressionTest, testing::Values("none", "gz", "brotli"));
+TEST_P(CompressionTest, ReadDataToBuffer) {
+    CowOptions options;
+    options.compression = GetParam();
+    options.cluster_ops = 0;
+    CowWriter writer(options);
+
+    ASSERT_TRUE(writer.Initialize(cow_->fd));
+
+    std::string data;
+    for (int i = 0; i < 3; i++) {
+        std::string block = "Block " + std::to_string(i) + ", believe it";
+        block.resize(options.block_size, static_cast<char>('a' + i));
+        data += block;
+    }
+
+    ASSERT_TRUE(writer.AddRawBlocks(50, data.data(), data.size()));
+    ASSERT_TRUE(writer.Finalize());
+
+    ASSERT_EQ(lseek(cow_->fd, 0, SEEK_SET), 0);
+
+    CowReader reader;
+    ASSERT_TRUE(reader.Parse(cow_->fd));
+
+    // Alternate between both read paths so that cached decompressor state
+    // is reused across operations.
+    std::string buffer(options.block_size, '\0');
+    size_t index = 0;
+    for (auto iter = reader.GetOpIter(); !iter->Done(); iter->Next(), index++) {
+        const auto& op = iter->Get();
+        std::string expected = data.substr(index * options.block_size, options.block_size);
+
+        ASSERT_TRUE(reader.ReadData(op, buffer.data(), buffer.size()));
+        ASSERT_EQ(buffer, expected);
+
+        StringSink sink;
+        ASSERT_TRUE(reader.ReadData(op, &sink));
+        ASSERT_EQ(sink.stream(), expected);
+
+        ASSERT_FALSE(reader.ReadData(op, buffer.data(), buffer.size() - 1));
+    }
+    ASSERT_EQ(index, 3);
+}
+
+INSTANTIATE_TEST_SUITE_P(CowApi, CompressionTest,
+                         testing::Values("none", "gz", "brotli", "lz4", "zstd", "auto"));
+
+TEST_F(CowTest, AutoCompression) {
+    CowOptions options;
+    options.compression = "auto";
+    options.cluster_ops = 0;
+    CowWriter writer(options);
+
+    ASSERT_TRUE(writer.Initialize(cow_->fd));
+
+    // One incompressible block followed by a highly compressible one.
+    std::string data(options.block_size, '\0');
+    std::mt19937 rng(0);
+    for (auto& c : data) {
+        c = static_cast<char>(rng());
+    }
+    data.append("This is some data, believe it");
+    data.resize(options.block_size * 2, '\0');
+
+    ASSERT_TRUE(writer.AddRawBlocks(50, data.data(), data.size()));
+    ASSERT_TRUE(writer.Finalize());
+
+    ASSERT_EQ(lseek(cow_->fd, 0, SEEK_SET), 0);
+
+    CowReader reader;
+    ASSERT_TRUE(reader.Parse(cow_->fd));
+
+    auto iter = reader.GetOpIter();
+    ASSERT_FALSE(iter->Done());
+    auto op = &iter->Get();
+    ASSERT_EQ(op->compression, kCowCompressNone);
+    ASSERT_EQ(op->data_length, options.block_size);
+
+    StringSink sink;
+    ASSERT_TRUE(reader.ReadData(*op, &sink));
+    ASSERT_EQ(sink.stream(), data.substr(0, options.block_size));
+
+    iter->Next();
+    ASSERT_FALSE(iter->Done());
+    op = &iter->Get();
+    ASSERT_NE(op->compression, kCowCompressNone);
+    ASSERT_LT(op->data_length, options.block_size);
+
+    sink.Reset();
+    ASSERT_TRUE(reader.ReadData(*op, &sink));
+    ASSERT_EQ(sink.stream(), data.substr(options.block_size));
+}
+
+TEST_F(CowTest, ParallelCompression) {
+    CowOptions options;
+    options.compression = "gz";
+    options.cluster_ops = 5;
+
+    // Enough blocks for several compression batches, with a partial one at
+    // the end.
+    std::string data;
+    std::mt19937 rng(0);
+    for (size_t i = 0; i < 1000; i++) {
+        std::string block = "Block " + std::to_string(i);
+        block.resize(options.block_size, static_cast<char>(rng() % 4));
+        data += block;
+    }
+
+    CowWriter serial_writer(options);
+    ASSERT_TRUE(serial_writer.Initialize(cow_->fd));
+    ASSERT_TRUE(serial_writer.AddRawBlocks(50, data.data(), data.size()));
+    ASSERT_TRUE(serial_writer.Finalize());
+
+    TemporaryFile parallel_cow;
+    ASSERT_GE(parallel_cow.fd, 0) << strerror(errno);
+
+    options.num_compress_threads = 4;
+    CowWriter parallel_writer(options);
+    ASSERT_TRUE(parallel_writer.Initialize(parallel_cow.fd));
+    // The compression threads are reused by the second call.
+    size_t split = 600 * options.block_size;
+    ASSERT_TRUE(parallel_writer.AddRawBlocks(50, data.data(), split));
+    ASSERT_TRUE(parallel_writer.AddRawBlocks(650, data.data() + split, data.size() - split));
+    ASSERT_TRUE(parallel_writer.Finalize());
+
+    std::string serial_contents, parallel_contents;
+    ASSERT_TRUE(android::base::ReadFileToString(cow_->path, &serial_contents));
+    ASSERT_TRUE(android::base::ReadFileToString(parallel_cow.path, &parallel_contents));
+    ASSERT_EQ(serial_contents, parallel_contents);
+
+    ASSERT_EQ(lseek(parallel_cow.fd, 0, SEEK_SET), 0);
+
+    CowReader reader;
+    ASSERT_TRUE(reader.Parse(parallel_cow.fd));
+
+    std::string buffer(options.block_size, '\0');
+    size_t index = 0;
+    for (auto iter = reader.GetOpIter(); !iter->Done(); iter->Next()) {
+        const auto& op = iter->Get();
+        if (op.type != kCowReplaceOp) {
+            continue;
+        }
+        ASSERT_EQ(op.new_block, 50 + index);
+        ASSERT_TRUE(reader.ReadData(op, buffer.data(), buffer.size()));
+        ASSERT_EQ(buffer, data.substr(index * options.block_size, options.block_size));
+        index++;
+    }
+    ASSERT_EQ(index, 1000);
+}
 
 TEST_F(CowTest, GetSize) {
     CowOptions options;
@@ -1112,6 +1262,240 @@ TEST_F(CowTest, LegacyRevMergeOpItrTest) {
     ASSERT_TRUE(iter->Done());
 }
 
+class CowMapTest : public CowTest, public testing::WithParamInterface<uint32_t> {};
+
+TEST_P(CowMapTest, MappedOps) {
+    CowOptions options;
+    options.cluster_ops = GetParam();
+    options.compression = "gz";
+    CowWriter writer(options);
+
+    ASSERT_TRUE(writer.Initialize(cow_->fd));
+
+    std::string data(options.block_size * 4, 'x');
+    for (int i = 0; i < 20; i++) {
+        ASSERT_TRUE(writer.AddCopy(100 + i, 200 + i));
+        ASSERT_TRUE(writer.AddRawBlocks(i * 4, data.data(), data.size()));
+        ASSERT_TRUE(writer.AddZeroBlocks(300 + i, 1));
+        ASSERT_TRUE(writer.AddLabel(i));
+    }
+    ASSERT_TRUE(writer.Finalize());
+
+    CowReader reader;
+    ASSERT_TRUE(reader.Parse(cow_->fd));
+    CowReader mapped_reader(true);
+    ASSERT_TRUE(mapped_reader.Parse(cow_->fd));
+
+    auto iter = reader.GetOpIter();
+    auto mapped_iter = mapped_reader.GetOpIter();
+    size_t num_ops = 0;
+    while (!iter->Done()) {
+        ASSERT_FALSE(mapped_iter->Done());
+        ASSERT_EQ(memcmp(&iter->Get(), &mapped_iter->Get(), sizeof(CowOperation)), 0);
+        iter->Next();
+        mapped_iter->Next();
+        num_ops++;
+    }
+    ASSERT_TRUE(mapped_iter->Done());
+    ASSERT_GE(num_ops, 20 * 7);
+
+    auto rev_iter = reader.GetRevMergeOpIter();
+    auto mapped_rev_iter = mapped_reader.GetRevMergeOpIter();
+    StringSink sink;
+    while (!rev_iter->Done()) {
+        ASSERT_FALSE(mapped_rev_iter->Done());
+        const auto& op = mapped_rev_iter->Get();
+        ASSERT_EQ(memcmp(&rev_iter->Get(), &op, sizeof(CowOperation)), 0);
+        if (op.type == kCowReplaceOp) {
+            sink.Reset();
+            ASSERT_TRUE(mapped_reader.ReadData(op, &sink));
+            ASSERT_EQ(sink.stream(), data.substr(0, options.block_size));
+        }
+        rev_iter->Next();
+        mapped_rev_iter->Next();
+    }
+    ASSERT_TRUE(mapped_rev_iter->Done());
+}
+
+INSTANTIATE_TEST_SUITE_P(CowApi, CowMapTest, testing::Values(0, 2, 7, 200));
+
+// A run that is longer than the first one must not be located by division,
+// even if it is the last one.
+TEST_F(CowTest, MappedOpsUnevenRuns) {
+    CowOptions options;
+    options.cluster_ops = 3;
+    CowWriter writer(options);
+
+    ASSERT_TRUE(writer.Initialize(cow_->fd));
+    ASSERT_TRUE(writer.AddZeroBlocks(10, 2));
+    ASSERT_TRUE(writer.Finalize());
+
+    // End the first cluster after its first operation, so that the runs hold
+    // 1 and 2 operations.
+    CowHeader header;
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(cow_->fd, &header, sizeof(header), 0));
+    CowOperation op = {};
+    op.type = kCowClusterOp;
+    op.source = 0;
+    ASSERT_TRUE(android::base::WriteFullyAtOffset(cow_->fd, &op, sizeof(op),
+                                                  header.header_size + header.buffer_size));
+
+    CowReader reader;
+    ASSERT_TRUE(reader.Parse(cow_->fd));
+    CowReader mapped_reader(true);
+    ASSERT_TRUE(mapped_reader.Parse(cow_->fd));
+
+    auto iter = reader.GetOpIter();
+    auto mapped_iter = mapped_reader.GetOpIter();
+    size_t num_ops = 0;
+    while (!iter->Done()) {
+        ASSERT_FALSE(mapped_iter->Done());
+        ASSERT_EQ(memcmp(&iter->Get(), &mapped_iter->Get(), sizeof(CowOperation)), 0);
+        iter->Next();
+        mapped_iter->Next();
+        num_ops++;
+    }
+    ASSERT_TRUE(mapped_iter->Done());
+    ASSERT_EQ(num_ops, 3);
+}
+
+class CowDedupTest : public CowTest,
+                     public testing::WithParamInterface<std::tuple<const char*, uint32_t>> {};
+
+TEST_P(CowDedupTest, DedupBlocks) {
+    CowOptions options;
+    options.compression = std::get<0>(GetParam());
+    options.cluster_ops = std::get<1>(GetParam());
+    options.dedup = true;
+    CowWriter writer(options);
+
+    ASSERT_TRUE(writer.Initialize(cow_->fd));
+
+    std::string blocks[3];
+    for (int i = 0; i < 3; i++) {
+        blocks[i] = "Block " + std::to_string(i);
+        blocks[i].resize(options.block_size, static_cast<char>('a' + i));
+    }
+
+    // Pattern of blocks written, interleaved with other operations.
+    const int pattern[] = {0, 1, 0, 2, 1, 1, 0};
+    for (size_t i = 0; i < std::size(pattern); i++) {
+        const auto& block = blocks[pattern[i]];
+        ASSERT_TRUE(writer.AddRawBlocks(10 + i, block.data(), block.size()));
+        ASSERT_TRUE(writer.AddCopy(100 + i, 200 + i));
+    }
+    ASSERT_TRUE(writer.AddLabel(1));
+    ASSERT_TRUE(writer.Finalize());
+
+    ASSERT_EQ(lseek(cow_->fd, 0, SEEK_SET), 0);
+
+    CowReader reader;
+    ASSERT_TRUE(reader.Parse(cow_->fd));
+
+    CowHeader header;
+    ASSERT_TRUE(reader.GetHeader(&header));
+    ASSERT_EQ(header.minor_version, kCowVersionMinor);
+
+    size_t num_replace = 0;
+    size_t num_dedup = 0;
+    std::string buffer(options.block_size, '\0');
+    for (auto iter = reader.GetOpIter(); !iter->Done(); iter->Next()) {
+        const auto& op = iter->Get();
+        if (op.type != kCowReplaceOp) {
+            continue;
+        }
+        ASSERT_EQ(op.new_block, 10 + num_replace);
+
+        const auto& expected = blocks[pattern[num_replace]];
+        ASSERT_TRUE(reader.ReadData(op, buffer.data(), buffer.size()));
+        ASSERT_EQ(buffer, expected);
+
+        StringSink sink;
+        ASSERT_TRUE(reader.ReadData(op, &sink));
+        ASSERT_EQ(sink.stream(), expected);
+
+        if (IsDedupOp(op)) {
+            num_dedup++;
+        }
+        num_replace++;
+    }
+    ASSERT_EQ(num_replace, std::size(pattern));
+    ASSERT_EQ(num_dedup, 4);
+
+    uint64_t label;
+    ASSERT_TRUE(reader.GetLastLabel(&label));
+    ASSERT_EQ(label, 1);
+}
+
+INSTANTIATE_TEST_SUITE_P(CowApi, CowDedupTest,
+                         testing::Combine(testing::Values("none", "gz"),
+                                          testing::Values(0, 2, 200)));
+
+TEST_F(CowTest, DedupForgetsLeastRecentlyUsed) {
+    CowOptions options;
+    options.cluster_ops = 0;
+    options.dedup = true;
+    options.dedup_max_entries = 2;
+    CowWriter writer(options);
+
+    ASSERT_TRUE(writer.Initialize(cow_->fd));
+
+    std::string blocks[3];
+    for (int i = 0; i < 3; i++) {
+        blocks[i] = std::string(options.block_size, static_cast<char>('a' + i));
+    }
+
+    // Block 0 is matched again before block 2 is added, so block 1 is the one
+    // forgotten.
+    const int pattern[] = {0, 1, 0, 2, 0, 1};
+    const bool expect_dedup[] = {false, false, true, false, true, false};
+    for (size_t i = 0; i < std::size(pattern); i++) {
+        const auto& block = blocks[pattern[i]];
+        ASSERT_TRUE(writer.AddRawBlocks(i, block.data(), block.size()));
+    }
+    ASSERT_TRUE(writer.Finalize());
+
+    ASSERT_EQ(lseek(cow_->fd, 0, SEEK_SET), 0);
+
+    CowReader reader;
+    ASSERT_TRUE(reader.Parse(cow_->fd));
+
+    size_t i = 0;
+    std::string buffer(options.block_size, '\0');
+    for (auto iter = reader.GetOpIter(); !iter->Done(); iter->Next(), i++) {
+        const auto& op = iter->Get();
+        ASSERT_EQ(op.new_block, i);
+        ASSERT_EQ(IsDedupOp(op), expect_dedup[i]) << op;
+        ASSERT_TRUE(reader.ReadData(op, buffer.data(), buffer.size()));
+        ASSERT_EQ(buffer, blocks[pattern[i]]);
+    }
+    ASSERT_EQ(i, std::size(pattern));
+}
+
+TEST_F(CowTest, DedupRequiresMinorVersion) {
+    CowOptions options;
+    options.cluster_ops = 0;
+    options.dedup = true;
+    CowWriter writer(options);
+
+    ASSERT_TRUE(writer.Initialize(cow_->fd));
+
+    std::string data(options.block_size, 'x');
+    ASSERT_TRUE(writer.AddRawBlocks(10, data.data(), data.size()));
+    ASSERT_TRUE(writer.AddRawBlocks(11, data.data(), data.size()));
+    ASSERT_TRUE(writer.Finalize());
+
+    // A reader must not mistake the deduplicated operation for one followed
+    // by data in a COW that claims to predate deduplication.
+    CowHeader header;
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(cow_->fd, &header, sizeof(header), 0));
+    header.minor_version = 0;
+    ASSERT_TRUE(android::base::WriteFullyAtOffset(cow_->fd, &header, sizeof(header), 0));
+
+    CowReader reader;
+    ASSERT_FALSE(reader.Parse(cow_->fd));
+}
+
 }  // namespace snapshot
 }  // namespace android
 
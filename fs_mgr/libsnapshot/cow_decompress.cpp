@@ -16,11 +16,16 @@
 
 #include "cow_decompress.h"
 
+#include <string.h>
+
 #include <utility>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <brotli/decode.h>
+#include <lz4.h>
 #include <zlib.h>
+#include <zstd.h>
 
 namespace android {
 namespace snapshot {
@@ -28,8 +33,21 @@ namespace snapshot {
 class NoDecompressor final : public IDecompressor {
   public:
     bool Decompress(size_t) override;
+    bool DecompressBlock(const void* input, size_t input_size, void* output,
+                         size_t output_size) override;
 };
 
+bool NoDecompressor::DecompressBlock(const void* input, size_t input_size, void* output,
+                                     size_t output_size) {
+    if (input_size != output_size) {
+        LOG(ERROR) << "Uncompressed data size " << input_size << " does not match "
+                   << output_size;
+        return false;
+    }
+    memcpy(output, input, input_size);
+    return true;
+}
+
 bool NoDecompressor::Decompress(size_t) {
     size_t stream_remaining = stream_->Size();
     while (stream_remaining) {
@@ -95,6 +113,8 @@ bool StreamDecompressor::Decompress(size_t output_bytes) {
 
     stream_remaining_ = stream_->Size();
     output_bytes_ = output_bytes;
+    output_buffer_ = nullptr;
+    output_buffer_remaining_ = 0;
 
     uint8_t chunk[kChunkSize];
     while (stream_remaining_) {
@@ -142,22 +162,64 @@ class GzDecompressor final : public StreamDecompressor {
     bool Init() override;
     bool DecompressInput(const uint8_t* data, size_t length) override;
     bool Done() override { return ended_; }
+    bool DecompressBlock(const void* input, size_t input_size, void* output,
+                         size_t output_size) override;
 
   private:
     z_stream z_ = {};
+    bool initialized_ = false;
     bool ended_ = false;
 };
 
+// The inflate state is allocated once and reset for every subsequent use.
 bool GzDecompressor::Init() {
-    if (int rv = inflateInit(&z_); rv != Z_OK) {
-        LOG(ERROR) << "inflateInit returned error code " << rv;
-        return false;
+    if (initialized_) {
+        if (int rv = inflateReset(&z_); rv != Z_OK) {
+            LOG(ERROR) << "inflateReset returned error code " << rv;
+            return false;
+        }
+    } else {
+        if (int rv = inflateInit(&z_); rv != Z_OK) {
+            LOG(ERROR) << "inflateInit returned error code " << rv;
+            return false;
+        }
+        initialized_ = true;
     }
+    z_.next_out = nullptr;
+    z_.avail_out = 0;
+    ended_ = false;
     return true;
 }
 
 GzDecompressor::~GzDecompressor() {
-    inflateEnd(&z_);
+    if (initialized_) {
+        inflateEnd(&z_);
+    }
+}
+
+bool GzDecompressor::DecompressBlock(const void* input, size_t input_size, void* output,
+                                     size_t output_size) {
+    if (!Init()) {
+        return false;
+    }
+
+    z_.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(input));
+    z_.avail_in = input_size;
+    z_.next_out = reinterpret_cast<Bytef*>(output);
+    z_.avail_out = output_size;
+
+    int rv = inflate(&z_, Z_FINISH);
+    if (rv != Z_STREAM_END) {
+        LOG(ERROR) << "inflate returned error code " << rv;
+        return false;
+    }
+    if (z_.avail_in || z_.avail_out) {
+        LOG(ERROR) << "Gz block size mismatch, unused input: " << z_.avail_in
+                   << " unfilled output: " << z_.avail_out;
+        return false;
+    }
+    ended_ = true;
+    return true;
 }
 
 bool GzDecompressor::DecompressInput(const uint8_t* data, size_t length) {
@@ -215,13 +277,40 @@ class BrotliDecompressor final : public StreamDecompressor {
     bool Init() override;
     bool DecompressInput(const uint8_t* data, size_t length) override;
     bool Done() override { return BrotliDecoderIsFinished(decoder_); }
+    bool DecompressBlock(const void* input, size_t input_size, void* output,
+                         size_t output_size) override;
 
   private:
     BrotliDecoderState* decoder_ = nullptr;
 };
 
+// Brotli has no way to reset a decoder, so a used one is replaced.
 bool BrotliDecompressor::Init() {
+    if (decoder_) {
+        BrotliDecoderDestroyInstance(decoder_);
+    }
     decoder_ = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+    if (!decoder_) {
+        LOG(ERROR) << "BrotliDecoderCreateInstance failed";
+        return false;
+    }
+    return true;
+}
+
+bool BrotliDecompressor::DecompressBlock(const void* input, size_t input_size, void* output,
+                                         size_t output_size) {
+    size_t decoded_size = output_size;
+    auto rv = BrotliDecoderDecompress(input_size, reinterpret_cast<const uint8_t*>(input),
+                                      &decoded_size, reinterpret_cast<uint8_t*>(output));
+    if (rv != BROTLI_DECODER_RESULT_SUCCESS) {
+        LOG(ERROR) << "brotli decode failed";
+        return false;
+    }
+    if (decoded_size != output_size) {
+        LOG(ERROR) << "Brotli block size mismatch, expected " << output_size << " got "
+                   << decoded_size;
+        return false;
+    }
     return true;
 }
 
@@ -260,5 +349,193 @@ std::unique_ptr<IDecompressor> IDecompressor::Brotli() {
     return std::unique_ptr<IDecompressor>(new BrotliDecompressor());
 }
 
+class ZstdDecompressor final : public StreamDecompressor {
+  public:
+    ~ZstdDecompressor();
+
+    bool Init() override;
+    bool DecompressInput(const uint8_t* data, size_t length) override;
+    bool Done() override { return ended_; }
+    bool DecompressBlock(const void* input, size_t input_size, void* output,
+                         size_t output_size) override;
+
+  private:
+    ZSTD_DCtx* dctx_ = nullptr;
+    bool ended_ = false;
+};
+
+// The decompression context is allocated once and reset for every
+// subsequent use.
+bool ZstdDecompressor::Init() {
+    if (!dctx_) {
+        dctx_ = ZSTD_createDCtx();
+        if (!dctx_) {
+            LOG(ERROR) << "ZSTD_createDCtx failed";
+            return false;
+        }
+    } else if (size_t rv = ZSTD_DCtx_reset(dctx_, ZSTD_reset_session_only); ZSTD_isError(rv)) {
+        LOG(ERROR) << "ZSTD_DCtx_reset failed: " << ZSTD_getErrorName(rv);
+        return false;
+    }
+    ended_ = false;
+    return true;
+}
+
+ZstdDecompressor::~ZstdDecompressor() {
+    ZSTD_freeDCtx(dctx_);
+}
+
+bool ZstdDecompressor::DecompressBlock(const void* input, size_t input_size, void* output,
+                                       size_t output_size) {
+    if (!Init()) {
+        return false;
+    }
+    size_t rv = ZSTD_decompressDCtx(dctx_, output, output_size, input, input_size);
+    if (ZSTD_isError(rv)) {
+        LOG(ERROR) << "ZSTD_decompressDCtx failed: " << ZSTD_getErrorName(rv);
+        return false;
+    }
+    if (rv != output_size) {
+        LOG(ERROR) << "Zstd block size mismatch, expected " << output_size << " got " << rv;
+        return false;
+    }
+    ended_ = true;
+    return true;
+}
+
+bool ZstdDecompressor::DecompressInput(const uint8_t* data, size_t length) {
+    ZSTD_inBuffer in = {data, length, 0};
+
+    // The decoder may hold back output when the output buffer fills up.
+    bool needs_more_output = false;
+    while (in.pos < in.size || needs_more_output) {
+        if (!output_buffer_remaining_ && !GetFreshBuffer()) {
+            return false;
+        }
+
+        ZSTD_outBuffer out = {output_buffer_, output_buffer_remaining_, 0};
+        size_t rv = ZSTD_decompressStream(dctx_, &out, &in);
+        if (ZSTD_isError(rv)) {
+            LOG(ERROR) << "ZSTD_decompressStream failed: " << ZSTD_getErrorName(rv);
+            return false;
+        }
+
+        if (!sink_->ReturnData(output_buffer_, out.pos)) {
+            LOG(ERROR) << "Could not return buffer to sink";
+            return false;
+        }
+        output_buffer_ += out.pos;
+        output_buffer_remaining_ -= out.pos;
+        needs_more_output = rv != 0 && out.pos == out.size;
+
+        if (rv == 0) {
+            if (in.pos < in.size) {
+                LOG(ERROR) << "Zstd stream ended prematurely";
+                return false;
+            }
+            ended_ = true;
+        }
+    }
+    return true;
+}
+
+std::unique_ptr<IDecompressor> IDecompressor::Zstd() {
+    return std::unique_ptr<IDecompressor>(new ZstdDecompressor());
+}
+
+// LZ4 blocks cannot be decoded incrementally, so the whole operation is
+// staged before the output is handed to the sink.
+class Lz4Decompressor final : public IDecompressor {
+  public:
+    bool Decompress(size_t output_bytes) override;
+    bool DecompressBlock(const void* input, size_t input_size, void* output,
+                         size_t output_size) override;
+
+  private:
+    std::vector<uint8_t> input_;
+    std::vector<uint8_t> output_;
+};
+
+bool Lz4Decompressor::DecompressBlock(const void* input, size_t input_size, void* output,
+                                      size_t output_size) {
+    int rv = LZ4_decompress_safe(reinterpret_cast<const char*>(input),
+                                 reinterpret_cast<char*>(output), input_size, output_size);
+    if (rv < 0) {
+        LOG(ERROR) << "LZ4_decompress_safe returned error code " << rv;
+        return false;
+    }
+    if (static_cast<size_t>(rv) != output_size) {
+        LOG(ERROR) << "LZ4 block size mismatch, expected " << output_size << " got " << rv;
+        return false;
+    }
+    return true;
+}
+
+bool Lz4Decompressor::Decompress(size_t output_bytes) {
+    input_.resize(stream_->Size());
+    size_t total = 0;
+    while (total < input_.size()) {
+        size_t read;
+        if (!stream_->Read(input_.data() + total, input_.size() - total, &read)) {
+            return false;
+        }
+        if (!read) {
+            LOG(ERROR) << "Stream ended prematurely";
+            return false;
+        }
+        total += read;
+    }
+
+    output_.resize(output_bytes);
+    if (!DecompressBlock(input_.data(), input_.size(), output_.data(), output_.size())) {
+        return false;
+    }
+
+    size_t pos = 0;
+    while (pos < output_.size()) {
+        size_t buffer_size;
+        void* buffer = sink_->GetBuffer(output_.size() - pos, &buffer_size);
+        if (!buffer || !buffer_size) {
+            LOG(ERROR) << "Could not acquire buffer from sink";
+            return false;
+        }
+        buffer_size = std::min(buffer_size, output_.size() - pos);
+        memcpy(buffer, output_.data() + pos, buffer_size);
+        if (!sink_->ReturnData(buffer, buffer_size)) {
+            LOG(ERROR) << "Could not return buffer to sink";
+            return false;
+        }
+        pos += buffer_size;
+    }
+    return true;
+}
+
+std::unique_ptr<IDecompressor> IDecompressor::Lz4() {
+    return std::unique_ptr<IDecompressor>(new Lz4Decompressor());
+}
+
+IDecompressor* IDecompressor::GetCached(uint8_t compression) {
+    static thread_local std::unique_ptr<IDecompressor> none = Uncompressed();
+    static thread_local std::unique_ptr<IDecompressor> gz = Gz();
+    static thread_local std::unique_ptr<IDecompressor> brotli = Brotli();
+    static thread_local std::unique_ptr<IDecompressor> lz4 = Lz4();
+    static thread_local std::unique_ptr<IDecompressor> zstd = Zstd();
+
+    switch (compression) {
+        case kCowCompressNone:
+            return none.get();
+        case kCowCompressGz:
+            return gz.get();
+        case kCowCompressBrotli:
+            return brotli.get();
+        case kCowCompressLz4:
+            return lz4.get();
+        case kCowCompressZstd:
+            return zstd.get();
+        default:
+            return nullptr;
+    }
+}
+
 }  // namespace snapshot
 }  // namespace android
@@ -41,10 +41,22 @@ class IDecompressor {
     static std::unique_ptr<IDecompressor> Uncompressed();
     static std::unique_ptr<IDecompressor> Gz();
     static std::unique_ptr<IDecompressor> Brotli();
+    static std::unique_ptr<IDecompressor> Lz4();
+    static std::unique_ptr<IDecompressor> Zstd();
+
+    // Returns a decompressor for |compression| which is owned by the calling
+    // thread. Its state is reset rather than reallocated between uses.
+    // Returns nullptr if the compression type is unknown.
+    static IDecompressor* GetCached(uint8_t compression);
 
     // |output_bytes| is the expected total number of bytes to sink.
     virtual bool Decompress(size_t output_bytes) = 0;
 
+    // Decompress all of |input| straight into |output|, bypassing the stream
+    // and sink. The decompressed data must be exactly |output_size| bytes.
+    virtual bool DecompressBlock(const void* input, size_t input_size, void* output,
+                                 size_t output_size) = 0;
+
     void set_stream(IByteStream* stream) { stream_ = stream; }
     void set_sink(IByteSink* sink) { sink_ = sink; }
 
@@ -44,14 +44,20 @@ std::ostream& operator<<(std::ostream& os, CowOperation const& op) {
     else
         os << (int)op.type << "?,";
     os << "compression:";
-    if (op.compression == kCowCompressNone)
+    uint8_t compression = GetCompressionType(op);
+    if (compression == kCowCompressNone)
         os << "kCowCompressNone,   ";
-    else if (op.compression == kCowCompressGz)
+    else if (compression == kCowCompressGz)
         os << "kCowCompressGz,     ";
-    else if (op.compression == kCowCompressBrotli)
+    else if (compression == kCowCompressBrotli)
         os << "kCowCompressBrotli, ";
+    else if (compression == kCowCompressLz4)
+        os << "kCowCompressLz4,    ";
+    else if (compression == kCowCompressZstd)
+        os << "kCowCompressZstd,   ";
     else
-        os << (int)op.compression << "?, ";
+        os << (int)compression << "?, ";
+    if (IsDedupOp(op)) os << "dedup, ";
     os << "data_length:" << op.data_length << ",\t";
     os << "new_block:" << op.new_block << ",\t";
     os << "source:" << op.source << ")";
@@ -62,7 +68,7 @@ int64_t GetNextOpOffset(const CowOperation& op, uint32_t cluster_ops) {
     if (op.type == kCowClusterOp) {
         return op.source;
     } else if (op.type == kCowReplaceOp && cluster_ops == 0) {
-        return op.data_length;
+        return IsDedupOp(op) ? 0 : op.data_length;
     } else {
         return 0;
     }
@@ -99,5 +105,13 @@ bool IsOrderedOp(const CowOperation& op) {
     }
 }
 
+bool IsDedupOp(const CowOperation& op) {
+    return op.type == kCowReplaceOp && (op.compression & kCowCompressDedup);
+}
+
+uint8_t GetCompressionType(const CowOperation& op) {
+    return op.compression & ~kCowCompressDedup;
+}
+
 }  // namespace snapshot
 }  // namespace android
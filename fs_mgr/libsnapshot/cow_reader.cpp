@@ -14,9 +14,11 @@
 // limitations under the License.
 //
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
 #include <optional>
 #include <set>
@@ -34,7 +36,103 @@
 namespace android {
 namespace snapshot {
 
-CowReader::CowReader() : fd_(-1), header_(), fd_size_(0) {}
+// Storage for the operations of a parsed COW.
+class CowOps {
+  public:
+    virtual ~CowOps() {}
+
+    virtual size_t size() const = 0;
+    virtual const CowOperation& at(size_t index) const = 0;
+};
+
+class CowOpsVector final : public CowOps {
+  public:
+    explicit CowOpsVector(std::vector<CowOperation>&& ops) : ops_(std::move(ops)) {}
+
+    size_t size() const override { return ops_.size(); }
+    const CowOperation& at(size_t index) const override { return ops_[index]; }
+
+  private:
+    std::vector<CowOperation> ops_;
+};
+
+// Operations accessed in place in a read-only mapping of the COW. On disk,
+// operations are stored in runs which are interleaved with data: a run is a
+// cluster, or a single operation if the COW is not clustered. The index only
+// records where each run starts. Usually all runs but the last one hold the
+// same number of operations, and the last one holds no more, so locating an
+// operation is a division; if that does not hold, we fall back to a binary
+// search.
+class CowOpsMapped final : public CowOps {
+  public:
+    CowOpsMapped(void* addr, size_t length)
+        : addr_(reinterpret_cast<const uint8_t*>(addr)), length_(length) {}
+    ~CowOpsMapped() { munmap(const_cast<uint8_t*>(addr_), length_); }
+
+    const uint8_t* addr() const { return addr_; }
+
+    void AddRun(uint64_t offset, size_t num_ops) {
+        runs_.push_back({offset, num_ops_, num_ops});
+        num_ops_ += num_ops;
+    }
+
+    // Drop operations at the end, e.g. the footer. This completes the index
+    // and must be called before at().
+    void Truncate(size_t num_ops) {
+        while (!runs_.empty() && runs_.back().first_op >= num_ops) {
+            runs_.pop_back();
+        }
+        if (!runs_.empty()) {
+            runs_.back().num_ops = num_ops - runs_.back().first_op;
+        }
+        num_ops_ = num_ops;
+        runs_.shrink_to_fit();
+
+        num_ops_per_run_ = runs_.empty() ? 0 : runs_.front().num_ops;
+        uniform_ = num_ops_per_run_ > 0;
+        for (size_t i = 0; uniform_ && i < runs_.size(); i++) {
+            if (i + 1 < runs_.size()) {
+                uniform_ = runs_[i].num_ops == num_ops_per_run_;
+            } else {
+                uniform_ = runs_[i].num_ops <= num_ops_per_run_;
+            }
+        }
+    }
+
+    size_t size() const override { return num_ops_; }
+
+    const CowOperation& at(size_t index) const override {
+        size_t run;
+        if (uniform_) {
+            run = index / num_ops_per_run_;
+        } else {
+            auto it = std::upper_bound(
+                    runs_.begin(), runs_.end(), index,
+                    [](size_t i, const OpRun& run) -> bool { return i < run.first_op; });
+            run = (it - runs_.begin()) - 1;
+        }
+        const OpRun& r = runs_[run];
+        return *reinterpret_cast<const CowOperation*>(
+                addr_ + r.offset + (index - r.first_op) * sizeof(CowOperation));
+    }
+
+  private:
+    struct OpRun {
+        uint64_t offset;
+        size_t first_op;
+        size_t num_ops;
+    };
+
+    const uint8_t* addr_;
+    size_t length_;
+    std::vector<OpRun> runs_;
+    size_t num_ops_ = 0;
+    size_t num_ops_per_run_ = 0;
+    bool uniform_ = false;
+};
+
+CowReader::CowReader(bool map_ops)
+    : fd_(-1), header_(), fd_size_(0), map_ops_(map_ops), has_seq_ops_(false) {}
 
 static void SHA256(const void*, size_t, uint8_t[]) {
 #if 0
@@ -121,7 +219,7 @@ bool CowReader::Parse(android::base::borrowed_fd fd, std::optional<uint64_t> lab
         return false;
     }
 
-    if ((header_.major_version > kCowVersionMajor) || (header_.minor_version != kCowVersionMinor)) {
+    if ((header_.major_version > kCowVersionMajor) || (header_.minor_version > kCowVersionMinor)) {
         LOG(ERROR) << "Header version mismatch";
         LOG(ERROR) << "Major version: " << header_.major_version
                    << "Expected: " << kCowVersionMajor;
@@ -158,7 +256,17 @@ bool CowReader::ParseOps(std::optional<uint64_t> label) {
         header_.buffer_size = 0;
     }
 
-    auto ops_buffer = std::make_shared<std::vector<CowOperation>>();
+    std::vector<CowOperation> ops_buffer;
+    std::unique_ptr<CowOpsMapped> mapped_ops;
+    if (map_ops_) {
+        void* addr = mmap(nullptr, fd_size_, PROT_READ, MAP_SHARED, fd_.get(), 0);
+        if (addr == MAP_FAILED) {
+            PLOG(WARNING) << "mmap of COW failed, copying operations";
+        } else {
+            mapped_ops = std::make_unique<CowOpsMapped>(addr, fd_size_);
+        }
+    }
+
     uint64_t current_op_num = 0;
     uint64_t cluster_ops = header_.cluster_ops ?: 1;
     bool done = false;
@@ -167,16 +275,30 @@ bool CowReader::ParseOps(std::optional<uint64_t> label) {
     while (!done) {
         uint64_t to_add = std::min(cluster_ops, (fd_size_ - pos) / sizeof(CowOperation));
         if (to_add == 0) break;
-        ops_buffer->resize(current_op_num + to_add);
-        if (!android::base::ReadFully(fd_, &ops_buffer->data()[current_op_num],
-                                      to_add * sizeof(CowOperation))) {
-            PLOG(ERROR) << "read op failed";
-            return false;
+
+        const CowOperation* cluster;
+        uint64_t cluster_pos = pos;
+        uint64_t first_op_num = current_op_num;
+        if (mapped_ops) {
+            cluster = reinterpret_cast<const CowOperation*>(mapped_ops->addr() + pos);
+        } else {
+            ops_buffer.resize(current_op_num + to_add);
+            if (!android::base::ReadFully(fd_, &ops_buffer.data()[current_op_num],
+                                          to_add * sizeof(CowOperation))) {
+                PLOG(ERROR) << "read op failed";
+                return false;
+            }
+            cluster = &ops_buffer.data()[current_op_num];
         }
         // Parse current cluster to find start of next cluster
-        while (current_op_num < ops_buffer->size()) {
-            auto& current_op = ops_buffer->data()[current_op_num];
+        while (current_op_num < first_op_num + to_add) {
+            const auto& current_op = cluster[current_op_num - first_op_num];
             current_op_num++;
+            if (IsDedupOp(current_op) && header_.minor_version < 1) {
+                LOG(ERROR) << "Deduplicated operation in a COW of minor version "
+                           << header_.minor_version << ": " << current_op;
+                return false;
+            }
             pos += sizeof(CowOperation) + GetNextOpOffset(current_op, header_.cluster_ops);
 
             if (current_op.type == kCowClusterOp) {
@@ -212,16 +334,22 @@ bool CowReader::ParseOps(std::optional<uint64_t> label) {
             }
         }
 
-        // Position for next cluster read
-        off_t offs = lseek(fd_.get(), pos, SEEK_SET);
-        if (offs < 0 || pos != static_cast<uint64_t>(offs)) {
-            PLOG(ERROR) << "lseek next op failed";
-            return false;
+        if (mapped_ops) {
+            if (current_op_num > first_op_num) {
+                mapped_ops->AddRun(cluster_pos, current_op_num - first_op_num);
+            }
+        } else {
+            // Position for next cluster read
+            off_t offs = lseek(fd_.get(), pos, SEEK_SET);
+            if (offs < 0 || pos != static_cast<uint64_t>(offs)) {
+                PLOG(ERROR) << "lseek next op failed";
+                return false;
+            }
+            ops_buffer.resize(current_op_num);
         }
-        ops_buffer->resize(current_op_num);
     }
 
-    LOG(DEBUG) << "COW file read complete. Total ops: " << ops_buffer->size();
+    LOG(DEBUG) << "COW file read complete. Total ops: " << current_op_num;
     // To successfully parse a COW file, we need either:
     //  (1) a label to read up to, and for that label to be found, or
     //  (2) a valid footer.
@@ -245,12 +373,12 @@ bool CowReader::ParseOps(std::optional<uint64_t> label) {
     memset(csum, 0, sizeof(uint8_t) * 32);
 
     if (footer_) {
-        if (ops_buffer->size() != footer_->op.num_ops) {
+        if (current_op_num != footer_->op.num_ops) {
             LOG(ERROR) << "num ops does not match, expected " << footer_->op.num_ops << ", found "
-                       << ops_buffer->size();
+                       << current_op_num;
             return false;
         }
-        if (ops_buffer->size() * sizeof(CowOperation) != footer_->op.ops_size) {
+        if (current_op_num * sizeof(CowOperation) != footer_->op.ops_size) {
             LOG(ERROR) << "ops size does not match ";
             return false;
         }
@@ -259,15 +387,24 @@ bool CowReader::ParseOps(std::optional<uint64_t> label) {
             LOG(ERROR) << "ops checksum does not match";
             return false;
         }
-        SHA256(ops_buffer->data(), footer_->op.ops_size, csum);
-        if (memcmp(csum, footer_->data.ops_checksum, sizeof(csum)) != 0) {
-            LOG(ERROR) << "ops checksum does not match";
-            return false;
+        // Mapped operations are not contiguous; they are only checksummed
+        // when copied.
+        if (!mapped_ops) {
+            SHA256(ops_buffer.data(), footer_->op.ops_size, csum);
+            if (memcmp(csum, footer_->data.ops_checksum, sizeof(csum)) != 0) {
+                LOG(ERROR) << "ops checksum does not match";
+                return false;
+            }
         }
     }
 
-    ops_ = ops_buffer;
-    ops_->shrink_to_fit();
+    if (mapped_ops) {
+        mapped_ops->Truncate(current_op_num);
+        ops_ = std::move(mapped_ops);
+    } else {
+        ops_buffer.shrink_to_fit();
+        ops_ = std::make_shared<CowOpsVector>(std::move(ops_buffer));
+    }
 
     return true;
 }
@@ -384,8 +521,9 @@ bool CowReader::PrepMergeOps() {
     size_t num_seqs = 0;
     size_t read;
 
-    for (size_t i = 0; i < ops_->size(); i++) {
-        auto& current_op = ops_->data()[i];
+    auto iter = GetOpIter();
+    for (size_t i = 0; !iter->Done(); iter->Next(), i++) {
+        const auto& current_op = iter->Get();
 
         if (current_op.type == kCowSequenceOp) {
             size_t seq_len = current_op.data_length / sizeof(uint32_t);
@@ -453,39 +591,39 @@ bool CowReader::GetLastLabel(uint64_t* label) {
 
 class CowOpIter final : public ICowOpIter {
   public:
-    CowOpIter(std::shared_ptr<std::vector<CowOperation>>& ops);
+    CowOpIter(std::shared_ptr<CowOps>& ops);
 
     bool Done() override;
     const CowOperation& Get() override;
     void Next() override;
 
   private:
-    std::shared_ptr<std::vector<CowOperation>> ops_;
-    std::vector<CowOperation>::iterator op_iter_;
+    std::shared_ptr<CowOps> ops_;
+    size_t op_index_;
 };
 
-CowOpIter::CowOpIter(std::shared_ptr<std::vector<CowOperation>>& ops) {
+CowOpIter::CowOpIter(std::shared_ptr<CowOps>& ops) {
     ops_ = ops;
-    op_iter_ = ops_->begin();
+    op_index_ = 0;
 }
 
 bool CowOpIter::Done() {
-    return op_iter_ == ops_->end();
+    return op_index_ == ops_->size();
 }
 
 void CowOpIter::Next() {
     CHECK(!Done());
-    op_iter_++;
+    op_index_++;
 }
 
 const CowOperation& CowOpIter::Get() {
     CHECK(!Done());
-    return (*op_iter_);
+    return ops_->at(op_index_);
 }
 
 class CowRevMergeOpIter final : public ICowOpIter {
   public:
-    explicit CowRevMergeOpIter(std::shared_ptr<std::vector<CowOperation>> ops,
+    explicit CowRevMergeOpIter(std::shared_ptr<CowOps> ops,
                                std::shared_ptr<std::vector<uint32_t>> merge_op_blocks,
                                std::shared_ptr<std::unordered_map<uint32_t, int>> map);
 
@@ -494,13 +632,13 @@ class CowRevMergeOpIter final : public ICowOpIter {
     void Next() override;
 
   private:
-    std::shared_ptr<std::vector<CowOperation>> ops_;
+    std::shared_ptr<CowOps> ops_;
     std::shared_ptr<std::vector<uint32_t>> merge_op_blocks_;
     std::shared_ptr<std::unordered_map<uint32_t, int>> map_;
     std::vector<uint32_t>::reverse_iterator block_riter_;
 };
 
-CowRevMergeOpIter::CowRevMergeOpIter(std::shared_ptr<std::vector<CowOperation>> ops,
+CowRevMergeOpIter::CowRevMergeOpIter(std::shared_ptr<CowOps> ops,
                                      std::shared_ptr<std::vector<uint32_t>> merge_op_blocks,
                                      std::shared_ptr<std::unordered_map<uint32_t, int>> map) {
     ops_ = ops;
@@ -521,7 +659,7 @@ void CowRevMergeOpIter::Next() {
 
 const CowOperation& CowRevMergeOpIter::Get() {
     CHECK(!Done());
-    return ops_->data()[map_->at(*block_riter_)];
+    return ops_->at(map_->at(*block_riter_));
 }
 
 std::unique_ptr<ICowOpIter> CowReader::GetOpIter() {
@@ -539,11 +677,9 @@ bool CowReader::GetRawBytes(uint64_t offset, void* buffer, size_t len, size_t* r
         LOG(ERROR) << "invalid data offset: " << offset << ", " << len << " bytes";
         return false;
     }
-    if (lseek(fd_.get(), offset, SEEK_SET) < 0) {
-        PLOG(ERROR) << "lseek to read raw bytes failed";
-        return false;
-    }
-    ssize_t rv = TEMP_FAILURE_RETRY(::read(fd_.get(), buffer, len));
+    // Use positional reads so that a single reader can serve data to
+    // multiple threads.
+    ssize_t rv = TEMP_FAILURE_RETRY(::pread(fd_.get(), buffer, len, offset));
     if (rv < 0) {
         PLOG(ERROR) << "read failed";
         return false;
@@ -583,20 +719,11 @@ class CowDataStream final : public IByteStream {
 };
 
 bool CowReader::ReadData(const CowOperation& op, IByteSink* sink) {
-    std::unique_ptr<IDecompressor> decompressor;
-    switch (op.compression) {
-        case kCowCompressNone:
-            decompressor = IDecompressor::Uncompressed();
-            break;
-        case kCowCompressGz:
-            decompressor = IDecompressor::Gz();
-            break;
-        case kCowCompressBrotli:
-            decompressor = IDecompressor::Brotli();
-            break;
-        default:
-            LOG(ERROR) << "Unknown compression type: " << op.compression;
-            return false;
+    uint8_t compression = GetCompressionType(op);
+    IDecompressor* decompressor = IDecompressor::GetCached(compression);
+    if (!decompressor) {
+        LOG(ERROR) << "Unknown compression type: " << static_cast<int>(compression);
+        return false;
     }
 
     CowDataStream stream(this, op.source, op.data_length);
@@ -605,5 +732,50 @@ bool CowReader::ReadData(const CowOperation& op, IByteSink* sink) {
     return decompressor->Decompress(header_.block_size);
 }
 
+bool CowReader::ReadData(const CowOperation& op, void* buffer, size_t buffer_size) {
+    uint8_t compression = GetCompressionType(op);
+    IDecompressor* decompressor = IDecompressor::GetCached(compression);
+    if (!decompressor) {
+        LOG(ERROR) << "Unknown compression type: " << static_cast<int>(compression);
+        return false;
+    }
+
+    uint64_t offset = op.source;
+    size_t data_length = op.data_length;
+
+    // Uncompressed data needs no staging.
+    uint8_t* data = reinterpret_cast<uint8_t*>(buffer);
+    if (compression != kCowCompressNone) {
+        // data_length is 16 bits wide, so this buffer fits any operation.
+        static thread_local std::unique_ptr<uint8_t[]> scratch;
+        if (!scratch) {
+            scratch = std::make_unique<uint8_t[]>(std::numeric_limits<uint16_t>::max());
+        }
+        data = scratch.get();
+    } else if (data_length != buffer_size) {
+        LOG(ERROR) << "Uncompressed data size " << data_length << " does not match buffer size "
+                   << buffer_size;
+        return false;
+    }
+
+    size_t total = 0;
+    while (total < data_length) {
+        size_t read;
+        if (!GetRawBytes(offset + total, data + total, data_length - total, &read)) {
+            return false;
+        }
+        if (!read) {
+            LOG(ERROR) << "Unexpected end of data at offset " << offset + total;
+            return false;
+        }
+        total += read;
+    }
+
+    if (compression == kCowCompressNone) {
+        return true;
+    }
+    return decompressor->DecompressBlock(data, data_length, buffer, buffer_size);
+}
+
 }  // namespace snapshot
 }  // namespace android
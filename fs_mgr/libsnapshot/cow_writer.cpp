@@ -14,11 +14,15 @@
 // limitations under the License.
 //
 
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <iterator>
 #include <limits>
 #include <queue>
+#include <string_view>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -26,7 +30,10 @@
 #include <brotli/encode.h>
 #include <libsnapshot/cow_reader.h>
 #include <libsnapshot/cow_writer.h>
+#include <lz4.h>
+#include <lz4hc.h>
 #include <zlib.h>
+#include <zstd.h>
 
 namespace android {
 namespace snapshot {
@@ -36,6 +43,9 @@ static_assert(sizeof(off_t) == sizeof(uint64_t));
 using android::base::borrowed_fd;
 using android::base::unique_fd;
 
+// Decompression speed barely depends on the zstd level, so favor size.
+static constexpr int kZstdCompressionLevel = 19;
+
 bool ICowWriter::AddCopy(uint64_t new_block, uint64_t old_block) {
     if (!ValidateNewBlock(new_block)) {
         return false;
@@ -93,11 +103,16 @@ CowWriter::CowWriter(const CowOptions& options) : ICowWriter(options), fd_(-1) {
     SetupHeaders();
 }
 
+CowWriter::~CowWriter() {
+    StopCompressWorkers();
+}
+
 void CowWriter::SetupHeaders() {
     header_ = {};
     header_.magic = kCowMagicNumber;
     header_.major_version = kCowVersionMajor;
-    header_.minor_version = kCowVersionMinor;
+    // Only COWs that may contain deduplicated operations need minor version 1.
+    header_.minor_version = options_.dedup ? kCowVersionMinor : 0;
     header_.header_size = sizeof(CowHeader);
     header_.footer_size = sizeof(CowFooter);
     header_.op_size = sizeof(CowOperation);
@@ -115,6 +130,12 @@ bool CowWriter::ParseOptions() {
         compression_ = kCowCompressGz;
     } else if (options_.compression == "brotli") {
         compression_ = kCowCompressBrotli;
+    } else if (options_.compression == "lz4") {
+        compression_ = kCowCompressLz4;
+    } else if (options_.compression == "zstd") {
+        compression_ = kCowCompressZstd;
+    } else if (options_.compression == "auto") {
+        auto_compression_ = true;
     } else if (options_.compression == "none") {
         compression_ = kCowCompressNone;
     } else if (!options_.compression.empty()) {
@@ -246,6 +267,11 @@ bool CowWriter::OpenForAppend(uint64_t label) {
 
     options_.block_size = header_.block_size;
     options_.cluster_ops = header_.cluster_ops;
+    if (options_.dedup && header_.minor_version < kCowVersionMinor) {
+        LOG(INFO) << "COW minor version " << header_.minor_version
+                  << " does not support deduplication, disabling it";
+        options_.dedup = false;
+    }
 
     // Reset this, since we're going to reimport all operations.
     footer_.op.num_ops = 0;
@@ -280,42 +306,265 @@ bool CowWriter::EmitCopy(uint64_t new_block, uint64_t old_block) {
 bool CowWriter::EmitRawBlocks(uint64_t new_block_start, const void* data, size_t size) {
     const uint8_t* iter = reinterpret_cast<const uint8_t*>(data);
     CHECK(!merge_in_progress_);
-    for (size_t i = 0; i < size / header_.block_size; i++) {
-        CowOperation op = {};
-        op.type = kCowReplaceOp;
-        op.new_block = new_block_start + i;
-        op.source = next_data_pos_;
+    size_t num_blocks = size / header_.block_size;
+    if (options_.num_compress_threads > 1 && num_blocks > 1 &&
+        (compression_ || auto_compression_)) {
+        return EmitRawBlocksParallel(new_block_start, iter, num_blocks);
+    }
 
-        if (compression_) {
-            auto data = Compress(iter, header_.block_size);
-            if (data.empty()) {
-                PLOG(ERROR) << "AddRawBlocks: compression failed";
-                return false;
-            }
-            if (data.size() > std::numeric_limits<uint16_t>::max()) {
-                LOG(ERROR) << "Compressed block is too large: " << data.size() << " bytes";
-                return false;
+    for (size_t i = 0; i < num_blocks; i++) {
+        uint8_t compression;
+        std::basic_string<uint8_t> compressed;
+        if (!CompressBlock(iter, &compression, &compressed)) {
+            return false;
+        }
+        if (!EmitBlock(new_block_start + i, iter, compression, compressed)) {
+            return false;
+        }
+        iter += header_.block_size;
+    }
+    return true;
+}
+
+// Number of blocks handed to a compression thread at a time.
+static constexpr size_t kBlocksPerCompressTask = 64;
+
+// A run of consecutive blocks being compressed by the compression threads.
+struct CowWriter::CompressBatch {
+    const uint8_t* data = nullptr;
+    size_t first = 0;
+    size_t count = 0;
+    std::vector<uint8_t> compression;
+    std::vector<std::basic_string<uint8_t>> compressed;
+    // Guarded by compress_lock_.
+    size_t pending_tasks = 0;
+    bool failed = false;
+};
+
+// Blocks are compressed in batches by a pool of threads. While one batch is
+// being compressed, the calling thread writes out the previous one in block
+// order, so the resulting COW is identical to the one written serially.
+bool CowWriter::EmitRawBlocksParallel(uint64_t new_block_start, const uint8_t* data,
+                                      size_t num_blocks) {
+    if (compress_threads_.empty()) {
+        for (uint32_t i = 0; i < options_.num_compress_threads; i++) {
+            compress_threads_.emplace_back([this]() -> void { CompressWorker(); });
+        }
+    }
+    size_t batch_size = compress_threads_.size() * kBlocksPerCompressTask;
+
+    CompressBatch batches[2];
+    auto start_batch = [&, this](CompressBatch* batch, size_t first) -> void {
+        batch->data = data + first * header_.block_size;
+        batch->first = first;
+        batch->count = std::min(batch_size, num_blocks - first);
+        StartCompressBatch(batch);
+    };
+
+    start_batch(&batches[0], 0);
+    for (size_t n = 0;; n++) {
+        CompressBatch* current = &batches[n % 2];
+        CompressBatch* next = &batches[(n + 1) % 2];
+
+        size_t next_first = current->first + current->count;
+        if (next_first < num_blocks) {
+            start_batch(next, next_first);
+        }
+        if (!WaitCompressBatch(current)) {
+            if (next_first < num_blocks) {
+                WaitCompressBatch(next);
             }
-            op.compression = compression_;
-            op.data_length = static_cast<uint16_t>(data.size());
+            return false;
+        }
 
-            if (!WriteOperation(op, data.data(), data.size())) {
-                PLOG(ERROR) << "AddRawBlocks: write failed";
+        for (size_t i = 0; i < current->count; i++) {
+            if (!EmitBlock(new_block_start + current->first + i,
+                           current->data + i * header_.block_size, current->compression[i],
+                           current->compressed[i])) {
+                if (next_first < num_blocks) {
+                    WaitCompressBatch(next);
+                }
                 return false;
             }
-        } else {
-            op.data_length = static_cast<uint16_t>(header_.block_size);
-            if (!WriteOperation(op, iter, header_.block_size)) {
+        }
+        if (next_first >= num_blocks) {
+            break;
+        }
+    }
+    return true;
+}
+
+void CowWriter::StartCompressBatch(CompressBatch* batch) {
+    batch->compression.resize(batch->count);
+    batch->compressed.resize(batch->count);
+
+    std::lock_guard<std::mutex> lock(compress_lock_);
+    batch->failed = false;
+    batch->pending_tasks = 0;
+    for (size_t begin = 0; begin < batch->count; begin += kBlocksPerCompressTask) {
+        size_t end = std::min(begin + kBlocksPerCompressTask, batch->count);
+        compress_tasks_.push({batch, begin, end});
+        batch->pending_tasks++;
+    }
+    compress_cv_.notify_all();
+}
+
+bool CowWriter::WaitCompressBatch(CompressBatch* batch) {
+    std::unique_lock<std::mutex> lock(compress_lock_);
+    compress_done_cv_.wait(lock, [batch]() -> bool { return batch->pending_tasks == 0; });
+    return !batch->failed;
+}
+
+void CowWriter::CompressWorker() {
+    std::unique_lock<std::mutex> lock(compress_lock_);
+    while (true) {
+        compress_cv_.wait(lock,
+                          [this]() -> bool { return compress_stopping_ || !compress_tasks_.empty(); });
+        if (compress_tasks_.empty()) {
+            return;
+        }
+        CompressTask task = compress_tasks_.front();
+        compress_tasks_.pop();
+        lock.unlock();
+
+        CompressBatch* batch = task.batch;
+        bool ok = true;
+        for (size_t i = task.begin; ok && i < task.end; i++) {
+            ok = CompressBlock(batch->data + i * header_.block_size, &batch->compression[i],
+                               &batch->compressed[i]);
+        }
+
+        lock.lock();
+        if (!ok) {
+            batch->failed = true;
+        }
+        if (--batch->pending_tasks == 0) {
+            compress_done_cv_.notify_all();
+        }
+    }
+}
+
+void CowWriter::StopCompressWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(compress_lock_);
+        compress_stopping_ = true;
+    }
+    compress_cv_.notify_all();
+    for (auto& thread : compress_threads_) {
+        thread.join();
+    }
+    compress_threads_.clear();
+}
+
+bool CowWriter::CompressBlock(const void* data, uint8_t* compression,
+                              std::basic_string<uint8_t>* compressed) {
+    *compression = compression_;
+    if (auto_compression_) {
+        *compressed = CompressAuto(data, header_.block_size, compression);
+    } else if (*compression) {
+        *compressed = Compress(data, header_.block_size, *compression);
+    }
+
+    if (*compression) {
+        if (compressed->empty()) {
+            PLOG(ERROR) << "AddRawBlocks: compression failed";
+            return false;
+        }
+        if (compressed->size() > std::numeric_limits<uint16_t>::max()) {
+            LOG(ERROR) << "Compressed block is too large: " << compressed->size() << " bytes";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CowWriter::EmitBlock(uint64_t new_block, const void* data, uint8_t compression,
+                          const std::basic_string<uint8_t>& compressed) {
+    CowOperation op = {};
+    op.type = kCowReplaceOp;
+    op.new_block = new_block;
+    op.source = next_data_pos_;
+    op.compression = compression;
+
+    const void* encoded = data;
+    if (compression) {
+        op.data_length = static_cast<uint16_t>(compressed.size());
+        encoded = compressed.data();
+    } else {
+        op.data_length = static_cast<uint16_t>(header_.block_size);
+    }
+
+    size_t hash = 0;
+    if (options_.dedup) {
+        hash = std::hash<std::string_view>()(
+                std::string_view(reinterpret_cast<const char*>(data), header_.block_size));
+        uint64_t source;
+        if (FindDedupData(hash, op, encoded, &source)) {
+            op.source = source;
+            op.compression |= kCowCompressDedup;
+            if (!WriteOperation(op)) {
                 PLOG(ERROR) << "AddRawBlocks: write failed";
                 return false;
             }
+            return true;
         }
+    }
 
-        iter += header_.block_size;
+    if (!WriteOperation(op, encoded, op.data_length)) {
+        PLOG(ERROR) << "AddRawBlocks: write failed";
+        return false;
+    }
+    if (options_.dedup) {
+        AddDedupData(hash, op);
+    }
+    return true;
+}
+
+// Look for earlier data identical to |encoded|. A candidate with a matching
+// hash is verified against the COW, except when writing to /dev/null where
+// the data is never read back.
+bool CowWriter::FindDedupData(size_t hash, const CowOperation& op, const void* encoded,
+                              uint64_t* source) {
+    auto it = dedup_map_.find(hash);
+    if (it == dedup_map_.end()) {
+        return false;
+    }
+    const auto& candidate = *it->second;
+    if (candidate.compression != op.compression || candidate.data_length != op.data_length) {
+        return false;
+    }
+    if (!is_dev_null_) {
+        dedup_buffer_.resize(candidate.data_length);
+        if (!android::base::ReadFullyAtOffset(fd_, dedup_buffer_.data(), candidate.data_length,
+                                              candidate.source) ||
+            memcmp(dedup_buffer_.data(), encoded, candidate.data_length) != 0) {
+            return false;
+        }
     }
+    dedup_lru_.splice(dedup_lru_.begin(), dedup_lru_, it->second);
+    *source = candidate.source;
     return true;
 }
 
+// Remember the data just written for |op|. It replaces any earlier data with
+// the same hash, and the least recently used entry is dropped once there are
+// more than |dedup_max_entries|.
+void CowWriter::AddDedupData(size_t hash, const CowOperation& op) {
+    DedupData data = {hash, op.source, op.data_length, op.compression};
+    auto it = dedup_map_.find(hash);
+    if (it != dedup_map_.end()) {
+        *it->second = data;
+        dedup_lru_.splice(dedup_lru_.begin(), dedup_lru_, it->second);
+        return;
+    }
+    dedup_lru_.emplace_front(data);
+    dedup_map_.emplace(hash, dedup_lru_.begin());
+    if (dedup_lru_.size() > options_.dedup_max_entries) {
+        dedup_map_.erase(dedup_lru_.back().hash);
+        dedup_lru_.pop_back();
+    }
+}
+
 bool CowWriter::EmitZeroBlocks(uint64_t new_block_start, uint64_t num_blocks) {
     CHECK(!merge_in_progress_);
     for (uint64_t i = 0; i < num_blocks; i++) {
@@ -372,8 +621,9 @@ bool CowWriter::EmitClusterIfNeeded() {
     return true;
 }
 
-std::basic_string<uint8_t> CowWriter::Compress(const void* data, size_t length) {
-    switch (compression_) {
+std::basic_string<uint8_t> CowWriter::Compress(const void* data, size_t length,
+                                               uint8_t compression) {
+    switch (compression) {
         case kCowCompressGz: {
             auto bound = compressBound(length);
             auto buffer = std::make_unique<uint8_t[]>(bound);
@@ -405,13 +655,76 @@ std::basic_string<uint8_t> CowWriter::Compress(const void* data, size_t length)
             }
             return std::basic_string<uint8_t>(buffer.get(), encoded_size);
         }
+        case kCowCompressLz4: {
+            auto bound = LZ4_compressBound(length);
+            if (!bound) {
+                LOG(ERROR) << "LZ4_compressBound returned 0";
+                return {};
+            }
+            auto buffer = std::make_unique<uint8_t[]>(bound);
+
+            auto rv = LZ4_compress_HC(reinterpret_cast<const char*>(data),
+                                      reinterpret_cast<char*>(buffer.get()), length, bound,
+                                      LZ4HC_CLEVEL_MAX);
+            if (rv <= 0) {
+                LOG(ERROR) << "LZ4_compress_HC failed";
+                return {};
+            }
+            return std::basic_string<uint8_t>(buffer.get(), rv);
+        }
+        case kCowCompressZstd: {
+            auto bound = ZSTD_compressBound(length);
+            auto buffer = std::make_unique<uint8_t[]>(bound);
+
+            auto rv = ZSTD_compress(buffer.get(), bound, data, length, kZstdCompressionLevel);
+            if (ZSTD_isError(rv)) {
+                LOG(ERROR) << "ZSTD_compress failed: " << ZSTD_getErrorName(rv);
+                return {};
+            }
+            return std::basic_string<uint8_t>(buffer.get(), rv);
+        }
         default:
-            LOG(ERROR) << "unhandled compression type: " << compression_;
+            LOG(ERROR) << "unhandled compression type: " << static_cast<int>(compression);
             break;
     }
     return {};
 }
 
+// Encodings ordered from cheapest to most expensive to decompress.
+static constexpr uint8_t kAutoCompressionOrder[] = {
+        kCowCompressNone, kCowCompressLz4, kCowCompressZstd, kCowCompressGz, kCowCompressBrotli,
+};
+
+// Compress the block with every encoding, then keep the first one in
+// decompression cost order whose size is within the budget. Returns an empty
+// string with |compression| set to kCowCompressNone if the block is best
+// stored as-is.
+std::basic_string<uint8_t> CowWriter::CompressAuto(const void* data, size_t length,
+                                                   uint8_t* compression) {
+    std::basic_string<uint8_t> encoded[std::size(kAutoCompressionOrder)];
+    size_t smallest = length;
+    for (size_t i = 1; i < std::size(kAutoCompressionOrder); i++) {
+        encoded[i] = Compress(data, length, kAutoCompressionOrder[i]);
+        if (encoded[i].empty()) {
+            *compression = kAutoCompressionOrder[i];
+            return {};
+        }
+        smallest = std::min(smallest, encoded[i].size());
+    }
+
+    uint64_t budget = smallest + smallest * options_.auto_compression_budget / 100;
+    for (size_t i = 0; i < std::size(kAutoCompressionOrder); i++) {
+        size_t size = i ? encoded[i].size() : length;
+        if (size <= budget) {
+            *compression = kAutoCompressionOrder[i];
+            return std::move(encoded[i]);
+        }
+    }
+    // Unreachable: the smallest encoding is always within the budget.
+    *compression = kCowCompressNone;
+    return {};
+}
+
 // TODO: Fix compilation issues when linking libcrypto library
 // when snapuserd is compiled as part of ramdisk.
 static void SHA256(const void*, size_t, uint8_t[]) {
@@ -530,15 +843,18 @@ bool CowWriter::WriteOperation(const CowOperation& op, const void* data, size_t
 void CowWriter::AddOperation(const CowOperation& op) {
     footer_.op.num_ops++;
 
+    // Deduplicated operations do not store any data of their own.
+    uint64_t data_size = IsDedupOp(op) ? 0 : op.data_length;
+
     if (op.type == kCowClusterOp) {
         current_cluster_size_ = 0;
         current_data_size_ = 0;
     } else if (header_.cluster_ops) {
         current_cluster_size_ += sizeof(op);
-        current_data_size_ += op.data_length;
+        current_data_size_ += data_size;
     }
 
-    next_data_pos_ += op.data_length + GetNextDataOffset(op, header_.cluster_ops);
+    next_data_pos_ += data_size + GetNextDataOffset(op, header_.cluster_ops);
     next_op_pos_ += sizeof(CowOperation) + GetNextOpOffset(op, header_.cluster_ops);
     ops_.insert(ops_.size(), reinterpret_cast<const uint8_t*>(&op), sizeof(op));
 }
@@ -22,7 +22,10 @@ namespace snapshot {
 
 static constexpr uint64_t kCowMagicNumber = 0x436f77634f572121ULL;
 static constexpr uint32_t kCowVersionMajor = 2;
-static constexpr uint32_t kCowVersionMinor = 0;
+// Minor version 1 adds deduplicated replace operations (kCowCompressDedup).
+// Writers only use it when deduplicating, so that other COWs stay readable by
+// readers that predate it.
+static constexpr uint32_t kCowVersionMinor = 1;
 
 static constexpr uint32_t kCowVersionManifest = 2;
 
@@ -154,6 +157,14 @@ static constexpr uint8_t kCowFooterOp = -1;
 static constexpr uint8_t kCowCompressNone = 0;
 static constexpr uint8_t kCowCompressGz = 1;
 static constexpr uint8_t kCowCompressBrotli = 2;
+static constexpr uint8_t kCowCompressLz4 = 3;
+static constexpr uint8_t kCowCompressZstd = 4;
+
+// Flag set in the compression field of a replace operation whose data is
+// shared with an earlier replace operation. |source| and |data_length| refer
+// to the earlier data, and no data is stored after the operation itself.
+// Only valid in COWs with a minor version of at least 1.
+static constexpr uint8_t kCowCompressDedup = 0x80;
 
 static constexpr uint8_t kCowReadAheadNotStarted = 0;
 static constexpr uint8_t kCowReadAheadInProgress = 1;
@@ -190,5 +201,10 @@ bool IsMetadataOp(const CowOperation& op);
 // Ops that have dependencies on old blocks, and must take care in their merge order
 bool IsOrderedOp(const CowOperation& op);
 
+// Ops that reference data written for an earlier op
+bool IsDedupOp(const CowOperation& op);
+// Compression type of the op's data, without flags
+uint8_t GetCompressionType(const CowOperation& op);
+
 }  // namespace snapshot
 }  // namespace android
@@ -28,6 +28,7 @@ namespace android {
 namespace snapshot {
 
 class ICowOpIter;
+class CowOps;
 
 // A ByteSink object handles requests for a buffer of a specific size. It
 // always owns the underlying buffer. It's designed to minimize potential
@@ -100,7 +101,11 @@ class ICowOpIter {
 
 class CowReader : public ICowReader {
   public:
-    CowReader();
+    // If |map_ops| is true, operations are not copied out of the COW when
+    // parsing. Instead the COW is mapped read-only and operations are
+    // accessed in place, which saves memory and parsing time on large COWs.
+    // If the COW cannot be mapped, operations are copied as usual.
+    explicit CowReader(bool map_ops = false);
     ~CowReader() { owned_fd_ = {}; }
 
     // Parse the COW, optionally, up to the given label. If no label is
@@ -124,6 +129,12 @@ class CowReader : public ICowReader {
 
     bool ReadData(const CowOperation& op, IByteSink* sink) override;
 
+    // Decode the data of |op| straight into |buffer|, which must hold exactly
+    // the decoded size of the operation. Compressed data is read with a single
+    // positional read into a per-thread buffer, and decompressor state is
+    // reused, so no allocations are made after the first call on a thread.
+    bool ReadData(const CowOperation& op, void* buffer, size_t buffer_size);
+
     bool GetRawBytes(uint64_t offset, void* buffer, size_t len, size_t* read);
 
     // Returns the total number of data ops that should be merged. This is the
@@ -147,7 +158,8 @@ class CowReader : public ICowReader {
     std::optional<CowFooter> footer_;
     uint64_t fd_size_;
     std::optional<uint64_t> last_label_;
-    std::shared_ptr<std::vector<CowOperation>> ops_;
+    bool map_ops_;
+    std::shared_ptr<CowOps> ops_;
     std::shared_ptr<std::vector<uint32_t>> merge_op_blocks_;
     std::shared_ptr<std::unordered_map<uint32_t, int>> block_map_;
     uint64_t num_total_data_ops_;
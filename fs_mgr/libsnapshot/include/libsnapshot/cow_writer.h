@@ -16,9 +16,16 @@
 
 #include <stdint.h>
 
+#include <condition_variable>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <queue>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 #include <libsnapshot/cow_format.h>
@@ -29,7 +36,12 @@ namespace snapshot {
 
 struct CowOptions {
     uint32_t block_size = 4096;
+
+    // One of "none", "gz", "brotli", "lz4", "zstd" or "auto". With "auto",
+    // each block is stored with the encoding that is cheapest to decompress
+    // among those within |auto_compression_budget| percent of the smallest.
     std::string compression;
+    uint32_t auto_compression_budget = 10;
 
     // Maximum number of blocks that can be written.
     std::optional<uint64_t> max_blocks;
@@ -41,6 +53,19 @@ struct CowOptions {
 
     // Preset the number of merged ops. Only useful for testing.
     uint64_t num_merge_ops = 0;
+
+    // Number of threads compressing blocks. The COW written is the same
+    // regardless of this setting.
+    uint32_t num_compress_threads = 1;
+
+    // Store a block whose contents were already written once as a reference
+    // to the existing data. This writes a COW with minor version 1. Ignored
+    // when appending to a COW with an older minor version.
+    bool dedup = false;
+
+    // Maximum number of distinct blocks remembered for deduplication. The
+    // least recently matched ones are forgotten first.
+    uint32_t dedup_max_entries = 16384;
 };
 
 // Interface for writing to a snapuserd COW. All operations are ordered; merges
@@ -99,6 +124,7 @@ class ICowWriter {
 class CowWriter : public ICowWriter {
   public:
     explicit CowWriter(const CowOptions& options);
+    ~CowWriter();
 
     // Set up the writer.
     // The file starts from the beginning.
@@ -127,6 +153,13 @@ class CowWriter : public ICowWriter {
     virtual bool EmitSequenceData(size_t num_ops, const uint32_t* data) override;
 
   private:
+    struct CompressBatch;
+    struct CompressTask {
+        CompressBatch* batch;
+        size_t begin;
+        size_t end;
+    };
+
     bool EmitCluster();
     bool EmitClusterIfNeeded();
     void SetupHeaders();
@@ -137,7 +170,21 @@ class CowWriter : public ICowWriter {
     bool WriteRawData(const void* data, size_t size);
     bool WriteOperation(const CowOperation& op, const void* data = nullptr, size_t size = 0);
     void AddOperation(const CowOperation& op);
-    std::basic_string<uint8_t> Compress(const void* data, size_t length);
+    bool EmitRawBlocksParallel(uint64_t new_block_start, const uint8_t* data, size_t num_blocks);
+    void StartCompressBatch(CompressBatch* batch);
+    bool WaitCompressBatch(CompressBatch* batch);
+    void CompressWorker();
+    void StopCompressWorkers();
+    bool EmitBlock(uint64_t new_block, const void* data, uint8_t compression,
+                   const std::basic_string<uint8_t>& compressed);
+    bool CompressBlock(const void* data, uint8_t* compression,
+                       std::basic_string<uint8_t>* compressed);
+    bool FindDedupData(size_t hash, const CowOperation& op, const void* encoded,
+                       uint64_t* source);
+    void AddDedupData(size_t hash, const CowOperation& op);
+    std::basic_string<uint8_t> Compress(const void* data, size_t length, uint8_t compression);
+    std::basic_string<uint8_t> CompressAuto(const void* data, size_t length,
+                                            uint8_t* compression);
     void InitPos();
 
     bool SetFd(android::base::borrowed_fd fd);
@@ -149,7 +196,8 @@ class CowWriter : public ICowWriter {
     android::base::borrowed_fd fd_;
     CowHeader header_{};
     CowFooter footer_{};
-    int compression_ = 0;
+    uint8_t compression_ = 0;
+    bool auto_compression_ = false;
     uint64_t next_op_pos_ = 0;
     uint64_t next_data_pos_ = 0;
     uint32_t cluster_size_ = 0;
@@ -162,6 +210,27 @@ class CowWriter : public ICowWriter {
     // :TODO: this is not efficient, but stringstream ubsan aborts because some
     // bytes overflow a signed char.
     std::basic_string<uint8_t> ops_;
+
+    // Data written by replace operations, most recently used first, and
+    // indexed by a hash of the block.
+    struct DedupData {
+        size_t hash;
+        uint64_t source;
+        uint16_t data_length;
+        uint8_t compression;
+    };
+    std::list<DedupData> dedup_lru_;
+    std::unordered_map<size_t, std::list<DedupData>::iterator> dedup_map_;
+    std::basic_string<uint8_t> dedup_buffer_;
+
+    // Threads compressing blocks for EmitRawBlocksParallel. They are started
+    // the first time they are needed and live as long as the writer.
+    std::vector<std::thread> compress_threads_;
+    std::mutex compress_lock_;
+    std::condition_variable compress_cv_;
+    std::condition_variable compress_done_cv_;
+    std::queue<CompressTask> compress_tasks_;
+    bool compress_stopping_ = false;
 };
 
 }  // namespace snapshot
@@ -139,7 +139,8 @@ static bool Inspect(const std::string& path, Options opt) {
 
         if (!opt.silent) std::cout << op << "\n";
 
-        if (opt.decompress && op.type == kCowReplaceOp && op.compression != kCowCompressNone) {
+        if (opt.decompress && op.type == kCowReplaceOp &&
+            GetCompressionType(op) != kCowCompressNone) {
             if (!reader.ReadData(op, &sink)) {
                 std::cerr << "Failed to decompress for :" << op << "\n";
                 success = false;
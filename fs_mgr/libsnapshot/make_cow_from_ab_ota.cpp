@@ -54,6 +54,8 @@ static constexpr uint64_t kBlockSize = 4096;
 DEFINE_string(source_tf, "", "Source target files (dir or zip file) for incremental payloads");
 DEFINE_string(compression, "gz", "Compression type to use (none or gz)");
 DEFINE_uint32(cluster_ops, 0, "Number of Cow Ops per cluster (0 or >1)");
+DEFINE_uint32(compress_threads, 1, "Number of threads compressing blocks");
+DEFINE_bool(dedup, false, "Store repeated blocks only once");
 
 void MyLogger(android::base::LogId, android::base::LogSeverity severity, const char*, const char*,
               unsigned int, const char* message) {
@@ -191,6 +193,8 @@ bool PayloadConverter::ProcessPartition(const PartitionUpdate& update) {
     options.block_size = kBlockSize;
     options.compression = FLAGS_compression;
     options.cluster_ops = FLAGS_cluster_ops;
+    options.num_compress_threads = FLAGS_compress_threads;
+    options.dedup = FLAGS_dedup;
 
     writer_ = std::make_unique<CowWriter>(options);
     if (!writer_->Initialize(std::move(fd))) {
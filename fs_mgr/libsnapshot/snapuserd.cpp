@@ -330,7 +330,9 @@ void Snapuserd::CheckMergeCompletionStatus() {
  * 12: Kernel will stop issuing metadata IO request when new-chunk ID is 0.
  */
 bool Snapuserd::ReadMetadata() {
-    reader_ = std::make_unique<CowReader>();
+    // COW operations are accessed in place; chunk_map_ holds pointers
+    // into the mapping for the lifetime of reader_.
+    reader_ = std::make_unique<CowReader>(true);
     CowHeader header;
     CowOptions options;
     bool metadata_found = false;
@@ -407,7 +409,7 @@ bool Snapuserd::ReadMetadata() {
 
 
         // Store operation pointer.
-        chunk_vec_.push_back(std::make_pair(ChunkToSector(data_chunk_id), cow_op));
+        InsertChunkOp(data_chunk_id, cow_op);
         num_ops += 1;
         offset += sizeof(struct disk_exception);
         cowop_rm_iter->Next();
@@ -579,7 +581,7 @@ bool Snapuserd::ReadMetadata() {
             de->new_chunk = data_chunk_id;
 
             // Store operation pointer.
-            chunk_vec_.push_back(std::make_pair(ChunkToSector(data_chunk_id), it->second));
+            InsertChunkOp(data_chunk_id, it->second);
             offset += sizeof(struct disk_exception);
             num_ops += 1;
             copy_ops++;
@@ -641,13 +643,10 @@ bool Snapuserd::ReadMetadata() {
                         << "Areas : " << vec_.size();
     }
 
-    chunk_vec_.shrink_to_fit();
+    chunk_map_.shrink_to_fit();
     vec_.shrink_to_fit();
     read_ahead_ops_.shrink_to_fit();
 
-    // Sort the vector based on sectors as we need this during un-aligned access
-    std::sort(chunk_vec_.begin(), chunk_vec_.end(), compare);
-
     SNAP_LOG(INFO) << "ReadMetadata completed. Final-chunk-id: " << data_chunk_id
                    << " Num Sector: " << ChunkToSector(data_chunk_id)
                    << " Replace-ops: " << replace_ops << " Zero-ops: " << zero_ops
@@ -663,6 +662,16 @@ bool Snapuserd::ReadMetadata() {
     return true;
 }
 
+// Chunk-ids handed out by ReadMetadata are monotonically increasing, hence
+// the table only ever grows at the tail. Any chunk-id which is skipped
+// (metadata pages and read-ahead boundaries) stays as nullptr.
+void Snapuserd::InsertChunkOp(chunk_t chunk, const CowOperation* cow_op) {
+    if (chunk >= chunk_map_.size()) {
+        chunk_map_.resize(chunk + 1, nullptr);
+    }
+    chunk_map_[chunk] = cow_op;
+}
+
 bool Snapuserd::MmapMetadata() {
     CowHeader header;
     reader_->GetHeader(&header);
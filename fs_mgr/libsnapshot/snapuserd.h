@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #include <bitset>
 #include <condition_variable>
@@ -165,6 +166,7 @@ class WorkerThread {
     void CloseFds() {
         ctrl_fd_ = {};
         backing_store_fd_ = {};
+        cow_data_fd_ = {};
     }
 
     // Functions interacting with dm-user
@@ -181,8 +183,8 @@ class WorkerThread {
     // IO Path
     bool ProcessIORequest();
     int ReadData(sector_t sector, size_t size);
-    int ReadUnalignedSector(sector_t sector, size_t size,
-                            std::vector<std::pair<sector_t, const CowOperation*>>::iterator& it);
+    int ReadUnalignedSector(sector_t sector, size_t size, sector_t cow_op_sector,
+                            const CowOperation* cow_op);
 
     // Processing COW operations
     bool ProcessCowOp(const CowOperation* cow_op);
@@ -193,6 +195,10 @@ class WorkerThread {
     bool ReadFromBaseDevice(const CowOperation* cow_op);
     bool GetReadAheadPopulatedBuffer(const CowOperation* cow_op);
 
+    // Batched IO
+    bool QueueCowOp(const CowOperation* cow_op);
+    bool SubmitBatchedReads();
+
     // Merge related functions
     bool ProcessMergeComplete(chunk_t chunk, void* buffer);
     loff_t GetMergeStartOffset(void* merged_buffer, void* unmerged_buffer,
@@ -215,6 +221,20 @@ class WorkerThread {
     unique_fd cow_fd_;
     unique_fd backing_store_fd_;
     unique_fd ctrl_fd_;
+    // Used only for positional reads of uncompressed data;
+    // reader_ owns cow_fd_ once InitReader is done.
+    unique_fd cow_data_fd_;
+
+    // A single 4k read which is deferred until the entire
+    // dm-user request has been walked so that reads to
+    // adjacent blocks can be coalesced.
+    struct BatchedRead {
+        int fd;
+        uint64_t offset;
+        void* buffer;
+    };
+    std::vector<BatchedRead> batched_reads_;
+    std::vector<struct iovec> iovecs_;
 
     std::shared_ptr<Snapuserd> snapuserd_;
     uint32_t exceptions_per_area_;
@@ -246,13 +266,12 @@ class Snapuserd : public std::enable_shared_from_this<Snapuserd> {
     bool InitializeWorkers();
     std::shared_ptr<Snapuserd> GetSharedPtr() { return shared_from_this(); }
 
-    std::vector<std::pair<sector_t, const CowOperation*>>& GetChunkVec() { return chunk_vec_; }
-    const std::vector<std::unique_ptr<uint8_t[]>>& GetMetadataVec() const { return vec_; }
-
-    static bool compare(std::pair<sector_t, const CowOperation*> p1,
-                        std::pair<sector_t, const CowOperation*> p2) {
-        return p1.first < p2.first;
+    // Returns the COW operation backing a data chunk, or nullptr if the
+    // chunk is a metadata chunk or is out of range.
+    const CowOperation* GetChunkOp(chunk_t chunk) const {
+        return (chunk < chunk_map_.size()) ? chunk_map_[chunk] : nullptr;
     }
+    const std::vector<std::unique_ptr<uint8_t[]>>& GetMetadataVec() const { return vec_; }
 
     void UnmapBufferRegion();
     bool MmapMetadata();
@@ -291,6 +310,7 @@ class Snapuserd : public std::enable_shared_from_this<Snapuserd> {
 
     bool GetRABuffer(std::unique_lock<std::mutex>* lock, uint64_t block, void* buffer);
     bool ReadMetadata();
+    void InsertChunkOp(chunk_t chunk, const CowOperation* cow_op);
     sector_t ChunkToSector(chunk_t chunk) { return chunk << CHUNK_SHIFT; }
     chunk_t SectorToChunk(sector_t sector) { return sector >> CHUNK_SHIFT; }
     bool IsBlockAligned(int read_size) { return ((read_size & (BLOCK_SZ - 1)) == 0); }
@@ -312,9 +332,11 @@ class Snapuserd : public std::enable_shared_from_this<Snapuserd> {
     // mapping of old-chunk to new-chunk
     std::vector<std::unique_ptr<uint8_t[]>> vec_;
 
-    // chunk_vec stores the pseudo mapping of sector
-    // to COW operations.
-    std::vector<std::pair<sector_t, const CowOperation*>> chunk_vec_;
+    // chunk_map_ stores the pseudo mapping of chunk-id
+    // to COW operations. Chunk-ids are allocated monotonically
+    // by ReadMetadata, so this is a dense table indexed directly
+    // by chunk-id; metadata chunks map to nullptr.
+    std::vector<const CowOperation*> chunk_map_;
 
     std::mutex lock_;
     std::condition_variable cv;
@@ -0,0 +1,132 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <linux/types.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <libsnapshot/cow_format.h>
+#include <libsnapshot/snapuserd_kernel.h>
+
+namespace android {
+namespace snapshot {
+
+// Compares the sector to COW operation lookup used by the snapuserd
+// read path. The synthetic COW mirrors the chunk-id allocation done by
+// Snapuserd::ReadMetadata: data chunks are handed out monotonically and
+// every (exceptions_per_area + 1)th chunk is reserved for metadata.
+class SyntheticCow {
+  public:
+    explicit SyntheticCow(size_t num_ops) : ops_(num_ops) {
+        uint32_t exceptions_per_area = (CHUNK_SIZE << SECTOR_SHIFT) / sizeof(struct disk_exception);
+        uint32_t stride = exceptions_per_area + 1;
+
+        chunk_t chunk = NUM_SNAPSHOT_HDR_CHUNKS + 1;
+        for (size_t i = 0; i < num_ops; i++) {
+            ops_[i].type = kCowReplaceOp;
+            ops_[i].new_block = i;
+
+            chunk_vec_.emplace_back(ChunkToSector(chunk), &ops_[i]);
+            if (chunk >= chunk_map_.size()) {
+                chunk_map_.resize(chunk + 1, nullptr);
+            }
+            chunk_map_[chunk] = &ops_[i];
+            data_chunks_.push_back(chunk);
+
+            chunk += 1;
+            if ((chunk % stride) == NUM_SNAPSHOT_HDR_CHUNKS) {
+                chunk += 1;
+            }
+        }
+    }
+
+    const CowOperation* LowerBound(sector_t sector) const {
+        auto it = std::lower_bound(chunk_vec_.begin(), chunk_vec_.end(),
+                                   std::make_pair(sector, nullptr), compare);
+        if (it == chunk_vec_.end()) {
+            return nullptr;
+        }
+        if (it->first != sector && it != chunk_vec_.begin()) {
+            --it;
+        }
+        return it->second;
+    }
+
+    const CowOperation* DirectIndex(sector_t sector) const {
+        chunk_t chunk = sector >> CHUNK_SHIFT;
+        return (chunk < chunk_map_.size()) ? chunk_map_[chunk] : nullptr;
+    }
+
+    // Sectors of randomly chosen data chunks, a few of them unaligned.
+    std::vector<sector_t> RandomSectors(size_t count) const {
+        std::mt19937 rng(0);
+        std::uniform_int_distribution<size_t> dist(0, data_chunks_.size() - 1);
+        std::vector<sector_t> sectors;
+        for (size_t i = 0; i < count; i++) {
+            sector_t sector = ChunkToSector(data_chunks_[dist(rng)]);
+            sectors.push_back(sector + (i % CHUNK_SIZE));
+        }
+        return sectors;
+    }
+
+  private:
+    static bool compare(std::pair<sector_t, const CowOperation*> p1,
+                        std::pair<sector_t, const CowOperation*> p2) {
+        return p1.first < p2.first;
+    }
+    static sector_t ChunkToSector(chunk_t chunk) { return chunk << CHUNK_SHIFT; }
+
+    std::vector<CowOperation> ops_;
+    std::vector<chunk_t> data_chunks_;
+    std::vector<std::pair<sector_t, const CowOperation*>> chunk_vec_;
+    std::vector<const CowOperation*> chunk_map_;
+};
+
+static constexpr size_t kNumLookups = 4096;
+
+static void BM_ChunkLookupLowerBound(benchmark::State& state) {
+    SyntheticCow cow(state.range(0));
+    auto sectors = cow.RandomSectors(kNumLookups);
+
+    for (auto _ : state) {
+        for (const auto& sector : sectors) {
+            benchmark::DoNotOptimize(cow.LowerBound(sector));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * sectors.size());
+}
+BENCHMARK(BM_ChunkLookupLowerBound)->Range(1 << 12, 1 << 22);
+
+static void BM_ChunkLookupDirectIndex(benchmark::State& state) {
+    SyntheticCow cow(state.range(0));
+    auto sectors = cow.RandomSectors(kNumLookups);
+
+    for (auto _ : state) {
+        for (const auto& sector : sectors) {
+            benchmark::DoNotOptimize(cow.DirectIndex(sector));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * sectors.size());
+}
+BENCHMARK(BM_ChunkLookupDirectIndex)->Range(1 << 12, 1 << 22);
+
+}  // namespace snapshot
+}  // namespace android
+
+BENCHMARK_MAIN();
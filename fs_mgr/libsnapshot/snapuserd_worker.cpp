@@ -19,6 +19,7 @@
 #include <csignal>
 #include <optional>
 #include <set>
+#include <tuple>
 
 #include <libsnapshot/snapuserd_client.h>
 
@@ -95,6 +96,12 @@ bool WorkerThread::InitializeFds() {
         return false;
     }
 
+    cow_data_fd_.reset(open(cow_device_.c_str(), O_RDONLY));
+    if (cow_data_fd_ < 0) {
+        SNAP_PLOG(ERROR) << "Open Failed: " << cow_device_;
+        return false;
+    }
+
     ctrl_fd_.reset(open(control_device_.c_str(), O_RDWR));
     if (ctrl_fd_ < 0) {
         SNAP_PLOG(ERROR) << "Unable to open " << control_device_;
@@ -134,7 +141,13 @@ void WorkerThread::ConstructKernelCowHeader() {
 // internal COW format and if the block is compressed,
 // it will be de-compressed.
 bool WorkerThread::ProcessReplaceOp(const CowOperation* cow_op) {
-    if (!reader_->ReadData(*cow_op, &bufsink_)) {
+    void* buffer = bufsink_.GetPayloadBuffer(BLOCK_SZ);
+    if (buffer == nullptr) {
+        SNAP_LOG(ERROR) << "ProcessReplaceOp: Failed to get payload buffer";
+        return false;
+    }
+
+    if (!reader_->ReadData(*cow_op, buffer, BLOCK_SZ)) {
         SNAP_LOG(ERROR) << "ProcessReplaceOp failed for block " << cow_op->new_block;
         return false;
     }
@@ -226,21 +239,116 @@ bool WorkerThread::ProcessCowOp(const CowOperation* cow_op) {
     return false;
 }
 
-int WorkerThread::ReadUnalignedSector(
-        sector_t sector, size_t size,
-        std::vector<std::pair<sector_t, const CowOperation*>>::iterator& it) {
+// Defer the reads which are served straight from the backing device or
+// from uncompressed data in the COW device so that SubmitBatchedReads()
+// can coalesce them. Everything else is processed in-line.
+bool WorkerThread::QueueCowOp(const CowOperation* cow_op) {
+    if (cow_op == nullptr) {
+        SNAP_LOG(ERROR) << "QueueCowOp: Invalid cow_op";
+        return false;
+    }
+
+    void* buffer = bufsink_.GetPayloadBuffer(BLOCK_SZ);
+    if (buffer == nullptr) {
+        SNAP_LOG(ERROR) << "QueueCowOp: Failed to get payload buffer";
+        return false;
+    }
+
+    switch (cow_op->type) {
+        case kCowCopyOp: {
+            if (GetReadAheadPopulatedBuffer(cow_op)) {
+                return true;
+            }
+            batched_reads_.push_back({backing_store_fd_.get(), cow_op->source * BLOCK_SZ, buffer});
+            return true;
+        }
+
+        case kCowReplaceOp: {
+            if (GetCompressionType(*cow_op) == kCowCompressNone &&
+                cow_op->data_length == BLOCK_SZ) {
+                batched_reads_.push_back({cow_data_fd_.get(), cow_op->source, buffer});
+                return true;
+            }
+            break;
+        }
+    }
+
+    return ProcessCowOp(cow_op);
+}
+
+static bool ReadFullyVectored(int fd, struct iovec* iov, int iovcnt, off_t offset) {
+    while (iovcnt > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(preadv(fd, iov, iovcnt, offset));
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return false;
+        }
+        offset += n;
+
+        // Skip over the fully read vectors and adjust a partially read one.
+        while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = reinterpret_cast<char*>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+// Issue all the deferred reads of a dm-user request. Reads are sorted
+// by device and offset; a run of adjacent blocks is read with a single
+// preadv() regardless of where the blocks land in the payload buffer.
+bool WorkerThread::SubmitBatchedReads() {
+    std::sort(batched_reads_.begin(), batched_reads_.end(),
+              [](const BatchedRead& a, const BatchedRead& b) {
+                  return std::tie(a.fd, a.offset) < std::tie(b.fd, b.offset);
+              });
+
+    size_t i = 0;
+    while (i < batched_reads_.size()) {
+        const BatchedRead& first = batched_reads_[i];
+        uint64_t next_offset = first.offset;
+
+        iovecs_.clear();
+        while (i < batched_reads_.size() && batched_reads_[i].fd == first.fd &&
+               batched_reads_[i].offset == next_offset) {
+            iovecs_.push_back({batched_reads_[i].buffer, BLOCK_SZ});
+            next_offset += BLOCK_SZ;
+            i++;
+        }
+
+        if (!ReadFullyVectored(first.fd, iovecs_.data(), iovecs_.size(), first.offset)) {
+            SNAP_PLOG(ERROR) << "Batched read failed at offset: " << first.offset
+                             << " blocks: " << iovecs_.size() << " from "
+                             << ((first.fd == backing_store_fd_.get()) ? backing_store_device_
+                                                                         : cow_device_);
+            batched_reads_.clear();
+            return false;
+        }
+    }
+
+    batched_reads_.clear();
+    return true;
+}
+
+int WorkerThread::ReadUnalignedSector(sector_t sector, size_t size, sector_t cow_op_sector,
+                                      const CowOperation* cow_op) {
     size_t skip_sector_size = 0;
 
     SNAP_LOG(DEBUG) << "ReadUnalignedSector: sector " << sector << " size: " << size
-                    << " Aligned sector: " << it->first;
+                    << " Aligned sector: " << cow_op_sector;
 
-    if (!ProcessCowOp(it->second)) {
+    if (!ProcessCowOp(cow_op)) {
         SNAP_LOG(ERROR) << "ReadUnalignedSector: " << sector << " failed of size: " << size
-                        << " Aligned sector: " << it->first;
+                        << " Aligned sector: " << cow_op_sector;
         return -1;
     }
 
-    int num_sectors_skip = sector - it->first;
+    int num_sectors_skip = sector - cow_op_sector;
 
     if (num_sectors_skip > 0) {
         skip_sector_size = num_sectors_skip << SECTOR_SHIFT;
@@ -249,7 +357,7 @@ int WorkerThread::ReadUnalignedSector(
 
         if (skip_sector_size == BLOCK_SZ) {
             SNAP_LOG(ERROR) << "Invalid un-aligned IO request at sector: " << sector
-                            << " Base-sector: " << it->first;
+                            << " Base-sector: " << cow_op_sector;
             return -1;
         }
 
@@ -272,34 +380,25 @@ int WorkerThread::ReadUnalignedSector(
  *
  */
 int WorkerThread::ReadData(sector_t sector, size_t size) {
-    std::vector<std::pair<sector_t, const CowOperation*>>& chunk_vec = snapuserd_->GetChunkVec();
-    std::vector<std::pair<sector_t, const CowOperation*>>::iterator it;
     /*
-     * chunk_map stores COW operation at 4k granularity.
-     * If the requested IO with the sector falls on the 4k
-     * boundary, then we can read the COW op directly without
-     * any issue.
+     * chunk_map stores COW operation at 4k granularity
+     * indexed by chunk-id. If the requested IO with the
+     * sector falls on the 4k boundary, then we can read
+     * the COW op directly without any issue.
      *
      * However, if the requested sector is not 4K aligned,
-     * then we will have the find the nearest COW operation
-     * and chop the 4K block to fetch the requested sector.
+     * then we have to chop the 4K block of the chunk
+     * containing the sector to fetch the requested sector.
      */
-    it = std::lower_bound(chunk_vec.begin(), chunk_vec.end(), std::make_pair(sector, nullptr),
-                          Snapuserd::compare);
+    chunk_t chunk = SectorToChunk(sector);
+    const CowOperation* cow_op = snapuserd_->GetChunkOp(chunk);
 
-    if (!(it != chunk_vec.end())) {
-        SNAP_LOG(ERROR) << "ReadData: Sector " << sector << " not found in chunk_vec";
+    if (cow_op == nullptr) {
+        SNAP_LOG(ERROR) << "ReadData: Sector " << sector << " not found in chunk_map";
         return -1;
     }
 
-    // We didn't find the required sector; hence find the previous sector
-    // as lower_bound will gives us the value greater than
-    // the requested sector
-    if (it->first != sector) {
-        if (it != chunk_vec.begin()) {
-            --it;
-        }
-
+    if (ChunkToSector(chunk) != sector) {
         /*
          * If the IO is spanned between two COW operations,
          * split the IO into two parts:
@@ -323,38 +422,36 @@ int WorkerThread::ReadData(sector_t sector, size_t size) {
          * 1: IO of size 512B from offset 3584 bytes (COW OP-1)
          * 2: IO of size 512B from offset 4096 bytes (COW OP-2)
          */
-        return ReadUnalignedSector(sector, size, it);
+        return ReadUnalignedSector(sector, size, ChunkToSector(chunk), cow_op);
     }
 
     int num_ops = DIV_ROUND_UP(size, BLOCK_SZ);
-    sector_t read_sector = sector;
+    batched_reads_.clear();
     while (num_ops) {
         // We have to make sure that the reads are
         // sequential; there shouldn't be a data
         // request merged with a metadata IO.
-        if (it->first != read_sector) {
-            SNAP_LOG(ERROR) << "Invalid IO request: read_sector: " << read_sector
-                            << " cow-op sector: " << it->first;
+        if (cow_op == nullptr) {
+            SNAP_LOG(ERROR) << "Invalid IO request at sector " << sector << " chunk: " << chunk
+                            << " has no COW op; pending read-request: " << num_ops;
             return -1;
-        } else if (!ProcessCowOp(it->second)) {
+        } else if (!QueueCowOp(cow_op)) {
             return -1;
         }
         num_ops -= 1;
-        read_sector += (BLOCK_SZ >> SECTOR_SHIFT);
-
-        it++;
+        chunk += 1;
+        cow_op = snapuserd_->GetChunkOp(chunk);
 
-        if (it == chunk_vec.end() && num_ops) {
-            SNAP_LOG(ERROR) << "Invalid IO request at sector " << sector
-                            << " COW ops completed; pending read-request: " << num_ops;
-            return -1;
-        }
         // Update the buffer offset
         bufsink_.UpdateBufferOffset(BLOCK_SZ);
     }
 
     // Reset the buffer offset
     bufsink_.ResetBufferOffset();
+
+    if (!SubmitBatchedReads()) {
+        return -1;
+    }
     return size;
 }
 
@@ -474,7 +571,6 @@ int WorkerThread::GetNumberOfMergedOps(void* merged_buffer, void* unmerged_buffe
     int merged_ops_cur_iter = 0;
     std::unordered_map<uint64_t, void*>& read_ahead_buffer_map = snapuserd_->GetReadAheadMap();
     *copy_op = false;
-    std::vector<std::pair<sector_t, const CowOperation*>>& chunk_vec = snapuserd_->GetChunkVec();
 
     // Find the operations which are merged in this cycle.
     while ((unmerged_exceptions + merged_ops_cur_iter) < exceptions_per_area_) {
@@ -496,21 +592,13 @@ int WorkerThread::GetNumberOfMergedOps(void* merged_buffer, void* unmerged_buffe
         if (cow_de->new_chunk != 0) {
             merged_ops_cur_iter += 1;
             offset += sizeof(struct disk_exception);
-            auto it = std::lower_bound(chunk_vec.begin(), chunk_vec.end(),
-                                       std::make_pair(ChunkToSector(cow_de->new_chunk), nullptr),
-                                       Snapuserd::compare);
+            const CowOperation* cow_op = snapuserd_->GetChunkOp(cow_de->new_chunk);
 
-            if (!(it != chunk_vec.end())) {
+            if (cow_op == nullptr) {
                 SNAP_LOG(ERROR) << "Sector not found: " << ChunkToSector(cow_de->new_chunk);
                 return -1;
             }
 
-            if (!(it->first == ChunkToSector(cow_de->new_chunk))) {
-                SNAP_LOG(ERROR) << "Invalid sector: " << ChunkToSector(cow_de->new_chunk);
-                return -1;
-            }
-            const CowOperation* cow_op = it->second;
-
             if (snapuserd_->IsReadAheadFeaturePresent() && cow_op->type == kCowCopyOp) {
                 *copy_op = true;
                 // Every single copy operation has to come from read-ahead
@@ -679,15 +767,12 @@ bool WorkerThread::DmuserWriteRequest() {
         return true;
     }
 
-    std::vector<std::pair<sector_t, const CowOperation*>>& chunk_vec = snapuserd_->GetChunkVec();
     size_t remaining_size = header->len;
     size_t read_size = std::min(PAYLOAD_SIZE, remaining_size);
 
     chunk_t chunk = SectorToChunk(header->sector);
-    auto it = std::lower_bound(chunk_vec.begin(), chunk_vec.end(),
-                               std::make_pair(header->sector, nullptr), Snapuserd::compare);
-
-    bool not_found = (it == chunk_vec.end() || it->first != header->sector);
+    bool not_found = (ChunkToSector(chunk) != header->sector ||
+                      snapuserd_->GetChunkOp(chunk) == nullptr);
 
     if (not_found) {
         void* buffer = bufsink_.GetPayloadBuffer(read_size);
@@ -727,7 +812,6 @@ bool WorkerThread::DmuserReadRequest() {
     size_t remaining_size = header->len;
     loff_t offset = 0;
     sector_t sector = header->sector;
-    std::vector<std::pair<sector_t, const CowOperation*>>& chunk_vec = snapuserd_->GetChunkVec();
     bool header_response = true;
     do {
         size_t read_size = std::min(PAYLOAD_SIZE, remaining_size);
@@ -750,9 +834,8 @@ bool WorkerThread::DmuserReadRequest() {
                 header->type = DM_USER_RESP_ERROR;
             }
         } else {
-            auto it = std::lower_bound(chunk_vec.begin(), chunk_vec.end(),
-                                       std::make_pair(header->sector, nullptr), Snapuserd::compare);
-            bool not_found = (it == chunk_vec.end() || it->first != header->sector);
+            bool not_found = (ChunkToSector(chunk) != header->sector ||
+                              snapuserd_->GetChunkOp(chunk) == nullptr);
             if (!offset && (read_size == BLOCK_SZ) && not_found) {
                 if (!ReadDiskExceptions(chunk, read_size)) {
                     SNAP_LOG(ERROR) << "ReadDiskExceptions failed for chunk id: " << chunk
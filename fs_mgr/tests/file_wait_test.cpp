@@ -20,9 +20,11 @@
 #include <android-base/unique_fd.h>
 #include <fs_mgr/file_wait.h>
 #include <gtest/gtest.h>
+#include <libdm/file_waiter.h>
 
 using namespace std::literals;
 using android::base::unique_fd;
+using android::dm::FileWaiter;
 using android::fs_mgr::WaitForFile;
 using android::fs_mgr::WaitForFileDeleted;
 
@@ -89,3 +91,60 @@ TEST_F(FileWaitTest, BadPath) {
     ASSERT_FALSE(WaitForFile("/this/path/does/not/exist", 5ms));
     EXPECT_EQ(errno, ENOENT);
 }
+
+TEST_F(FileWaitTest, CreateInMissingDirectoryAsync) {
+    std::string dir = test_file_ + ".dir";
+    std::string path = dir + "/subdir/file";
+    std::thread thread([&] {
+        std::this_thread::sleep_for(100ms);
+        ASSERT_EQ(mkdir(dir.c_str(), 0700), 0);
+        std::this_thread::sleep_for(100ms);
+        ASSERT_EQ(mkdir((dir + "/subdir").c_str(), 0700), 0);
+        std::this_thread::sleep_for(100ms);
+        unique_fd fd(open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0700));
+    });
+    EXPECT_TRUE(WaitForFile(path, 3s));
+    thread.join();
+
+    unlink(path.c_str());
+    rmdir((dir + "/subdir").c_str());
+    rmdir(dir.c_str());
+}
+
+TEST_F(FileWaitTest, ConcurrentWaits) {
+    std::vector<std::string> paths;
+    for (int i = 0; i < 4; i++) {
+        paths.emplace_back(test_file_ + "." + std::to_string(i));
+    }
+
+    std::vector<std::thread> waiters;
+    std::vector<int> results(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        waiters.emplace_back([&, i] { results[i] = WaitForFile(paths[i], 3s); });
+    }
+    std::this_thread::sleep_for(100ms);
+    for (const auto& path : paths) {
+        unique_fd fd(open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0700));
+    }
+    for (auto& waiter : waiters) {
+        waiter.join();
+    }
+    for (size_t i = 0; i < paths.size(); i++) {
+        EXPECT_TRUE(results[i]) << paths[i];
+        unlink(paths[i].c_str());
+    }
+}
+
+TEST_F(FileWaitTest, Stats) {
+    auto& waiter = FileWaiter::Instance();
+    waiter.ResetStats();
+
+    ASSERT_TRUE(WaitForFileDeleted(test_file_, 500ms));
+    ASSERT_FALSE(WaitForFile(test_file_, 50ms));
+
+    auto stats = waiter.GetStats();
+    EXPECT_EQ(stats.waits, 2);
+    EXPECT_EQ(stats.timeouts, 1);
+    EXPECT_GE(stats.max_time, 50ms);
+    EXPECT_GE(stats.total_time, stats.max_time);
+}
@@ -16,6 +16,8 @@
 
 #include "action_manager.h"
 
+#include <algorithm>
+
 #include <android-base/logging.h>
 
 namespace android {
@@ -37,9 +39,95 @@ ActionManager& ActionManager::GetInstance() {
 }
 
 void ActionManager::AddAction(std::unique_ptr<Action> action) {
+    IndexAction(action.get());
     actions_.emplace_back(std::move(action));
 }
 
+void ActionManager::IndexAction(Action* action) {
+    IndexedAction entry = {next_action_order_++, action};
+    if (!action->event_trigger().empty() || action->property_triggers().empty()) {
+        event_trigger_index_[action->event_trigger()].emplace_back(entry);
+        return;
+    }
+    for (const auto& [name, value] : action->property_triggers()) {
+        property_trigger_index_[name].emplace_back(entry);
+    }
+}
+
+void ActionManager::RemoveAction(const Action* action) {
+    auto remove_from = [action](ActionIndex* index, const std::string& name) {
+        auto it = index->find(name);
+        if (it == index->end()) return;
+        auto& entries = it->second;
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                     [action](const auto& e) { return e.action == action; }),
+                      entries.end());
+        if (entries.empty()) index->erase(it);
+    };
+    remove_from(&event_trigger_index_, action->event_trigger());
+    for (const auto& [name, value] : action->property_triggers()) {
+        remove_from(&property_trigger_index_, name);
+    }
+
+    auto eraser = [action](std::unique_ptr<Action>& a) { return a.get() == action; };
+    actions_.erase(std::remove_if(actions_.begin(), actions_.end(), eraser), actions_.end());
+}
+
+void ActionManager::CollectActions(const EventTrigger& event_trigger,
+                                   std::vector<Action*>* matched) const {
+    // An empty event matches any action without an event trigger whose property triggers are
+    // currently satisfied, so it can't be looked up by name.
+    if (event_trigger.empty()) {
+        for (const auto& action : actions_) {
+            if (action->CheckEvent(event_trigger)) matched->emplace_back(action.get());
+        }
+        return;
+    }
+    auto it = event_trigger_index_.find(event_trigger);
+    if (it == event_trigger_index_.end()) return;
+    for (const auto& entry : it->second) {
+        if (entry.action->CheckEvent(event_trigger)) matched->emplace_back(entry.action);
+    }
+}
+
+void ActionManager::CollectActions(const PropertyChange& property_change,
+                                   std::vector<Action*>* matched) const {
+    const auto& name = property_change.first;
+    // QueueAllPropertyActions() checks every action's property triggers against current values.
+    if (name.empty()) {
+        for (const auto& action : actions_) {
+            if (action->CheckEvent(property_change)) matched->emplace_back(action.get());
+        }
+        return;
+    }
+
+    static const std::vector<IndexedAction> kNoActions;
+    auto find = [](const ActionIndex& index, const std::string& key) -> const auto& {
+        auto it = index.find(key);
+        return it == index.end() ? kNoActions : it->second;
+    };
+    const auto& by_property = find(property_trigger_index_, name);
+    const auto& untriggered = find(event_trigger_index_, "");
+
+    std::vector<IndexedAction> candidates;
+    candidates.reserve(by_property.size() + untriggered.size());
+    std::merge(by_property.begin(), by_property.end(), untriggered.begin(), untriggered.end(),
+               std::back_inserter(candidates),
+               [](const auto& a, const auto& b) { return a.order < b.order; });
+    for (const auto& entry : candidates) {
+        if (entry.action->CheckEvent(property_change)) matched->emplace_back(entry.action);
+    }
+}
+
+void ActionManager::CollectActions(const BuiltinAction& builtin_action,
+                                   std::vector<Action*>* matched) const {
+    auto it = std::find_if(actions_.begin(), actions_.end(),
+                           [builtin_action](const auto& a) { return a.get() == builtin_action; });
+    if (it != actions_.end()) {
+        matched->emplace_back(it->get());
+    }
+}
+
 void ActionManager::QueueEventTrigger(const std::string& trigger) {
     auto lock = std::lock_guard{event_queue_lock_};
     event_queue_.emplace(trigger);
@@ -61,6 +149,7 @@ void ActionManager::QueueBuiltinAction(BuiltinFunction func, const std::string&
     action->AddCommand(std::move(func), {name}, 0);
 
     event_queue_.emplace(action.get());
+    IndexAction(action.get());
     actions_.emplace_back(std::move(action));
 }
 
@@ -68,12 +157,13 @@ void ActionManager::ExecuteOneCommand() {
     {
         auto lock = std::lock_guard{event_queue_lock_};
         // Loop through the event queue until we have an action to execute
+        std::vector<Action*> matched;
         while (current_executing_actions_.empty() && !event_queue_.empty()) {
-            for (const auto& action : actions_) {
-                if (std::visit([&action](const auto& event) { return action->CheckEvent(event); },
-                               event_queue_.front())) {
-                    current_executing_actions_.emplace(action.get());
-                }
+            matched.clear();
+            std::visit([this, &matched](const auto& event) { CollectActions(event, &matched); },
+                       event_queue_.front());
+            for (auto action : matched) {
+                current_executing_actions_.emplace(action);
             }
             event_queue_.pop();
         }
@@ -101,9 +191,7 @@ void ActionManager::ExecuteOneCommand() {
         current_executing_actions_.pop();
         current_command_ = 0;
         if (action->oneshot()) {
-            auto eraser = [&action](std::unique_ptr<Action>& a) { return a.get() == action; };
-            actions_.erase(std::remove_if(actions_.begin(), actions_.end(), eraser),
-                           actions_.end());
+            RemoveAction(action);
         }
     }
 }
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <map>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -50,7 +51,28 @@ class ActionManager {
     ActionManager(ActionManager const&) = delete;
     void operator=(ActionManager const&) = delete;
 
+    struct IndexedAction {
+        uint64_t order;
+        Action* action;
+    };
+    using ActionIndex = std::map<std::string, std::vector<IndexedAction>>;
+
+    void IndexAction(Action* action);
+    void RemoveAction(const Action* action);
+    void CollectActions(const EventTrigger& event_trigger, std::vector<Action*>* matched) const;
+    void CollectActions(const PropertyChange& property_change,
+                        std::vector<Action*>* matched) const;
+    void CollectActions(const BuiltinAction& builtin_action, std::vector<Action*>* matched) const;
+
     std::vector<std::unique_ptr<Action>> actions_;
+    // Actions are indexed by the names of the triggers that can start them, so that an event is
+    // only checked against the actions that refer to it. Actions with an event trigger are found
+    // by that event, and all others by each of their property triggers. The few actions with no
+    // trigger at all are kept under the empty event trigger. Each list is in the order that
+    // actions were added, which is the order they must run in.
+    ActionIndex event_trigger_index_;
+    ActionIndex property_trigger_index_;
+    uint64_t next_action_order_ = 0;
     std::queue<std::variant<EventTrigger, PropertyChange, BuiltinAction>> event_queue_
             GUARDED_BY(event_queue_lock_);
     mutable std::mutex event_queue_lock_;
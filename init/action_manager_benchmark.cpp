@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "action_manager.h"
+
+#include <random>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace init {
+
+// Roughly the shape of a device boot: many actions on property triggers, a few on events, and a
+// stream of property changes that mostly don't match any of them.
+static constexpr int kNumProperties = 1000;
+static constexpr int kNumPropertyChanges = 2000;
+static constexpr int kNumEvents = 20;
+
+static std::string PropertyName(int i) {
+    return StringPrintf("vendor.benchmark.prop%d", i);
+}
+
+static void AddActions(ActionManager* am, int num_actions) {
+    std::mt19937 rng(0);
+    std::uniform_int_distribution<int> property(0, kNumProperties - 1);
+    std::uniform_int_distribution<int> value(0, 3);
+    std::uniform_int_distribution<int> event(0, kNumEvents - 1);
+
+    auto function = [](const BuiltinArguments&) { return Result<void>{}; };
+    for (int i = 0; i < num_actions; i++) {
+        std::map<std::string, std::string> property_triggers;
+        std::string event_trigger;
+        if (i % 10 == 0) {
+            event_trigger = StringPrintf("event%d", event(rng));
+        } else {
+            property_triggers.emplace(PropertyName(property(rng)), std::to_string(value(rng)));
+        }
+        auto action = std::make_unique<Action>(false, nullptr, "<benchmark>", i, event_trigger,
+                                               property_triggers);
+        action->AddCommand(function, {"benchmark"}, 0);
+        am->AddAction(std::move(action));
+    }
+}
+
+static void BenchmarkPropertyChanges(benchmark::State& state) {
+    android::base::SetMinimumLogSeverity(android::base::WARNING);
+
+    ActionManager am;
+    AddActions(&am, state.range(0));
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> property(0, kNumProperties * 2 - 1);
+    std::uniform_int_distribution<int> value(0, 3);
+    std::vector<std::pair<std::string, std::string>> changes;
+    for (int i = 0; i < kNumPropertyChanges; i++) {
+        // Half of the changed properties have no triggers at all.
+        changes.emplace_back(PropertyName(property(rng)), std::to_string(value(rng)));
+    }
+
+    while (state.KeepRunning()) {
+        for (const auto& [name, value] : changes) {
+            am.QueuePropertyChange(name, value);
+        }
+        while (am.HasMoreCommands()) {
+            am.ExecuteOneCommand();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * changes.size());
+}
+
+BENCHMARK(BenchmarkPropertyChanges)->Arg(500)->Arg(2000)->Arg(8000);
+
+}  // namespace init
+}  // namespace android
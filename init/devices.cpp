@@ -171,6 +171,54 @@ bool SysfsPermissions::MatchWithSubsystem(const std::string& path,
     return Match(path);
 }
 
+void PermissionsMatcher::Add(const Permissions& permissions, size_t index) {
+    const auto& name = permissions.name_;
+    if (permissions.prefix_) {
+        FindOrAddNode(name).prefix_rules.emplace_back(index);
+    } else if (permissions.wildcard_) {
+        auto literal_prefix = name.substr(0, name.find_first_of("*?[\\"));
+        int flags = permissions.no_fnm_pathname_ ? 0 : FNM_PATHNAME;
+        FindOrAddNode(literal_prefix).wildcard_rules.emplace_back(WildcardRule{name, flags, index});
+    } else {
+        exact_rules_[name].emplace_back(index);
+    }
+}
+
+PermissionsMatcher::TrieNode& PermissionsMatcher::FindOrAddNode(const std::string& prefix) {
+    size_t node = 0;
+    for (char c : prefix) {
+        auto [it, inserted] = trie_[node].children.emplace(c, trie_.size());
+        if (inserted) {
+            trie_.emplace_back();
+        }
+        node = it->second;
+    }
+    return trie_[node];
+}
+
+void PermissionsMatcher::Match(const std::string& path, std::vector<size_t>* matches) const {
+    if (auto it = exact_rules_.find(path); it != exact_rules_.end()) {
+        matches->insert(matches->end(), it->second.begin(), it->second.end());
+    }
+
+    size_t node = 0;
+    for (size_t i = 0;; ++i) {
+        const auto& trie_node = trie_[node];
+        matches->insert(matches->end(), trie_node.prefix_rules.begin(),
+                        trie_node.prefix_rules.end());
+        for (const auto& rule : trie_node.wildcard_rules) {
+            if (fnmatch(rule.pattern.c_str(), path.c_str(), rule.flags) == 0) {
+                matches->emplace_back(rule.index);
+            }
+        }
+
+        if (i == path.size()) break;
+        auto child = trie_node.children.find(path[i]);
+        if (child == trie_node.children.end()) break;
+        node = child->second;
+    }
+}
+
 void SysfsPermissions::SetPermissions(const std::string& path) const {
     std::string attribute_file = path + "/" + attribute_;
     LOG(VERBOSE) << "fixup " << attribute_file << " " << uid() << " " << gid() << " " << std::oct
@@ -225,8 +273,25 @@ void DeviceHandler::FixupSysPermissions(const std::string& upath,
     // contain, so we prepend it...
     std::string path = "/sys" + upath;
 
-    for (const auto& s : sysfs_permissions_) {
-        if (s.MatchWithSubsystem(path, subsystem)) s.SetPermissions(path);
+    // This applies the same rules, in the same order, as calling MatchWithSubsystem() on each of
+    // sysfs_permissions_.
+    std::vector<size_t> matches;
+    sysfs_permissions_matcher_.Match(path, &matches);
+
+    std::vector<size_t> subsystem_matches;
+    std::string path_basename = Basename(path);
+    sysfs_permissions_matcher_.Match("/sys/class/" + subsystem + "/" + path_basename,
+                                     &subsystem_matches);
+    sysfs_permissions_matcher_.Match("/sys/bus/" + subsystem + "/devices/" + path_basename,
+                                     &subsystem_matches);
+    for (auto index : subsystem_matches) {
+        if (sysfs_permissions_[index].HasSubsystem(subsystem)) matches.emplace_back(index);
+    }
+
+    std::sort(matches.begin(), matches.end());
+    matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+    for (auto index : matches) {
+        sysfs_permissions_[index].SetPermissions(path);
     }
 
     if (!skip_restorecon_ && access(path.c_str(), F_OK) == 0) {
@@ -239,15 +304,18 @@ void DeviceHandler::FixupSysPermissions(const std::string& upath,
 
 std::tuple<mode_t, uid_t, gid_t> DeviceHandler::GetDevicePermissions(
     const std::string& path, const std::vector<std::string>& links) const {
-    // Search the perms list in reverse so that ueventd.$hardware can override ueventd.rc.
-    for (auto it = dev_permissions_.crbegin(); it != dev_permissions_.crend(); ++it) {
-        if (it->Match(path) || std::any_of(links.cbegin(), links.cend(),
-                                           [it](const auto& link) { return it->Match(link); })) {
-            return {it->perm(), it->uid(), it->gid()};
-        }
+    std::vector<size_t> matches;
+    dev_permissions_matcher_.Match(path, &matches);
+    for (const auto& link : links) {
+        dev_permissions_matcher_.Match(link, &matches);
+    }
+    if (matches.empty()) {
+        /* Default if nothing found. */
+        return {0600, 0, 0};
     }
-    /* Default if nothing found. */
-    return {0600, 0, 0};
+    // Use the last matching rule so that ueventd.$hardware can override ueventd.rc.
+    const auto& permissions = dev_permissions_[*std::max_element(matches.begin(), matches.end())];
+    return {permissions.perm(), permissions.uid(), permissions.gid()};
 }
 
 void DeviceHandler::MakeDevice(const std::string& path, bool block, int major, int minor,
@@ -543,6 +611,8 @@ DeviceHandler::DeviceHandler(std::vector<Permissions> dev_permissions,
                              bool skip_restorecon)
     : dev_permissions_(std::move(dev_permissions)),
       sysfs_permissions_(std::move(sysfs_permissions)),
+      dev_permissions_matcher_(dev_permissions_),
+      sysfs_permissions_matcher_(sysfs_permissions_),
       subsystems_(std::move(subsystems)),
       boot_devices_(std::move(boot_devices)),
       skip_restorecon_(skip_restorecon),
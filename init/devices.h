@@ -21,8 +21,10 @@
 #include <sys/types.h>
 
 #include <algorithm>
+#include <map>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <android-base/file.h>
@@ -37,6 +39,7 @@ namespace init {
 class Permissions {
   public:
     friend void TestPermissions(const Permissions& expected, const Permissions& test);
+    friend class PermissionsMatcher;
 
     Permissions(const std::string& name, mode_t perm, uid_t uid, gid_t gid, bool no_fnm_pathname);
 
@@ -68,12 +71,54 @@ class SysfsPermissions : public Permissions {
         : Permissions(name, perm, uid, gid, no_fnm_pathname), attribute_(attribute) {}
 
     bool MatchWithSubsystem(const std::string& path, const std::string& subsystem) const;
+    // Whether MatchWithSubsystem() also tries the /sys/class and /sys/bus paths for |subsystem|.
+    bool HasSubsystem(const std::string& subsystem) const {
+        return name().find(subsystem) != std::string::npos;
+    }
     void SetPermissions(const std::string& path) const;
 
   private:
     const std::string attribute_;
 };
 
+// An index over a list of Permissions, built once, that finds every rule matching a path
+// without calling Permissions::Match() on each rule in turn. Exact names are looked up in a hash
+// map, and rules ending in '*' are found by walking a trie of their prefixes along the path. Other
+// wildcard rules hang off the trie node for the literal text before their first wildcard, so
+// fnmatch() is only tried on the few rules that share a prefix with the path.
+class PermissionsMatcher {
+  public:
+    PermissionsMatcher() : trie_(1) {}
+    template <typename T>
+    explicit PermissionsMatcher(const std::vector<T>& permissions) : PermissionsMatcher() {
+        for (size_t i = 0; i < permissions.size(); ++i) {
+            Add(permissions[i], i);
+        }
+    }
+
+    // Appends the index of each rule that matches |path| to |matches|, in no particular order.
+    void Match(const std::string& path, std::vector<size_t>* matches) const;
+
+  private:
+    struct WildcardRule {
+        std::string pattern;
+        int flags;
+        size_t index;
+    };
+    struct TrieNode {
+        std::map<char, size_t> children;
+        std::vector<size_t> prefix_rules;
+        std::vector<WildcardRule> wildcard_rules;
+    };
+
+    void Add(const Permissions& permissions, size_t index);
+    TrieNode& FindOrAddNode(const std::string& prefix);
+
+    std::unordered_map<std::string, std::vector<size_t>> exact_rules_;
+    // trie_[0] is the root, for the empty prefix.
+    std::vector<TrieNode> trie_;
+};
+
 class Subsystem {
   public:
     friend class SubsystemParser;
@@ -135,6 +180,8 @@ class DeviceHandler : public UeventHandler {
 
     std::vector<Permissions> dev_permissions_;
     std::vector<SysfsPermissions> sysfs_permissions_;
+    PermissionsMatcher dev_permissions_matcher_;
+    PermissionsMatcher sysfs_permissions_matcher_;
     std::vector<Subsystem> subsystems_;
     std::set<std::string> boot_devices_;
     bool skip_restorecon_;
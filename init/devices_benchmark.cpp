@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "devices.h"
+
+#include <random>
+
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace init {
+
+// Roughly the shape of ueventd.rc plus a vendor ueventd.rc: mostly exact device names, some
+// prefixes, and a few fnmatch() patterns, replayed against the device nodes seen at coldboot.
+static constexpr int kNumPaths = 2000;
+
+static std::vector<Permissions> MakePermissions(int num_rules) {
+    std::vector<Permissions> permissions;
+    for (int i = 0; i < num_rules; i++) {
+        if (i % 10 == 0) {
+            permissions.emplace_back(StringPrintf("/dev/vendor%d/*", i), 0660, 0, 1000, false);
+        } else if (i % 25 == 1) {
+            permissions.emplace_back(StringPrintf("/dev/block/*/by-name/part%d", i), 0660, 0, 6,
+                                     false);
+        } else {
+            permissions.emplace_back(StringPrintf("/dev/device%d", i), 0660, 0, 1000, false);
+        }
+    }
+    return permissions;
+}
+
+static std::vector<std::string> MakePaths(int num_rules) {
+    std::mt19937 rng(0);
+    // Half of the paths don't match any rule.
+    std::uniform_int_distribution<int> rule(0, num_rules * 2 - 1);
+    std::vector<std::string> paths;
+    for (int i = 0; i < kNumPaths; i++) {
+        int n = rule(rng);
+        if (n % 10 == 0) {
+            paths.emplace_back(StringPrintf("/dev/vendor%d/node%d", n, i));
+        } else if (n % 25 == 1) {
+            paths.emplace_back(StringPrintf("/dev/block/platform/by-name/part%d", n));
+        } else {
+            paths.emplace_back(StringPrintf("/dev/device%d", n));
+        }
+    }
+    return paths;
+}
+
+static void BenchmarkLinearScan(benchmark::State& state) {
+    auto permissions = MakePermissions(state.range(0));
+    auto paths = MakePaths(state.range(0));
+
+    while (state.KeepRunning()) {
+        for (const auto& path : paths) {
+            for (auto it = permissions.crbegin(); it != permissions.crend(); ++it) {
+                if (it->Match(path)) {
+                    benchmark::DoNotOptimize(it->perm());
+                    break;
+                }
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * paths.size());
+}
+
+BENCHMARK(BenchmarkLinearScan)->Arg(100)->Arg(500)->Arg(2000);
+
+static void BenchmarkPermissionsMatcher(benchmark::State& state) {
+    auto permissions = MakePermissions(state.range(0));
+    auto paths = MakePaths(state.range(0));
+    PermissionsMatcher matcher(permissions);
+
+    std::vector<size_t> matches;
+    while (state.KeepRunning()) {
+        for (const auto& path : paths) {
+            matches.clear();
+            matcher.Match(path, &matches);
+            if (!matches.empty()) {
+                benchmark::DoNotOptimize(
+                        permissions[*std::max_element(matches.begin(), matches.end())].perm());
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * paths.size());
+}
+
+BENCHMARK(BenchmarkPermissionsMatcher)->Arg(100)->Arg(500)->Arg(2000);
+
+}  // namespace init
+}  // namespace android
@@ -328,5 +328,34 @@ TEST(device_handler, SysfsPermissionsMatchWithSubsystemBus) {
     EXPECT_EQ(1001U, permissions.gid());
 }
 
+TEST(device_handler, PermissionsMatcherMatchesLikeLinearScan) {
+    std::vector<Permissions> permissions = {
+            {"/dev/null", 0666, 0, 0, false},
+            {"/dev/input/*", 0660, 0, 1004, false},
+            {"/dev/block/*/by-name/*", 0660, 0, 6, false},
+            {"/dev/device*name*", 0660, 0, 1000, false},
+            {"/dev/device*name*", 0600, 0, 1000, true},
+            {"/dev/ttyHS[0-9]", 0660, 0, 1002, false},
+            {"/dev/input/event0", 0600, 0, 0, false},
+            {"/dev/*", 0600, 0, 0, false},
+            {"/dev/null", 0600, 0, 0, false},
+    };
+    PermissionsMatcher matcher(permissions);
+
+    for (const auto& path :
+         {"/dev/null", "/dev/input/event0", "/dev/input/mice", "/dev/block/platform/by-name/boot",
+          "/dev/block/platform/soc/by-name/boot", "/dev/devicename", "/dev/device/name",
+          "/dev/device/subdir/name", "/dev/ttyHS3", "/dev/ttyHS", "/dev", "", "/sys/null"}) {
+        std::vector<size_t> expected;
+        for (size_t i = 0; i < permissions.size(); ++i) {
+            if (permissions[i].Match(path)) expected.emplace_back(i);
+        }
+        std::vector<size_t> matches;
+        matcher.Match(path, &matches);
+        std::sort(matches.begin(), matches.end());
+        EXPECT_EQ(expected, matches) << path;
+    }
+}
+
 }  // namespace init
 }  // namespace android
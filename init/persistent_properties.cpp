@@ -22,7 +22,11 @@
 #include <sys/system_properties.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <chrono>
+#include <map>
 #include <memory>
+#include <optional>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -36,6 +40,9 @@ using android::base::ReadFdToString;
 using android::base::StartsWith;
 using android::base::unique_fd;
 using android::base::WriteStringToFd;
+using std::chrono::steady_clock;
+
+using namespace std::literals;
 
 namespace android {
 namespace init {
@@ -46,6 +53,38 @@ namespace {
 
 constexpr const char kLegacyPersistentPropertyDir[] = "/data/property";
 
+// The persistent property file is a serialized PersistentProperties message. Since protobuf
+// concatenates repeated fields, an update can be appended to the file as a message holding a
+// single record, and the file still parses as one message, in which the last record for a name
+// wins. Appended records are fsync()'ed together once the property service goes idle, and the
+// file is compacted by rewriting it once most of it is stale.
+//
+// This is only used from the property service thread.
+struct PersistentPropertyJournal {
+    // Which file the state below belongs to.
+    std::string filename;
+    std::map<std::string, std::string> properties;
+    unique_fd fd;
+    size_t file_size = 0;
+    // The size of the file once compacted, that is, of |properties| serialized.
+    size_t compacted_size = 0;
+    std::optional<steady_clock::time_point> first_unsynced_write;
+    steady_clock::time_point last_write;
+};
+
+PersistentPropertyJournal journal;
+
+// The file is compacted when it is both larger than this, and at least twice its compacted size.
+constexpr size_t kMinCompactionSize = 64 * 1024;
+// Appended records are fsync()'ed when no property has been written for kSyncIdleDelay, but never
+// later than kMaxSyncDelay after the first unsynced write.
+constexpr auto kSyncIdleDelay = 10ms;
+constexpr auto kMaxSyncDelay = 100ms;
+
+// The tag of each record in a serialized PersistentProperties: field number and wire type 2
+// (length-delimited).
+constexpr uint8_t kRecordTag = (PersistentProperties::kPropertiesFieldNumber << 3) | 2;
+
 void AddPersistentProperty(const std::string& name, const std::string& value,
                            PersistentProperties* persistent_properties) {
     auto persistent_property_record = persistent_properties->add_properties();
@@ -140,37 +179,52 @@ PersistentProperties LoadPersistentPropertiesFromMemory() {
     return persistent_properties;
 }
 
-Result<std::string> ReadPersistentPropertyFile() {
-    const std::string temp_filename = persistent_property_filename + ".tmp";
-    if (access(temp_filename.c_str(), F_OK) == 0) {
-        LOG(INFO)
-            << "Found temporary property file while attempting to persistent system properties"
-               " a previous persistent property write may have failed";
-        unlink(temp_filename.c_str());
-    }
-    auto file_contents = ReadFile(persistent_property_filename);
-    if (!file_contents.ok()) {
-        return Error() << "Unable to read persistent property file: " << file_contents.error();
-    }
-    return *file_contents;
+std::string SerializeRecord(const std::string& name, const std::string& value) {
+    PersistentProperties persistent_properties;
+    AddPersistentProperty(name, value, &persistent_properties);
+    return persistent_properties.SerializeAsString();
 }
 
-}  // namespace
+PersistentProperties ToPersistentProperties(const std::map<std::string, std::string>& properties) {
+    PersistentProperties persistent_properties;
+    for (const auto& [name, value] : properties) {
+        AddPersistentProperty(name, value, &persistent_properties);
+    }
+    return persistent_properties;
+}
 
-Result<PersistentProperties> LoadPersistentPropertyFile() {
-    auto file_contents = ReadPersistentPropertyFile();
-    if (!file_contents.ok()) return file_contents.error();
+// Parses |contents| one record at a time, stopping at the first record that is incomplete or
+// corrupt, as left behind by an append that was interrupted. Returns how many bytes were valid.
+size_t ParsePersistentPropertyRecords(const std::string& contents,
+                                      std::map<std::string, std::string>* properties) {
+    size_t pos = 0;
+    while (pos < contents.size()) {
+        if (static_cast<uint8_t>(contents[pos]) != kRecordTag) break;
+
+        size_t record_pos = pos + 1;
+        uint64_t length = 0;
+        bool length_complete = false;
+        for (int shift = 0; shift < 35 && record_pos < contents.size(); shift += 7) {
+            uint8_t byte = contents[record_pos++];
+            length |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                length_complete = true;
+                break;
+            }
+        }
+        if (!length_complete || length > contents.size() - record_pos) break;
 
-    PersistentProperties persistent_properties;
-    if (persistent_properties.ParseFromString(*file_contents)) return persistent_properties;
+        PersistentProperties::PersistentPropertyRecord record;
+        if (!record.ParseFromArray(contents.data() + record_pos, length)) break;
 
-    // If the file cannot be parsed in either format, then we don't have any recovery
-    // mechanisms, so we delete it to allow for future writes to take place successfully.
-    unlink(persistent_property_filename.c_str());
-    return Error() << "Unable to parse persistent property file: Could not parse protobuf";
+        (*properties)[record.name()] = record.value();
+        pos = record_pos + length;
+    }
+    return pos;
 }
 
-Result<void> WritePersistentPropertyFile(const PersistentProperties& persistent_properties) {
+Result<void> WriteCompactedPersistentPropertyFile(
+        const PersistentProperties& persistent_properties) {
     const std::string temp_filename = persistent_property_filename + ".tmp";
     unique_fd fd(TEMP_FAILURE_RETRY(
         open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_NOFOLLOW | O_TRUNC | O_CLOEXEC, 0600)));
@@ -207,9 +261,26 @@ Result<void> WritePersistentPropertyFile(const PersistentProperties& persistent_
     return {};
 }
 
-// Persistent properties are not written often, so we rather not keep any data in memory and read
-// then rewrite the persistent property file for each update.
-void WritePersistentProperty(const std::string& name, const std::string& value) {
+// Rewrites the file from |journal.properties| and starts appending to the new file.
+Result<void> CompactJournal() {
+    journal.fd.reset();
+    if (auto result = WriteCompactedPersistentPropertyFile(
+                ToPersistentProperties(journal.properties));
+        !result.ok()) {
+        return result.error();
+    }
+    journal.fd.reset(TEMP_FAILURE_RETRY(open(persistent_property_filename.c_str(),
+                                             O_WRONLY | O_APPEND | O_NOFOLLOW | O_CLOEXEC)));
+    if (journal.fd == -1) {
+        return ErrnoError() << "Unable to open persistent property file for appending";
+    }
+    journal.file_size = journal.compacted_size;
+    // The rewrite has already been fsync()'ed.
+    journal.first_unsynced_write.reset();
+    return {};
+}
+
+Result<void> OpenJournal() {
     auto persistent_properties = LoadPersistentPropertyFile();
 
     if (!persistent_properties.ok()) {
@@ -217,22 +288,153 @@ void WritePersistentProperty(const std::string& name, const std::string& value)
                    << persistent_properties.error();
         persistent_properties = LoadPersistentPropertiesFromMemory();
     }
-    auto it = std::find_if(persistent_properties->mutable_properties()->begin(),
-                           persistent_properties->mutable_properties()->end(),
-                           [&name](const auto& record) { return record.name() == name; });
-    if (it != persistent_properties->mutable_properties()->end()) {
-        it->set_name(name);
-        it->set_value(value);
+
+    journal = {};
+    journal.filename = persistent_property_filename;
+    for (const auto& record : persistent_properties->properties()) {
+        journal.properties[record.name()] = record.value();
+    }
+    for (const auto& [name, value] : journal.properties) {
+        journal.compacted_size += SerializeRecord(name, value).size();
+    }
+
+    journal.fd.reset(TEMP_FAILURE_RETRY(open(persistent_property_filename.c_str(),
+                                             O_WRONLY | O_APPEND | O_NOFOLLOW | O_CLOEXEC)));
+    struct stat sb;
+    if (journal.fd != -1 && fstat(journal.fd, &sb) == 0 &&
+        static_cast<size_t>(sb.st_size) == journal.compacted_size) {
+        journal.file_size = sb.st_size;
+        return {};
+    }
+    // Start from a compacted file if the existing one is missing, has stale or partial records,
+    // or was recovered from memory.
+    return CompactJournal();
+}
+
+// Whether |journal| still refers to the current persistent property file.
+bool JournalIsOpen() {
+    if (journal.fd == -1 || journal.filename != persistent_property_filename) {
+        return false;
+    }
+    struct stat sb;
+    return fstat(journal.fd, &sb) == 0 && sb.st_nlink > 0;
+}
+
+Result<std::string> ReadPersistentPropertyFile() {
+    const std::string temp_filename = persistent_property_filename + ".tmp";
+    if (access(temp_filename.c_str(), F_OK) == 0) {
+        LOG(INFO)
+            << "Found temporary property file while attempting to persistent system properties"
+               " a previous persistent property write may have failed";
+        unlink(temp_filename.c_str());
+    }
+    auto file_contents = ReadFile(persistent_property_filename);
+    if (!file_contents.ok()) {
+        return Error() << "Unable to read persistent property file: " << file_contents.error();
+    }
+    return *file_contents;
+}
+
+}  // namespace
+
+Result<PersistentProperties> LoadPersistentPropertyFile() {
+    auto file_contents = ReadPersistentPropertyFile();
+    if (!file_contents.ok()) return file_contents.error();
+
+    std::map<std::string, std::string> properties;
+    size_t valid_size = ParsePersistentPropertyRecords(*file_contents, &properties);
+    if (valid_size == file_contents->size()) return ToPersistentProperties(properties);
+
+    PersistentProperties persistent_properties;
+    if (persistent_properties.ParseFromString(*file_contents)) {
+        properties.clear();
+        for (const auto& record : persistent_properties.properties()) {
+            properties[record.name()] = record.value();
+        }
+        return ToPersistentProperties(properties);
+    }
+
+    if (valid_size > 0) {
+        LOG(ERROR) << "Ignoring " << file_contents->size() - valid_size
+                   << " bytes of incomplete records at the end of the persistent property file";
+        return ToPersistentProperties(properties);
+    }
+
+    // If the file cannot be parsed in either format, then we don't have any recovery
+    // mechanisms, so we delete it to allow for future writes to take place successfully.
+    unlink(persistent_property_filename.c_str());
+    return Error() << "Unable to parse persistent property file: Could not parse protobuf";
+}
+
+Result<void> WritePersistentPropertyFile(const PersistentProperties& persistent_properties) {
+    // The file is replaced, so the next write reloads it.
+    journal = {};
+    return WriteCompactedPersistentPropertyFile(persistent_properties);
+}
+
+// Persistent properties are written by appending the new record to the persistent property file,
+// rather than rewriting the whole file for each update.
+void WritePersistentProperty(const std::string& name, const std::string& value) {
+    if (!JournalIsOpen()) {
+        if (auto result = OpenJournal(); !result.ok()) {
+            LOG(ERROR) << "Could not store persistent property: " << result.error();
+            journal = {};
+            return;
+        }
+    }
+
+    auto it = journal.properties.find(name);
+    if (it != journal.properties.end()) {
+        if (it->second == value) return;
+        journal.compacted_size -= SerializeRecord(name, it->second).size();
+    }
+    journal.properties[name] = value;
+
+    auto record = SerializeRecord(name, value);
+    journal.compacted_size += record.size();
+    if (!WriteStringToFd(record, journal.fd)) {
+        PLOG(ERROR) << "Unable to append persistent property, rewriting the file";
+        journal.file_size = SIZE_MAX;
     } else {
-        AddPersistentProperty(name, value, &persistent_properties.value());
+        journal.file_size += record.size();
+        auto now = steady_clock::now();
+        if (!journal.first_unsynced_write) {
+            journal.first_unsynced_write = now;
+        }
+        journal.last_write = now;
+    }
+
+    if (journal.file_size > std::max(kMinCompactionSize, 2 * journal.compacted_size)) {
+        if (auto result = CompactJournal(); !result.ok()) {
+            LOG(ERROR) << "Could not store persistent property: " << result.error();
+            journal = {};
+        }
     }
+}
+
+std::optional<std::chrono::milliseconds> PersistentPropertySyncTimeout() {
+    if (!journal.first_unsynced_write) {
+        return {};
+    }
+    auto deadline = std::min(journal.last_write + kSyncIdleDelay,
+                             *journal.first_unsynced_write + kMaxSyncDelay);
+    auto timeout = std::chrono::ceil<std::chrono::milliseconds>(deadline - steady_clock::now());
+    return std::max(timeout, 0ms);
+}
 
-    if (auto result = WritePersistentPropertyFile(*persistent_properties); !result.ok()) {
-        LOG(ERROR) << "Could not store persistent property: " << result.error();
+void SyncPersistentProperties() {
+    if (!journal.first_unsynced_write) {
+        return;
+    }
+    if (journal.fd != -1 && fsync(journal.fd) != 0) {
+        PLOG(ERROR) << "Unable to fsync() persistent property file";
     }
+    journal.first_unsynced_write.reset();
 }
 
 PersistentProperties LoadPersistentProperties() {
+    // Writes after this reload the file, rather than trusting what was read before.
+    journal = {};
     auto persistent_properties = LoadPersistentPropertyFile();
 
     if (!persistent_properties.ok()) {
@@ -17,6 +17,8 @@
 #ifndef _INIT_PERSISTENT_PROPERTIES_H
 #define _INIT_PERSISTENT_PROPERTIES_H
 
+#include <chrono>
+#include <optional>
 #include <string>
 
 #include "result.h"
@@ -28,6 +30,12 @@ namespace init {
 PersistentProperties LoadPersistentProperties();
 void WritePersistentProperty(const std::string& name, const std::string& value);
 
+// WritePersistentProperty() appends to the persistent property file without waiting for it to
+// reach storage. Returns how long the caller may wait before calling SyncPersistentProperties(),
+// or nullopt if there is nothing to sync. Writes that land within the wait share one fsync().
+std::optional<std::chrono::milliseconds> PersistentPropertySyncTimeout();
+void SyncPersistentProperties();
+
 // Exposed only for testing
 Result<PersistentProperties> LoadPersistentPropertyFile();
 Result<void> WritePersistentPropertyFile(const PersistentProperties& persistent_properties);
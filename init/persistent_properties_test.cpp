@@ -17,6 +17,7 @@
 #include "persistent_properties.h"
 
 #include <errno.h>
+#include <sys/stat.h>
 
 #include <vector>
 
@@ -155,5 +156,100 @@ TEST(persistent_properties, UpdatePropertyBadParse) {
     EXPECT_FALSE(it == read_back_properties.properties().end());
 }
 
+TEST(persistent_properties, UpdatesAreAppended) {
+    TemporaryFile tf;
+    ASSERT_TRUE(tf.fd != -1);
+    persistent_property_filename = tf.path;
+
+    std::vector<std::pair<std::string, std::string>> persistent_properties = {
+        {"persist.sys.locale", "en-US"},
+        {"persist.sys.timezone", "America/Los_Angeles"},
+    };
+    ASSERT_RESULT_OK(
+            WritePersistentPropertyFile(VectorToPersistentProperties(persistent_properties)));
+    auto initial_contents = ReadFile(tf.path);
+    ASSERT_RESULT_OK(initial_contents);
+
+    WritePersistentProperty("persist.sys.locale", "pt-BR");
+    WritePersistentProperty("persist.sys.locale", "fr-FR");
+    WritePersistentProperty("persist.test.new", "1");
+    SyncPersistentProperties();
+
+    // The original contents are left in place, and the file still parses as a single message.
+    auto file_contents = ReadFile(tf.path);
+    ASSERT_RESULT_OK(file_contents);
+    EXPECT_EQ(0u, file_contents->find(*initial_contents));
+    PersistentProperties parsed;
+    EXPECT_TRUE(parsed.ParseFromString(*file_contents));
+    EXPECT_EQ(5, parsed.properties().size());
+
+    std::vector<std::pair<std::string, std::string>> persistent_properties_expected = {
+        {"persist.sys.locale", "fr-FR"},
+        {"persist.sys.timezone", "America/Los_Angeles"},
+        {"persist.test.new", "1"},
+    };
+    auto read_back_properties = LoadPersistentProperties();
+    CheckPropertiesEqual(persistent_properties_expected, read_back_properties);
+}
+
+TEST(persistent_properties, IncompleteAppendIsIgnored) {
+    TemporaryFile tf;
+    ASSERT_TRUE(tf.fd != -1);
+    persistent_property_filename = tf.path;
+
+    std::vector<std::pair<std::string, std::string>> persistent_properties = {
+        {"persist.sys.timezone", "America/Los_Angeles"},
+    };
+    ASSERT_RESULT_OK(
+            WritePersistentPropertyFile(VectorToPersistentProperties(persistent_properties)));
+    WritePersistentProperty("persist.sys.locale", "pt-BR");
+
+    // Simulate losing power partway through appending another record.
+    auto record = VectorToPersistentProperties({{"persist.sys.locale", "fr-FR"}});
+    auto partial_record = record.SerializeAsString().substr(0, 10);
+    auto file_contents = ReadFile(tf.path);
+    ASSERT_RESULT_OK(file_contents);
+    ASSERT_RESULT_OK(WriteFile(tf.path, *file_contents + partial_record));
+
+    std::vector<std::pair<std::string, std::string>> persistent_properties_expected = {
+        {"persist.sys.timezone", "America/Los_Angeles"},
+        {"persist.sys.locale", "pt-BR"},
+    };
+    auto read_back_properties = LoadPersistentProperties();
+    CheckPropertiesEqual(persistent_properties_expected, read_back_properties);
+
+    // The next write starts over from a compacted file.
+    WritePersistentProperty("persist.test.new", "1");
+    persistent_properties_expected.emplace_back("persist.test.new", "1");
+    read_back_properties = LoadPersistentProperties();
+    CheckPropertiesEqual(persistent_properties_expected, read_back_properties);
+}
+
+TEST(persistent_properties, FileIsCompacted) {
+    TemporaryFile tf;
+    ASSERT_TRUE(tf.fd != -1);
+    persistent_property_filename = tf.path;
+
+    ASSERT_RESULT_OK(WritePersistentPropertyFile(
+            VectorToPersistentProperties({{"persist.sys.timezone", "America/Los_Angeles"}})));
+
+    std::string value(1024, 'a');
+    for (int i = 0; i < 1000; i++) {
+        value[0] = 'a' + i % 26;
+        WritePersistentProperty("persist.test.large", value);
+    }
+
+    struct stat sb;
+    ASSERT_EQ(0, stat(tf.path, &sb));
+    EXPECT_LT(sb.st_size, 256 * 1024);
+
+    std::vector<std::pair<std::string, std::string>> persistent_properties_expected = {
+        {"persist.sys.timezone", "America/Los_Angeles"},
+        {"persist.test.large", value},
+    };
+    auto read_back_properties = LoadPersistentProperties();
+    CheckPropertiesEqual(persistent_properties_expected, read_back_properties);
+}
+
 }  // namespace init
 }  // namespace android
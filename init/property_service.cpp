@@ -1321,7 +1321,7 @@ static void PropertyServiceThread() {
     }
 
     while (true) {
-        auto pending_functions = epoll.Wait(std::nullopt);
+        auto pending_functions = epoll.Wait(PersistentPropertySyncTimeout());
         if (!pending_functions.ok()) {
             LOG(ERROR) << pending_functions.error();
         } else {
@@ -1329,6 +1329,9 @@ static void PropertyServiceThread() {
                 (*function)();
             }
         }
+        if (PersistentPropertySyncTimeout() == 0ms) {
+            SyncPersistentProperties();
+        }
     }
 }
 
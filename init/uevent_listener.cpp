@@ -29,6 +29,10 @@
 namespace android {
 namespace init {
 
+// How many uevents to receive per system call. Coldboot and hotplug deliver them in bursts.
+static constexpr size_t kUeventBatchSize = 16;
+static constexpr size_t kUeventSlotSize = UEVENT_MSG_LEN + 2;
+
 static void ParseEvent(const char* msg, Uevent* uevent) {
     uevent->partition_num = -1;
     uevent->major = -1;
@@ -86,7 +90,8 @@ static void ParseEvent(const char* msg, Uevent* uevent) {
     }
 }
 
-UeventListener::UeventListener(size_t uevent_socket_rcvbuf_size) {
+UeventListener::UeventListener(size_t uevent_socket_rcvbuf_size)
+    : msg_buffer_(new char[kUeventBatchSize * kUeventSlotSize]) {
     device_fd_.reset(uevent_open_socket(uevent_socket_rcvbuf_size, true));
     if (device_fd_ == -1) {
         LOG(FATAL) << "Could not open uevent socket";
@@ -95,26 +100,43 @@ UeventListener::UeventListener(size_t uevent_socket_rcvbuf_size) {
     fcntl(device_fd_, F_SETFL, O_NONBLOCK);
 }
 
-ReadUeventResult UeventListener::ReadUevent(Uevent* uevent) const {
-    char msg[UEVENT_MSG_LEN + 2];
-    int n = uevent_kernel_multicast_recv(device_fd_, msg, UEVENT_MSG_LEN);
-    if (n <= 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            PLOG(ERROR) << "Error reading from Uevent Fd";
+// Reads and handles uevents, a batch per recvmmsg(), until the socket has none left or
+// |callback| asks to stop.  Invalid uevents, such as those that overflow UEVENT_MSG_LEN or do not
+// come from the kernel, are skipped.
+ListenerAction UeventListener::ReadUevents(const ListenerCallback& callback) const {
+    // Reused for every uevent, so that its strings keep their capacity.
+    Uevent uevent;
+    ssize_t lengths[kUeventBatchSize];
+    while (true) {
+        int count = uevent_kernel_multicast_recv_batch(device_fd_, msg_buffer_.get(),
+                                                       kUeventSlotSize, kUeventBatchSize, lengths);
+        if (count <= 0) {
+            if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                PLOG(ERROR) << "Error reading from Uevent Fd";
+            }
+            return ListenerAction::kContinue;
         }
-        return ReadUeventResult::kFailed;
-    }
-    if (n >= UEVENT_MSG_LEN) {
-        LOG(ERROR) << "Uevent overflowed buffer, discarding";
-        return ReadUeventResult::kInvalid;
-    }
 
-    msg[n] = '\0';
-    msg[n + 1] = '\0';
+        for (int i = 0; i < count; ++i) {
+            ssize_t n = lengths[i];
+            if (n <= 0) continue;
+            // This also leaves room in the slot for the two terminating '\0's.
+            if (n >= UEVENT_MSG_LEN) {
+                LOG(ERROR) << "Uevent overflowed buffer, discarding";
+                continue;
+            }
 
-    ParseEvent(msg, uevent);
+            char* msg = msg_buffer_.get() + i * kUeventSlotSize;
+            msg[n] = '\0';
+            msg[n + 1] = '\0';
 
-    return ReadUeventResult::kSuccess;
+            ParseEvent(msg, &uevent);
+            if (callback(uevent) == ListenerAction::kStop) return ListenerAction::kStop;
+        }
+
+        // A short batch means the socket has been drained.
+        if (static_cast<size_t>(count) < kUeventBatchSize) return ListenerAction::kContinue;
+    }
 }
 
 // RegenerateUevents*() walks parts of the /sys tree and pokes the uevent files to cause the kernel
@@ -134,13 +156,7 @@ ListenerAction UeventListener::RegenerateUeventsForDir(DIR* d,
         write(fd, "add\n", 4);
         close(fd);
 
-        Uevent uevent;
-        ReadUeventResult result;
-        while ((result = ReadUevent(&uevent)) != ReadUeventResult::kFailed) {
-            // Skip processing the uevent if it is invalid.
-            if (result == ReadUeventResult::kInvalid) continue;
-            if (callback(uevent) == ListenerAction::kStop) return ListenerAction::kStop;
-        }
+        if (ReadUevents(callback) == ListenerAction::kStop) return ListenerAction::kStop;
     }
 
     dirent* de;
@@ -212,13 +228,7 @@ void UeventListener::Poll(const ListenerCallback& callback,
         if (ufd.revents & POLLIN) {
             // We're non-blocking, so if we receive a poll event keep processing until
             // we have exhausted all uevent messages.
-            Uevent uevent;
-            ReadUeventResult result;
-            while ((result = ReadUevent(&uevent)) != ReadUeventResult::kFailed) {
-                // Skip processing the uevent if it is invalid.
-                if (result == ReadUeventResult::kInvalid) continue;
-                if (callback(uevent) == ListenerAction::kStop) return;
-            }
+            if (ReadUevents(callback) == ListenerAction::kStop) return;
         }
     }
 }
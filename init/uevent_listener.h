@@ -21,6 +21,7 @@
 
 #include <chrono>
 #include <functional>
+#include <memory>
 #include <optional>
 
 #include <android-base/unique_fd.h>
@@ -37,12 +38,6 @@ enum class ListenerAction {
     kContinue,  // Continue regenerating uevents as we haven't seen the one(s) we're interested in.
 };
 
-enum class ReadUeventResult {
-    kSuccess = 0,  // Uevent was successfully read.
-    kFailed,       // Uevent reading has failed.
-    kInvalid,      // An Invalid Uevent was read (like say, the msg received is >= UEVENT_MSG_LEN).
-};
-
 using ListenerCallback = std::function<ListenerAction(const Uevent&)>;
 
 class UeventListener {
@@ -56,10 +51,12 @@ class UeventListener {
               const std::optional<std::chrono::milliseconds> relative_timeout = {}) const;
 
   private:
-    ReadUeventResult ReadUevent(Uevent* uevent) const;
+    ListenerAction ReadUevents(const ListenerCallback& callback) const;
     ListenerAction RegenerateUeventsForDir(DIR* d, const ListenerCallback& callback) const;
 
     android::base::unique_fd device_fd_;
+    // Receive buffer for kUeventBatchSize messages of UEVENT_MSG_LEN + 2 bytes each.
+    std::unique_ptr<char[]> msg_buffer_;
 };
 
 }  // namespace init
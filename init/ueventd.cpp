@@ -24,10 +24,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <set>
 #include <thread>
 
@@ -88,10 +91,12 @@
 // 1) ueventd regenerates uevents by doing the /sys traversal and listens to the netlink socket for
 //    the generated uevents.  It writes these uevents into a queue represented by a vector.
 //
-// 2) ueventd forks 'n' separate uevent handler subprocesses and has each of them to handle the
-//    uevents in the queue based on a starting offset (their process number) and a stride (the total
-//    number of processes).  Note that no IPC happens at this point and only const functions from
-//    DeviceHandler should be called from this context.
+// 2) ueventd forks 'n' separate uevent handler subprocesses, which take uevents from the queue one
+//    at a time until it is empty.  The index of the next uevent to handle is an atomic counter in
+//    memory shared between the subprocesses, so a subprocess that gets slow uevents (for example
+//    firmware loads) doesn't leave the others idle.  The same is done afterwards for the
+//    parallel restorecon directories.  Note that no other IPC happens at this point and only const
+//    functions from DeviceHandler should be called from this context.
 //
 // 3) In parallel to the subprocesses handling the uevents, the main thread of ueventd calls
 //    selinux_android_restorecon() recursively on /sys/class, /sys/block, and /sys/devices.
@@ -111,6 +116,26 @@
 namespace android {
 namespace init {
 
+// Statistics that each coldboot subprocess reports back to ueventd through shared memory.
+struct ColdBootWorkerStats {
+    uint64_t uevents;
+    uint64_t restorecons;
+    std::chrono::microseconds uevent_time;
+    std::chrono::microseconds restorecon_time;
+    std::chrono::microseconds slowest_uevent_time;
+    char slowest_uevent[96];
+};
+
+// Memory shared between ueventd and its coldboot subprocesses, followed by one
+// ColdBootWorkerStats per subprocess.
+struct ColdBootSharedState {
+    std::atomic<size_t> next_uevent;
+    std::atomic<size_t> next_restorecon;
+};
+
+static_assert(std::atomic<size_t>::is_always_lock_free,
+              "coldboot work counters are shared across processes");
+
 class ColdBoot {
   public:
     ColdBoot(UeventListener& uevent_listener,
@@ -123,15 +148,19 @@ class ColdBoot {
           enable_parallel_restorecon_(enable_parallel_restorecon),
           parallel_restorecon_queue_(parallel_restorecon_queue) {}
 
+    ~ColdBoot();
+
     void Run();
 
   private:
-    void UeventHandlerMain(unsigned int process_num, unsigned int total_processes);
+    void UeventHandlerMain(unsigned int process_num);
     void RegenerateUevents();
+    void MapSharedState();
     void ForkSubProcesses();
     void WaitForSubProcesses();
-    void RestoreConHandler(unsigned int process_num, unsigned int total_processes);
+    void RestoreConHandler(unsigned int process_num);
     void GenerateRestoreCon(const std::string& directory);
+    void LogWorkerStats();
 
     UeventListener& uevent_listener_;
     std::vector<std::unique_ptr<UeventHandler>>& uevent_handlers_;
@@ -146,22 +175,47 @@ class ColdBoot {
     std::vector<std::string> restorecon_queue_;
 
     std::vector<std::string> parallel_restorecon_queue_;
+
+    ColdBootSharedState* shared_state_ = nullptr;
+    ColdBootWorkerStats* worker_stats_ = nullptr;
+    size_t shared_state_size_ = 0;
 };
 
-void ColdBoot::UeventHandlerMain(unsigned int process_num, unsigned int total_processes) {
-    for (unsigned int i = process_num; i < uevent_queue_.size(); i += total_processes) {
+ColdBoot::~ColdBoot() {
+    if (shared_state_) {
+        munmap(shared_state_, shared_state_size_);
+    }
+}
+
+void ColdBoot::UeventHandlerMain(unsigned int process_num) {
+    auto& stats = worker_stats_[process_num];
+
+    for (size_t i = shared_state_->next_uevent++; i < uevent_queue_.size();
+         i = shared_state_->next_uevent++) {
         auto& uevent = uevent_queue_[i];
+        auto start = std::chrono::steady_clock::now();
 
         for (auto& uevent_handler : uevent_handlers_) {
             uevent_handler->HandleUevent(uevent);
         }
+
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start);
+        stats.uevents++;
+        stats.uevent_time += duration;
+        if (duration > stats.slowest_uevent_time) {
+            stats.slowest_uevent_time = duration;
+            strlcpy(stats.slowest_uevent, uevent.path.c_str(), sizeof(stats.slowest_uevent));
+        }
     }
 }
 
-void ColdBoot::RestoreConHandler(unsigned int process_num, unsigned int total_processes) {
+void ColdBoot::RestoreConHandler(unsigned int process_num) {
+    auto& stats = worker_stats_[process_num];
     android::base::Timer t_process;
 
-    for (unsigned int i = process_num; i < restorecon_queue_.size(); i += total_processes) {
+    for (size_t i = shared_state_->next_restorecon++; i < restorecon_queue_.size();
+         i = shared_state_->next_restorecon++) {
         android::base::Timer t;
         auto& dir = restorecon_queue_[i];
 
@@ -173,7 +227,9 @@ void ColdBoot::RestoreConHandler(unsigned int process_num, unsigned int total_pr
             LOG(INFO) << "took " << t.duration().count() <<"ms restorecon '"
                         << dir.c_str() << "' on process '" << process_num  <<"'";
         }
+        stats.restorecons++;
     }
+    stats.restorecon_time = t_process.duration();
 
     //Calculate process restorecon time
     LOG(VERBOSE) << "took " << t_process.duration().count() << "ms on process '"
@@ -214,7 +270,22 @@ void ColdBoot::RegenerateUevents() {
     });
 }
 
+void ColdBoot::MapSharedState() {
+    shared_state_size_ =
+            sizeof(ColdBootSharedState) + num_handler_subprocesses_ * sizeof(ColdBootWorkerStats);
+    void* shared_memory = mmap(nullptr, shared_state_size_, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared_memory == MAP_FAILED) {
+        PLOG(FATAL) << "mmap() of coldboot shared state failed";
+    }
+    // Anonymous mappings are zero filled, so every counter and statistic starts at zero.
+    shared_state_ = new (shared_memory) ColdBootSharedState();
+    worker_stats_ = reinterpret_cast<ColdBootWorkerStats*>(shared_state_ + 1);
+}
+
 void ColdBoot::ForkSubProcesses() {
+    MapSharedState();
+
     for (unsigned int i = 0; i < num_handler_subprocesses_; ++i) {
         auto pid = fork();
         if (pid < 0) {
@@ -222,9 +293,9 @@ void ColdBoot::ForkSubProcesses() {
         }
 
         if (pid == 0) {
-            UeventHandlerMain(i, num_handler_subprocesses_);
+            UeventHandlerMain(i);
             if (enable_parallel_restorecon_) {
-                RestoreConHandler(i, num_handler_subprocesses_);
+                RestoreConHandler(i);
             }
             _exit(EXIT_SUCCESS);
         }
@@ -266,6 +337,26 @@ void ColdBoot::WaitForSubProcesses() {
     }
 }
 
+void ColdBoot::LogWorkerStats() {
+    std::vector<std::chrono::microseconds> busy_times;
+    for (unsigned int i = 0; i < num_handler_subprocesses_; ++i) {
+        const auto& stats = worker_stats_[i];
+        busy_times.emplace_back(stats.uevent_time + stats.restorecon_time);
+        LOG(INFO) << "Coldboot subprocess " << i << " handled " << stats.uevents << " uevents in "
+                  << stats.uevent_time.count() / 1000 << "ms (slowest "
+                  << stats.slowest_uevent_time.count() / 1000 << "ms for '" << stats.slowest_uevent
+                  << "') and " << stats.restorecons << " restorecons in "
+                  << stats.restorecon_time.count() / 1000 << "ms";
+    }
+    if (busy_times.empty()) return;
+
+    std::sort(busy_times.begin(), busy_times.end());
+    LOG(INFO) << "Coldboot subprocess busy time min/median/max: "
+              << busy_times.front().count() / 1000 << "/"
+              << busy_times[busy_times.size() / 2].count() / 1000 << "/"
+              << busy_times.back().count() / 1000 << "ms";
+}
+
 void ColdBoot::Run() {
     android::base::Timer cold_boot_timer;
 
@@ -291,6 +382,7 @@ void ColdBoot::Run() {
     }
 
     WaitForSubProcesses();
+    LogWorkerStats();
 
     android::base::SetProperty(kColdBootDoneProp, "true");
     LOG(INFO) << "Coldboot took " << cold_boot_timer.duration().count() / 1000.0f << " seconds";
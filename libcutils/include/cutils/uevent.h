@@ -29,6 +29,10 @@ ssize_t uevent_kernel_multicast_recv(int socket, void *buffer, size_t length);
 ssize_t uevent_kernel_multicast_uid_recv(int socket, void *buffer, size_t length, uid_t *uid);
 ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid);
 
+#define UEVENT_RECV_BATCH_MAX 64
+ssize_t uevent_kernel_multicast_recv_batch(int socket, void *buffer, size_t length, size_t count,
+                                           ssize_t *lengths);
+
 #ifdef __cplusplus
 }
 #endif
@@ -50,6 +50,34 @@ ssize_t uevent_kernel_multicast_uid_recv(int socket, void* buffer, size_t length
     return uevent_kernel_recv(socket, buffer, length, true, uid);
 }
 
+/**
+ * Returns whether a message received into |hdr| came from the kernel, and sets
+ * "uid" to the uid of its sender, or -1 if that is unknown.
+ */
+static bool uevent_is_from_kernel(const struct msghdr* hdr, bool require_group, uid_t* uid) {
+    const struct sockaddr_nl* addr = (const struct sockaddr_nl*)hdr->msg_name;
+
+    *uid = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS) {
+        /* ignoring netlink message with no sender credentials */
+        return false;
+    }
+
+    struct ucred* cred = (struct ucred*)CMSG_DATA(cmsg);
+    *uid = cred->uid;
+
+    if (addr->nl_pid != 0) {
+        /* ignore non-kernel */
+        return false;
+    }
+    if (require_group && addr->nl_groups == 0) {
+        /* ignore unicast messages when requested */
+        return false;
+    }
+    return true;
+}
+
 ssize_t uevent_kernel_recv(int socket, void* buffer, size_t length, bool require_group, uid_t* uid) {
     struct iovec iov = {buffer, length};
     struct sockaddr_nl addr;
@@ -57,7 +85,6 @@ ssize_t uevent_kernel_recv(int socket, void* buffer, size_t length, bool require
     struct msghdr hdr = {
         &addr, sizeof(addr), &iov, 1, control, sizeof(control), 0,
     };
-    struct ucred* cred;
 
     *uid = -1;
     ssize_t n = TEMP_FAILURE_RETRY(recvmsg(socket, &hdr, 0));
@@ -65,31 +92,58 @@ ssize_t uevent_kernel_recv(int socket, void* buffer, size_t length, bool require
         return n;
     }
 
-    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
-    if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS) {
-        /* ignoring netlink message with no sender credentials */
-        goto out;
+    if (!uevent_is_from_kernel(&hdr, require_group, uid)) {
+        /* clear residual potentially malicious data */
+        bzero(buffer, length);
+        errno = EIO;
+        return -1;
     }
+    return n;
+}
 
-    cred = (struct ucred*)CMSG_DATA(cmsg);
-    *uid = cred->uid;
-
-    if (addr.nl_pid != 0) {
-        /* ignore non-kernel */
-        goto out;
-    }
-    if (require_group && addr.nl_groups == 0) {
-        /* ignore unicast messages when requested */
-        goto out;
+/**
+ * Like uevent_kernel_multicast_recv(), but receives up to "count" messages
+ * with a single recvmmsg() call. "buffer" holds "count" slots of "length"
+ * bytes, and the i-th message is received into the i-th slot.
+ *
+ * Returns the number of messages received, or -1 with errno set as for
+ * recvmmsg(). Only the first UEVENT_RECV_BATCH_MAX slots are used. For each
+ * message, "lengths" is set to its size, or to -1 if it did not come from the
+ * kernel, in which case its slot is cleared.
+ */
+ssize_t uevent_kernel_multicast_recv_batch(int socket, void* buffer, size_t length, size_t count,
+                                           ssize_t* lengths) {
+    if (count > UEVENT_RECV_BATCH_MAX) count = UEVENT_RECV_BATCH_MAX;
+
+    struct iovec iov[UEVENT_RECV_BATCH_MAX];
+    struct sockaddr_nl addr[UEVENT_RECV_BATCH_MAX];
+    char control[UEVENT_RECV_BATCH_MAX][CMSG_SPACE(sizeof(struct ucred))];
+    struct mmsghdr msgs[UEVENT_RECV_BATCH_MAX];
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = (char*)buffer + i * length;
+        iov[i].iov_len = length;
+        msgs[i].msg_hdr.msg_name = &addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
     }
 
+    /* MSG_WAITFORONE so that a blocking socket returns as soon as there is a message. */
+    int n = TEMP_FAILURE_RETRY(recvmmsg(socket, msgs, count, MSG_WAITFORONE, NULL));
+    for (int i = 0; i < n; i++) {
+        uid_t uid;
+        if (uevent_is_from_kernel(&msgs[i].msg_hdr, true, &uid)) {
+            lengths[i] = msgs[i].msg_len;
+        } else {
+            /* clear residual potentially malicious data */
+            bzero(iov[i].iov_base, length);
+            lengths[i] = -1;
+        }
+    }
     return n;
-
-out:
-    /* clear residual potentially malicious data */
-    bzero(buffer, length);
-    errno = EIO;
-    return -1;
 }
 
 int uevent_open_socket(int buf_sz, bool passcred) {
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cutils/uevent.h>
+
+#include <linux/netlink.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+using android::base::unique_fd;
+
+// A uevent socket that is not subscribed to any group, so that the only
+// messages it receives are the ones sent by the test. Since they do not come
+// from the kernel, every one of them must be rejected.
+class UeventTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        receiver_.reset(socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT));
+        ASSERT_GE(receiver_, 0) << strerror(errno);
+        int on = 1;
+        ASSERT_EQ(0, setsockopt(receiver_, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)));
+
+        sockaddr_nl addr = {};
+        addr.nl_family = AF_NETLINK;
+        ASSERT_EQ(0, bind(receiver_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)))
+                << strerror(errno);
+        socklen_t addr_len = sizeof(receiver_addr_);
+        ASSERT_EQ(0, getsockname(receiver_, reinterpret_cast<sockaddr*>(&receiver_addr_),
+                                 &addr_len));
+
+        sender_.reset(socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT));
+        ASSERT_GE(sender_, 0) << strerror(errno);
+    }
+
+    void Send(const std::string& message) {
+        ASSERT_EQ(static_cast<ssize_t>(message.size()),
+                  sendto(sender_, message.data(), message.size(), 0,
+                         reinterpret_cast<sockaddr*>(&receiver_addr_), sizeof(receiver_addr_)))
+                << strerror(errno);
+    }
+
+    unique_fd receiver_;
+    unique_fd sender_;
+    sockaddr_nl receiver_addr_ = {};
+};
+
+TEST_F(UeventTest, BatchRejectsNonKernelMessages) {
+    static constexpr size_t kSlotSize = 64;
+    static constexpr size_t kCount = 4;
+
+    Send("add@/devices/fake1");
+    Send("add@/devices/fake2");
+
+    std::vector<char> buffer(kSlotSize * kCount, 'x');
+    ssize_t lengths[kCount] = {};
+    ASSERT_EQ(2, uevent_kernel_multicast_recv_batch(receiver_, buffer.data(), kSlotSize, kCount,
+                                                    lengths));
+
+    for (size_t i = 0; i < 2; i++) {
+        EXPECT_EQ(-1, lengths[i]);
+        EXPECT_EQ(std::string(kSlotSize, '\0'), std::string(&buffer[i * kSlotSize], kSlotSize));
+    }
+    // Slots that received nothing are left alone.
+    EXPECT_EQ(std::string(kSlotSize * 2, 'x'), std::string(&buffer[2 * kSlotSize], kSlotSize * 2));
+}
+
+TEST_F(UeventTest, BatchIsClampedToMax) {
+    static constexpr size_t kSlotSize = 32;
+    static constexpr size_t kCount = UEVENT_RECV_BATCH_MAX + 5;
+
+    for (size_t i = 0; i < kCount; i++) {
+        Send("change@/devices/fake" + std::to_string(i));
+    }
+
+    std::vector<char> buffer(kSlotSize * kCount, 'x');
+    std::vector<ssize_t> lengths(kCount, 0);
+    ASSERT_EQ(UEVENT_RECV_BATCH_MAX, uevent_kernel_multicast_recv_batch(
+                                             receiver_, buffer.data(), kSlotSize, kCount,
+                                             lengths.data()));
+    for (size_t i = 0; i < UEVENT_RECV_BATCH_MAX; i++) {
+        EXPECT_EQ(-1, lengths[i]);
+    }
+    for (size_t i = UEVENT_RECV_BATCH_MAX; i < kCount; i++) {
+        EXPECT_EQ(0, lengths[i]);
+        EXPECT_EQ(std::string(kSlotSize, 'x'), std::string(&buffer[i * kSlotSize], kSlotSize));
+    }
+
+    // The rest are left for the next call.
+    ASSERT_EQ(5, uevent_kernel_multicast_recv_batch(receiver_, buffer.data(), kSlotSize, kCount,
+                                                    lengths.data()));
+}
@@ -20,6 +20,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <iterator>
+#include <map>
+#include <new>
+
 #include "backed_block.h"
 #include "sparse_defs.h"
 
@@ -46,12 +50,46 @@ struct backed_block {
   struct backed_block* next;
 };
 
+/*
+ * Blocks are kept in a singly linked list sorted by block number, which is
+ * what callers iterate over. The list is indexed by block number so that
+ * finding the insertion point of a block does not require walking the list.
+ */
 struct backed_block_list {
-  struct backed_block* data_blocks;
-  struct backed_block* last_used;
-  unsigned int block_size;
+  struct backed_block* data_blocks = nullptr;
+  std::multimap<unsigned int, struct backed_block*> index;
+  unsigned int block_size = 0;
 };
 
+/* Blocks starting at the same block are indexed in list order, newest first. */
+static void index_insert(struct backed_block_list* bbl, struct backed_block* bb) {
+  bbl->index.emplace_hint(bbl->index.lower_bound(bb->block), bb->block, bb);
+}
+
+static void index_erase(struct backed_block_list* bbl, struct backed_block* bb) {
+  /* Blocks appended to the tail are merged before they are indexed. */
+  if (bbl->index.empty() || bb->block > bbl->index.rbegin()->first) {
+    return;
+  }
+
+  auto range = bbl->index.equal_range(bb->block);
+  for (auto it = range.first; it != range.second; it++) {
+    if (it->second == bb) {
+      bbl->index.erase(it);
+      return;
+    }
+  }
+}
+
+/* Returns the last block in the list that starts before |block|, or nullptr. */
+static struct backed_block* index_find_before(struct backed_block_list* bbl, unsigned int block) {
+  auto it = bbl->index.lower_bound(block);
+  if (it == bbl->index.begin()) {
+    return nullptr;
+  }
+  return std::prev(it)->second;
+}
+
 struct backed_block* backed_block_iter_new(struct backed_block_list* bbl) {
   return bbl->data_blocks;
 }
@@ -110,8 +148,10 @@ void backed_block_destroy(struct backed_block* bb) {
 }
 
 struct backed_block_list* backed_block_list_new(unsigned int block_size) {
-  struct backed_block_list* b =
-      reinterpret_cast<backed_block_list*>(calloc(sizeof(struct backed_block_list), 1));
+  struct backed_block_list* b = new (std::nothrow) backed_block_list;
+  if (b == nullptr) {
+    return nullptr;
+  }
   b->block_size = block_size;
   return b;
 }
@@ -126,7 +166,7 @@ void backed_block_list_destroy(struct backed_block_list* bbl) {
     }
   }
 
-  free(bbl);
+  delete bbl;
 }
 
 void backed_block_list_move(struct backed_block_list* from, struct backed_block_list* to,
@@ -137,39 +177,45 @@ void backed_block_list_move(struct backed_block_list* from, struct backed_block_
     start = from->data_blocks;
   }
 
-  if (!end) {
-    for (end = start; end && end->next; end = end->next)
-      ;
+  if (start == nullptr) {
+    return;
   }
 
-  if (start == nullptr || end == nullptr) {
+  /* Moving a whole list into an empty one hands over the index as is. */
+  if (start == from->data_blocks && end == nullptr && to->data_blocks == nullptr) {
+    to->data_blocks = start;
+    to->index.swap(from->index);
+    from->data_blocks = nullptr;
+    from->index.clear();
     return;
   }
 
-  from->last_used = nullptr;
-  to->last_used = nullptr;
+  /* Unlink the blocks from the index of |from|, finding |end| if needed. */
+  for (bb = start;; bb = bb->next) {
+    index_erase(from, bb);
+    index_insert(to, bb);
+    if (bb == end || (!end && !bb->next)) {
+      end = bb;
+      break;
+    }
+  }
+
   if (from->data_blocks == start) {
     from->data_blocks = end->next;
   } else {
-    for (bb = from->data_blocks; bb; bb = bb->next) {
-      if (bb->next == start) {
-        bb->next = end->next;
-        break;
-      }
+    bb = index_find_before(from, start->block);
+    if (bb) {
+      bb->next = end->next;
     }
   }
 
-  if (!to->data_blocks) {
+  bb = index_find_before(to, start->block);
+  if (!bb) {
+    end->next = to->data_blocks;
     to->data_blocks = start;
-    end->next = nullptr;
   } else {
-    for (bb = to->data_blocks; bb; bb = bb->next) {
-      if (!bb->next || bb->next->block > start->block) {
-        end->next = bb->next;
-        bb->next = start;
-        break;
-      }
-    }
+    end->next = bb->next;
+    bb->next = start;
   }
 }
 
@@ -222,6 +268,7 @@ static int merge_bb(struct backed_block_list* bbl, struct backed_block* a, struc
   a->len += b->len;
   a->next = b->next;
 
+  index_erase(bbl, b);
   backed_block_destroy(b);
 
   return 0;
@@ -232,40 +279,41 @@ static int queue_bb(struct backed_block_list* bbl, struct backed_block* new_bb)
 
   if (bbl->data_blocks == nullptr) {
     bbl->data_blocks = new_bb;
+    index_insert(bbl, new_bb);
     return 0;
   }
 
   if (bbl->data_blocks->block > new_bb->block) {
     new_bb->next = bbl->data_blocks;
     bbl->data_blocks = new_bb;
+    index_insert(bbl, new_bb);
     return 0;
   }
 
-  /* Optimization: blocks are mostly queued in sequence, so save the
-     pointer to the last bb that was added, and start searching from
-     there if the next block number is higher */
-  if (bbl->last_used && new_bb->block > bbl->last_used->block)
-    bb = bbl->last_used;
-  else
-    bb = bbl->data_blocks;
-  bbl->last_used = new_bb;
-
-  for (; bb->next && bb->next->block < new_bb->block; bb = bb->next)
-    ;
-
-  if (bb->next == nullptr) {
-    bb->next = new_bb;
-  } else {
-    new_bb->next = bb->next;
+  /* Optimization: blocks are mostly queued in sequence, so appending to the
+     last block does not need an index lookup */
+  bb = bbl->index.rbegin()->second;
+  if (new_bb->block > bb->block) {
     bb->next = new_bb;
+    if (merge_bb(bbl, bb, new_bb)) {
+      bbl->index.emplace_hint(bbl->index.end(), new_bb->block, new_bb);
+    }
+    return 0;
   }
 
-  merge_bb(bbl, new_bb, new_bb->next);
-  if (!merge_bb(bbl, bb, new_bb)) {
-    /* new_bb destroyed, point to retained as last_used */
-    bbl->last_used = bb;
+  bb = index_find_before(bbl, new_bb->block);
+  if (!bb) {
+    /* The first block starts at the same block as the new one. */
+    bb = bbl->data_blocks;
   }
 
+  new_bb->next = bb->next;
+  bb->next = new_bb;
+  index_insert(bbl, new_bb);
+
+  merge_bb(bbl, new_bb, new_bb->next);
+  merge_bb(bbl, bb, new_bb);
+
   return 0;
 }
 
@@ -361,6 +409,7 @@ int backed_block_split(struct backed_block_list* bbl, struct backed_block* bb,
   new_bb->next = bb->next;
   bb->next = new_bb;
   bb->len = max_len;
+  index_insert(bbl, new_bb);
 
   switch (bb->type) {
     case BACKED_BLOCK_DATA:
@@ -243,6 +243,22 @@ int sparse_file_foreach_chunk(struct sparse_file *s, bool sparse, bool crc,
  */
 int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc);
 
+/**
+ * sparse_file_read_hole - read a file with holes into a sparse file cookie
+ *
+ * @s - sparse file cookie
+ * @fd - file descriptor to read from
+ *
+ * Reads a regular file into a sparse file cookie, like sparse_file_read with
+ * sparse set to false, except that holes are skipped without being read.
+ * Holes and block aligned chunks of all zeros will be converted to "don't
+ * care" chunks, and chunks of another 32 bit value to fill chunks.  If the
+ * file system does not report holes, the whole file is read.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_read_hole(struct sparse_file *s, int fd);
+
 /**
  * sparse_file_read_buf - read a buffer into a sparse file cookie
  *
@@ -305,6 +321,26 @@ struct sparse_file *sparse_file_import_buf(char* buf, bool verbose, bool crc);
  */
 struct sparse_file *sparse_file_import_auto(int fd, bool crc, bool verbose);
 
+/**
+ * sparse_file_unsparse - expand a sparse file into a normal file
+ *
+ * @in_fd - file descriptor to read a file in the Android sparse file format from
+ * @out_fd - file descriptor to write the expanded file to
+ * @verbose - print verbose errors while reading the sparse file
+ * @crc - verify the crc of a file in the Android sparse file format
+ *
+ * Expands a sparse file one chunk at a time, without building a sparse file
+ * cookie, so memory use does not depend on the size of the file.  in_fd is
+ * read sequentially and may be a pipe.  The expanded data is written from the
+ * current offset of out_fd, seeking over don't care chunks, and a regular
+ * out_fd is then truncated to the expanded length.  Where possible, raw chunks
+ * are copied by the kernel.  If crc is true, the crc is verified as each crc
+ * chunk is reached, after the data before it has been written.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_unsparse(int in_fd, int out_fd, bool verbose, bool crc);
+
 /** sparse_file_resparse - rechunk an existing sparse file into smaller files
  *
  * @in_s - sparse file cookie of the existing sparse file
@@ -319,6 +355,21 @@ struct sparse_file *sparse_file_import_auto(int fd, bool crc, bool verbose);
 int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
 		struct sparse_file **out_s, int out_s_count);
 
+/** sparse_file_resparse_packed - rechunk a sparse file into as few files as possible
+ *
+ * @in_s - sparse file cookie of the existing sparse file
+ * @max_len - maximum file size
+ * @out_s - array of sparse file cookies
+ * @out_s_count - size of out_s array
+ *
+ * Same as sparse_file_resparse, except that a chunk is split whenever at least
+ * one block of it still fits in the current file, so that every file but the
+ * last is filled up to max_len.  This minimizes the number of files, at the
+ * cost of splitting more chunks.
+ */
+int sparse_file_resparse_packed(struct sparse_file *in_s, unsigned int max_len,
+		struct sparse_file **out_s, int out_s_count);
+
 /**
  * sparse_file_verbose - set a sparse file cookie to print verbose errors
  *
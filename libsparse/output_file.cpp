@@ -30,6 +30,12 @@
 #include <unistd.h>
 #include <zlib.h>
 
+#include <deque>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "defs.h"
 #include "output_file.h"
 #include "sparse_crc32.h"
@@ -61,7 +67,7 @@ struct output_file_ops {
   int (*skip)(struct output_file*, int64_t);
   int (*pad)(struct output_file*, int64_t);
   int (*write)(struct output_file*, void*, size_t);
-  void (*close)(struct output_file*);
+  int (*close)(struct output_file*);
 };
 
 struct sparse_file_ops {
@@ -85,9 +91,25 @@ struct output_file {
   char* buf;
 };
 
+/*
+ * gzip output is split into independent gzip members of kGzMemberSize bytes of
+ * input, which are compressed on worker threads and written in order. A
+ * sequence of gzip members is itself a valid gzip file.
+ */
+static constexpr size_t kGzMemberSize = 1024 * 1024;
+
+struct gz_output {
+  int fd = -1;
+  int64_t pos = 0;
+  bool wrote_member = false;
+  std::string pending;
+  std::string zero_member;
+  std::deque<std::future<std::string>> members;
+};
+
 struct output_file_gz {
   struct output_file out;
-  gzFile gz_fd;
+  struct gz_output* gz;
 };
 
 #define to_output_file_gz(_o) container_of((_o), struct output_file_gz, out)
@@ -159,10 +181,11 @@ static int file_write(struct output_file* out, void* data, size_t len) {
   return 0;
 }
 
-static void file_close(struct output_file* out) {
+static int file_close(struct output_file* out) {
   struct output_file_normal* outn = to_output_file_normal(out);
 
   free(outn);
+  return 0;
 }
 
 static struct output_file_ops file_ops = {
@@ -173,75 +196,184 @@ static struct output_file_ops file_ops = {
     .close = file_close,
 };
 
-static int gz_file_open(struct output_file* out, int fd) {
-  struct output_file_gz* outgz = to_output_file_gz(out);
+static unsigned int output_threads() {
+  static const unsigned int threads = std::max(std::thread::hardware_concurrency(), 1U);
+  return threads;
+}
 
-  outgz->gz_fd = gzdopen(fd, "wb9");
-  if (!outgz->gz_fd) {
-    error_errno("gzopen");
-    return -errno;
+/* Compresses data into a complete gzip member, or returns an empty string on error. */
+static std::string gz_compress_member(const std::string& data) {
+  z_stream zs = {};
+  std::string member;
+
+  if (deflateInit2(&zs, 9, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return member;
   }
 
-  return 0;
+  member.resize(deflateBound(&zs, data.size()));
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zs.avail_in = data.size();
+  zs.next_out = reinterpret_cast<Bytef*>(&member[0]);
+  zs.avail_out = member.size();
+  if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+    member.resize(zs.total_out);
+  } else {
+    member.clear();
+  }
+  deflateEnd(&zs);
+
+  return member;
 }
 
-static int gz_file_skip(struct output_file* out, int64_t cnt) {
-  off64_t ret;
-  struct output_file_gz* outgz = to_output_file_gz(out);
+static int gz_write_member(struct gz_output* gz, const std::string& member) {
+  const char* data = member.data();
+  size_t len = member.size();
 
-  ret = gzseek(outgz->gz_fd, cnt, SEEK_CUR);
-  if (ret < 0) {
-    error_errno("gzseek");
+  if (len == 0) {
+    error("gzip compression failed");
     return -1;
   }
+
+  while (len > 0) {
+    ssize_t ret = write(gz->fd, data, len);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error_errno("write");
+      return -1;
+    }
+    data += ret;
+    len -= ret;
+  }
+  gz->wrote_member = true;
+
   return 0;
 }
 
-static int gz_file_pad(struct output_file* out, int64_t len) {
-  off64_t ret;
-  struct output_file_gz* outgz = to_output_file_gz(out);
+/* Writes out finished members until at most max_pending are still being compressed. */
+static int gz_drain_members(struct gz_output* gz, size_t max_pending) {
+  int ret = 0;
 
-  ret = gztell(outgz->gz_fd);
-  if (ret < 0) {
-    return -1;
+  while (gz->members.size() > max_pending) {
+    std::string member = gz->members.front().get();
+    gz->members.pop_front();
+    if (ret == 0) {
+      ret = gz_write_member(gz, member);
+    }
   }
 
-  if (ret >= len) {
-    return 0;
-  }
+  return ret;
+}
 
-  ret = gzseek(outgz->gz_fd, len - 1, SEEK_SET);
-  if (ret < 0) {
-    return -1;
-  }
+/* Starts compressing the pending data into a new member. */
+static int gz_queue_pending(struct gz_output* gz) {
+  gz->members.emplace_back(
+      std::async(std::launch::async, gz_compress_member, std::move(gz->pending)));
+  gz->pending.clear();
+  return gz_drain_members(gz, output_threads());
+}
 
-  gzwrite(outgz->gz_fd, "", 1);
+static int gz_file_open(struct output_file* out, int fd) {
+  struct output_file_gz* outgz = to_output_file_gz(out);
 
+  outgz->gz = new (std::nothrow) gz_output;
+  if (!outgz->gz) {
+    error_errno("malloc gz_output");
+    return -ENOMEM;
+  }
+  outgz->gz->fd = fd;
   return 0;
 }
 
 static int gz_file_write(struct output_file* out, void* data, size_t len) {
   int ret;
-  struct output_file_gz* outgz = to_output_file_gz(out);
+  struct gz_output* gz = to_output_file_gz(out)->gz;
+  const char* ptr = reinterpret_cast<const char*>(data);
 
+  gz->pos += len;
   while (len > 0) {
-    ret = gzwrite(outgz->gz_fd, data, std::min<unsigned int>(len, (unsigned int)INT_MAX));
-    if (ret == 0) {
-      error("gzwrite %s", gzerror(outgz->gz_fd, nullptr));
-      return -1;
+    size_t n = std::min(len, kGzMemberSize - gz->pending.size());
+    gz->pending.append(ptr, n);
+    ptr += n;
+    len -= n;
+
+    if (gz->pending.size() == kGzMemberSize) {
+      ret = gz_queue_pending(gz);
+      if (ret < 0) {
+        return ret;
+      }
     }
-    len -= ret;
-    data = (char*)data + ret;
   }
 
   return 0;
 }
 
-static void gz_file_close(struct output_file* out) {
-  struct output_file_gz* outgz = to_output_file_gz(out);
+static int gz_file_skip(struct output_file* out, int64_t cnt) {
+  int ret = 0;
+  struct gz_output* gz = to_output_file_gz(out)->gz;
+
+  /* Skipped regions read back as zeros. Whole members of zeros are only
+   * compressed once. */
+  while (cnt > 0) {
+    if (gz->pending.empty() && cnt >= (int64_t)kGzMemberSize) {
+      if (gz->zero_member.empty()) {
+        gz->zero_member = gz_compress_member(std::string(kGzMemberSize, '\0'));
+      }
+      std::string member = gz->zero_member;
+      gz->members.emplace_back(
+          std::async(std::launch::deferred, [member = std::move(member)]() { return member; }));
+      ret = gz_drain_members(gz, output_threads());
+      gz->pos += kGzMemberSize;
+      cnt -= kGzMemberSize;
+    } else {
+      size_t n = std::min<int64_t>(cnt, kGzMemberSize - gz->pending.size());
+      gz->pending.append(n, '\0');
+      gz->pos += n;
+      cnt -= n;
+      if (gz->pending.size() == kGzMemberSize) {
+        ret = gz_queue_pending(gz);
+      }
+    }
+    if (ret < 0) {
+      return ret;
+    }
+  }
 
-  gzclose(outgz->gz_fd);
-  free(outgz);
+  return 0;
+}
+
+static int gz_file_pad(struct output_file* out, int64_t len) {
+  struct gz_output* gz = to_output_file_gz(out)->gz;
+
+  if (gz->pos >= len) {
+    return 0;
+  }
+
+  return gz_file_skip(out, len - gz->pos);
+}
+
+static int gz_file_close(struct output_file* out) {
+  int ret = 0;
+  struct gz_output* gz = to_output_file_gz(out)->gz;
+
+  /* Always emit at least one member, so that empty output is a valid gzip file. */
+  if (!gz->pending.empty() || (!gz->wrote_member && gz->members.empty())) {
+    ret = gz_queue_pending(gz);
+  }
+  int drain_ret = gz_drain_members(gz, 0);
+  if (ret == 0) {
+    ret = drain_ret;
+  }
+
+  if (close(gz->fd) < 0 && ret == 0) {
+    ret = -errno;
+    error_errno("close");
+  }
+  delete gz;
+  free(to_output_file_gz(out));
+
+  return ret;
 }
 
 static struct output_file_ops gz_file_ops = {
@@ -273,8 +405,9 @@ static int callback_file_skip(struct output_file* out, int64_t off) {
   return 0;
 }
 
+/* The callback is not told about the space after the last chunk. */
 static int callback_file_pad(struct output_file* out __unused, int64_t len __unused) {
-  return -1;
+  return 0;
 }
 
 static int callback_file_write(struct output_file* out, void* data, size_t len) {
@@ -283,10 +416,11 @@ static int callback_file_write(struct output_file* out, void* data, size_t len)
   return outc->write(outc->priv, data, len);
 }
 
-static void callback_file_close(struct output_file* out) {
+static int callback_file_close(struct output_file* out) {
   struct output_file_callback* outc = to_output_file_callback(out);
 
   free(outc);
+  return 0;
 }
 
 static struct output_file_ops callback_file_ops = {
@@ -371,6 +505,38 @@ static int write_sparse_fill_chunk(struct output_file* out, uint64_t len, uint32
   return 0;
 }
 
+/*
+ * The crc of a large data chunk is computed in slices on worker threads while
+ * the chunk is written, and the slice crcs are folded together with
+ * crc32_combine(). sparse_crc32() computes the same crc as zlib's crc32().
+ */
+static constexpr size_t kCrcSliceSize = 4 * 1024 * 1024;
+
+static std::vector<std::future<uint32_t>> crc32_start_slices(const void* data, size_t len,
+                                                             size_t* slice_len) {
+  std::vector<std::future<uint32_t>> slices;
+  const char* ptr = reinterpret_cast<const char*>(data);
+
+  *slice_len = std::max(kCrcSliceSize, DIV_ROUND_UP(len, output_threads()));
+  auto policy = len > *slice_len ? std::launch::async : std::launch::deferred;
+  for (size_t off = 0; off < len; off += *slice_len) {
+    slices.emplace_back(
+        std::async(policy, sparse_crc32, 0, ptr + off, std::min(*slice_len, len - off)));
+  }
+
+  return slices;
+}
+
+static uint32_t crc32_finish_slices(uint32_t crc, std::vector<std::future<uint32_t>>* slices,
+                                    size_t slice_len, size_t len) {
+  for (size_t i = 0; i < slices->size(); i++) {
+    size_t off = i * slice_len;
+    crc = crc32_combine(crc, (*slices)[i].get(), std::min(slice_len, len - off));
+  }
+
+  return crc;
+}
+
 static int write_sparse_data_chunk(struct output_file* out, uint64_t len, void* data) {
   chunk_header_t chunk_header;
   uint64_t rnd_up_len, zero_len;
@@ -388,6 +554,11 @@ static int write_sparse_data_chunk(struct output_file* out, uint64_t len, void*
   ret = out->ops->write(out, &chunk_header, sizeof(chunk_header));
 
   if (ret < 0) return -1;
+
+  size_t slice_len = 0;
+  std::vector<std::future<uint32_t>> crc_slices;
+  if (out->use_crc) crc_slices = crc32_start_slices(data, len, &slice_len);
+
   ret = out->ops->write(out, data, len);
   if (ret < 0) return -1;
   if (zero_len) {
@@ -396,7 +567,7 @@ static int write_sparse_data_chunk(struct output_file* out, uint64_t len, void*
   }
 
   if (out->use_crc) {
-    out->crc32 = sparse_crc32(out->crc32, data, len);
+    out->crc32 = crc32_finish_slices(out->crc32, &crc_slices, slice_len, len);
     if (zero_len) out->crc32 = sparse_crc32(out->crc32, out->zero_buf, zero_len);
   }
 
@@ -420,7 +591,7 @@ int write_sparse_end_chunk(struct output_file* out) {
     if (ret < 0) {
       return ret;
     }
-    out->ops->write(out, &out->crc32, 4);
+    ret = out->ops->write(out, &out->crc32, 4);
     if (ret < 0) {
       return ret;
     }
@@ -492,13 +663,15 @@ static struct sparse_file_ops normal_file_ops = {
     .write_end_chunk = write_normal_end_chunk,
 };
 
-void output_file_close(struct output_file* out) {
-  out->sparse_ops->write_end_chunk(out);
+int output_file_close(struct output_file* out) {
+  int ret = out->sparse_ops->write_end_chunk(out);
   free(out->zero_buf);
   free(out->fill_buf);
   out->zero_buf = nullptr;
   out->fill_buf = nullptr;
-  out->ops->close(out);
+  int close_ret = out->ops->close(out);
+
+  return ret < 0 ? ret : close_ret;
 }
 
 static int output_file_init(struct output_file* out, int block_size, int64_t len, bool sparse,
@@ -628,7 +801,11 @@ struct output_file* output_file_open_fd(int fd, unsigned int block_size, int64_t
     return nullptr;
   }
 
-  out->ops->open(out, fd);
+  ret = out->ops->open(out, fd);
+  if (ret < 0) {
+    free(out);
+    return nullptr;
+  }
 
   ret = output_file_init(out, block_size, len, sparse, chunks, crc);
   if (ret < 0) {
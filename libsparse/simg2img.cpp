@@ -37,7 +37,6 @@ int main(int argc, char* argv[]) {
   int in;
   int out;
   int i;
-  struct sparse_file* s;
 
   if (argc < 3) {
     usage();
@@ -61,22 +60,15 @@ int main(int argc, char* argv[]) {
       }
     }
 
-    s = sparse_file_import(in, true, false);
-    if (!s) {
-      fprintf(stderr, "Failed to read sparse file\n");
-      exit(-1);
-    }
-
     if (lseek(out, 0, SEEK_SET) == -1) {
       perror("lseek failed");
       exit(EXIT_FAILURE);
     }
 
-    if (sparse_file_write(s, out, false, false, false) < 0) {
-      fprintf(stderr, "Cannot write output file\n");
+    if (sparse_file_unsparse(in, out, true, false) < 0) {
+      fprintf(stderr, "Failed to unsparse %s\n", argv[i]);
       exit(-1);
     }
-    sparse_file_destroy(s);
     close(in);
   }
 
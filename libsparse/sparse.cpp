@@ -160,9 +160,9 @@ int sparse_file_write(struct sparse_file* s, int fd, bool gz, bool sparse, bool
 
   ret = write_all_blocks(s, out);
 
-  output_file_close(out);
+  int close_ret = output_file_close(out);
 
-  return ret;
+  return ret ? ret : close_ret;
 }
 
 int sparse_file_callback(struct sparse_file* s, bool sparse, bool crc,
@@ -178,9 +178,9 @@ int sparse_file_callback(struct sparse_file* s, bool sparse, bool crc,
 
   ret = write_all_blocks(s, out);
 
-  output_file_close(out);
+  int close_ret = output_file_close(out);
 
-  return ret;
+  return ret ? ret : close_ret;
 }
 
 struct chunk_data {
@@ -222,9 +222,9 @@ int sparse_file_foreach_chunk(struct sparse_file* s, bool sparse, bool crc,
     if (ret) return ret;
   }
 
-  output_file_close(out);
+  int close_ret = output_file_close(out);
 
-  return ret;
+  return ret ? ret : close_ret;
 }
 
 static int out_counter_write(void* priv, const void* data __unused, size_t len) {
@@ -247,9 +247,7 @@ int64_t sparse_file_len(struct sparse_file* s, bool sparse, bool crc) {
 
   ret = write_all_blocks(s, out);
 
-  output_file_close(out);
-
-  if (ret < 0) {
+  if (output_file_close(out) < 0 || ret < 0) {
     return -1;
   }
 
@@ -261,7 +259,7 @@ unsigned int sparse_file_block_size(struct sparse_file* s) {
 }
 
 static struct backed_block* move_chunks_up_to_len(struct sparse_file* from, struct sparse_file* to,
-                                                  unsigned int len) {
+                                                  unsigned int len, bool pack) {
   int64_t count = 0;
   struct output_file* out_counter;
   struct backed_block* last_bb = nullptr;
@@ -286,8 +284,9 @@ static struct backed_block* move_chunks_up_to_len(struct sparse_file* from, stru
   }
 
   for (bb = start; bb; bb = backed_block_iter_next(bb)) {
+    bool gap = backed_block_block(bb) > last_block;
     count = 0;
-    if (backed_block_block(bb) > last_block) count += sizeof(chunk_header_t);
+    if (gap) count += sizeof(chunk_header_t);
     last_block = backed_block_block(bb) + DIV_ROUND_UP(backed_block_len(bb), to->block_size);
 
     /* will call out_counter_write to update count */
@@ -300,10 +299,13 @@ static struct backed_block* move_chunks_up_to_len(struct sparse_file* from, stru
       /*
        * If the remaining available size is more than 1/8th of the
        * requested size, split the chunk.  Results in sparse files that
-       * are at least 7/8ths of the requested size
+       * are at least 7/8ths of the requested size.  When packing, split
+       * the chunk if any of it fits, counting the skip chunk before it.
        */
       file_len += sizeof(chunk_header_t);
-      if (!last_bb || (len - file_len > (len / 8))) {
+      if (pack && gap) file_len += sizeof(chunk_header_t);
+      bool split = pack ? len - file_len >= (int64_t)to->block_size : len - file_len > (len / 8);
+      if (!last_bb || split) {
         backed_block_split(from->backed_block_list, bb, len - file_len);
         last_bb = bb;
       }
@@ -322,8 +324,8 @@ out:
   return bb;
 }
 
-int sparse_file_resparse(struct sparse_file* in_s, unsigned int max_len, struct sparse_file** out_s,
-                         int out_s_count) {
+static int resparse(struct sparse_file* in_s, unsigned int max_len, struct sparse_file** out_s,
+                    int out_s_count, bool pack) {
   struct backed_block* bb;
   struct sparse_file* s;
   struct sparse_file* tmp;
@@ -337,7 +339,7 @@ int sparse_file_resparse(struct sparse_file* in_s, unsigned int max_len, struct
   do {
     s = sparse_file_new(in_s->block_size, in_s->len);
 
-    bb = move_chunks_up_to_len(in_s, s, max_len);
+    bb = move_chunks_up_to_len(in_s, s, max_len, pack);
 
     if (c < out_s_count) {
       out_s[c] = s;
@@ -355,6 +357,16 @@ int sparse_file_resparse(struct sparse_file* in_s, unsigned int max_len, struct
   return c;
 }
 
+int sparse_file_resparse(struct sparse_file* in_s, unsigned int max_len, struct sparse_file** out_s,
+                         int out_s_count) {
+  return resparse(in_s, max_len, out_s, out_s_count, false);
+}
+
+int sparse_file_resparse_packed(struct sparse_file* in_s, unsigned int max_len,
+                                struct sparse_file** out_s, int out_s_count) {
+  return resparse(in_s, max_len, out_s, out_s_count, true);
+}
+
 void sparse_file_verbose(struct sparse_file* s) {
   s->verbose = true;
 }
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <sparse/sparse.h>
+
+static constexpr unsigned int kBlockSize = 4096;
+
+/*
+ * Scattered extents: every other block holds a chunk, so that neighbouring
+ * chunks are never merged.
+ */
+static std::vector<unsigned int> ChunkBlocks(size_t num_chunks, bool shuffle) {
+  std::vector<unsigned int> blocks(num_chunks);
+  for (size_t i = 0; i < num_chunks; i++) {
+    blocks[i] = i * 2;
+  }
+  if (shuffle) {
+    std::shuffle(blocks.begin(), blocks.end(), std::mt19937(0));
+  }
+  return blocks;
+}
+
+static struct sparse_file* BuildSparseFile(const std::vector<unsigned int>& blocks) {
+  int64_t len = static_cast<int64_t>(blocks.size()) * 2 * kBlockSize;
+  struct sparse_file* s = sparse_file_new(kBlockSize, len);
+  for (const auto& block : blocks) {
+    sparse_file_add_fill(s, block, kBlockSize, block);
+  }
+  return s;
+}
+
+static void BM_AddChunks(benchmark::State& state, bool shuffle) {
+  auto blocks = ChunkBlocks(state.range(0), shuffle);
+  for (auto _ : state) {
+    struct sparse_file* s = BuildSparseFile(blocks);
+    benchmark::DoNotOptimize(s);
+    sparse_file_destroy(s);
+  }
+  state.SetItemsProcessed(state.iterations() * blocks.size());
+}
+BENCHMARK_CAPTURE(BM_AddChunks, sequential, false)->Range(1 << 10, 1 << 18);
+BENCHMARK_CAPTURE(BM_AddChunks, random, true)->Range(1 << 10, 1 << 18);
+
+static void BM_Resparse(benchmark::State& state) {
+  auto blocks = ChunkBlocks(state.range(0), true);
+  struct sparse_file* s = BuildSparseFile(blocks);
+
+  /* Small enough for a few hundred chunks per output file. */
+  unsigned int max_len = 256 * 1024;
+  for (auto _ : state) {
+    int count = sparse_file_resparse(s, max_len, nullptr, 0);
+    benchmark::DoNotOptimize(count);
+  }
+  state.SetItemsProcessed(state.iterations() * blocks.size());
+  sparse_file_destroy(s);
+}
+BENCHMARK(BM_Resparse)->Range(1 << 10, 1 << 18);
+
+BENCHMARK_MAIN();
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <algorithm>
 #include <string>
@@ -37,8 +38,17 @@
 #include "sparse_file.h"
 #include "sparse_format.h"
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(_WIN32)
+#define ftruncate64 ftruncate
+#endif
+
 #if defined(__APPLE__) && defined(__MACH__)
 #define lseek64 lseek
+#define ftruncate64 ftruncate
 #define off64_t off_t
 #endif
 
@@ -410,22 +420,80 @@ static int sparse_file_read_sparse(struct sparse_file* s, SparseFileSource* sour
   return 0;
 }
 
-static int sparse_file_read_normal(struct sparse_file* s, int fd) {
-  int ret;
-  uint32_t* buf = (uint32_t*)malloc(s->block_size);
-  unsigned int block = 0;
-  int64_t remain = s->len;
-  int64_t offset = 0;
-  unsigned int to_read;
-  unsigned int i;
-  bool sparse_block;
+/*
+ * Returns true if the block consists of a single repeated 32-bit value. Each
+ * 256 byte stride is checked without branches so that the compiler can turn
+ * the inner loop into vector compares.
+ */
+static bool is_fill_block(const uint8_t* block, unsigned int block_size, uint32_t* fill_val) {
+  static constexpr unsigned int kStride = 256;
+  uint32_t val;
+  memcpy(&val, block, sizeof(val));
+  uint64_t pattern = (static_cast<uint64_t>(val) << 32) | val;
+
+  unsigned int i = 0;
+  for (; i + kStride <= block_size; i += kStride) {
+    uint64_t diff = 0;
+    for (unsigned int j = 0; j < kStride; j += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, block + i + j, sizeof(word));
+      diff |= word ^ pattern;
+    }
+    if (diff) {
+      return false;
+    }
+  }
+  for (; i < block_size; i += sizeof(uint32_t)) {
+    uint32_t word;
+    memcpy(&word, block + i, sizeof(word));
+    if (word != val) {
+      return false;
+    }
+  }
+
+  *fill_val = val;
+  return true;
+}
 
+/*
+ * Reads range_len bytes starting at offset, which must be block aligned, from the
+ * current position of fd. If skip_zero is set, zero blocks are left out of the
+ * sparse file, and are written as don't care chunks.
+ */
+static int sparse_file_read_normal_range(struct sparse_file* s, int fd, int64_t offset,
+                                         int64_t range_len, bool skip_zero) {
+  int ret;
+  unsigned int block = offset / s->block_size;
+  int64_t remain = range_len;
+
+  /* Read many blocks at a time, and queue runs of data or fill blocks with
+   * a single call instead of one per block. */
+  int64_t buf_size = std::max(COPY_BUF_SIZE - COPY_BUF_SIZE % s->block_size,
+                              static_cast<int64_t>(s->block_size));
+  uint8_t* buf = (uint8_t*)malloc(buf_size);
   if (!buf) {
     return -ENOMEM;
   }
 
+  /* The pending run of blocks, either data or a single fill value. */
+  unsigned int run_block = 0;
+  int64_t run_offset = 0;
+  int64_t run_len = 0;
+  bool run_is_fill = false;
+  uint32_t run_fill_val = 0;
+
+  auto flush_run = [&]() {
+    if (!run_len) return;
+    if (run_is_fill) {
+      sparse_file_add_fill(s, run_fill_val, run_len, run_block);
+    } else {
+      sparse_file_add_fd(s, fd, run_offset, run_len, run_block);
+    }
+    run_len = 0;
+  };
+
   while (remain > 0) {
-    to_read = std::min(remain, (int64_t)(s->block_size));
+    int64_t to_read = std::min(remain, buf_size);
     ret = read_all(fd, buf, to_read);
     if (ret < 0) {
       error("failed to read sparse file");
@@ -433,34 +501,110 @@ static int sparse_file_read_normal(struct sparse_file* s, int fd) {
       return ret;
     }
 
-    if (to_read == s->block_size) {
-      sparse_block = true;
-      for (i = 1; i < s->block_size / sizeof(uint32_t); i++) {
-        if (buf[0] != buf[i]) {
-          sparse_block = false;
-          break;
-        }
+    for (int64_t pos = 0; pos < to_read; pos += s->block_size) {
+      unsigned int len = std::min(to_read - pos, static_cast<int64_t>(s->block_size));
+      uint32_t fill_val;
+      bool fill = len == s->block_size && is_fill_block(buf + pos, len, &fill_val);
+      bool skip = skip_zero && fill && fill_val == 0;
+
+      if (run_len && (skip || fill != run_is_fill || (fill && fill_val != run_fill_val))) {
+        flush_run();
       }
-    } else {
-      sparse_block = false;
-    }
+      if (skip) {
+        offset += len;
+        block++;
+        continue;
+      }
+      if (!run_len) {
+        run_block = block;
+        run_offset = offset;
+        run_is_fill = fill;
+        run_fill_val = fill ? fill_val : 0;
+      }
+      run_len += len;
 
-    if (sparse_block) {
-      /* TODO: add flag to use skip instead of fill for buf[0] == 0 */
-      sparse_file_add_fill(s, buf[0], to_read, block);
-    } else {
-      sparse_file_add_fd(s, fd, offset, to_read, block);
+      offset += len;
+      block++;
     }
-
     remain -= to_read;
-    offset += to_read;
-    block++;
   }
+  flush_run();
 
   free(buf);
   return 0;
 }
 
+static int sparse_file_read_normal(struct sparse_file* s, int fd) {
+  return sparse_file_read_normal_range(s, fd, 0, s->len, false);
+}
+
+/*
+ * Reads only the data regions of fd, as reported by SEEK_DATA and SEEK_HOLE,
+ * so that holes are never read. Holes and zero blocks become don't care
+ * chunks.
+ */
+int sparse_file_read_hole(struct sparse_file* s, int fd) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  int ret;
+  int64_t start;
+  int64_t end;
+  int64_t hole = 0;
+  int64_t prev_end = 0;
+
+  for (;;) {
+    start = lseek64(fd, hole, SEEK_DATA);
+    if (start < 0) {
+      if (errno == ENXIO) {
+        /* The rest of the file is a hole */
+        return 0;
+      }
+      if (errno == EINVAL && hole == 0) {
+        /* The file system does not report holes */
+        break;
+      }
+      error("could not seek to data");
+      return -errno;
+    }
+    if (start >= s->len) {
+      return 0;
+    }
+
+    hole = lseek64(fd, start, SEEK_HOLE);
+    if (hole < 0) {
+      error("could not seek to hole");
+      return -errno;
+    }
+
+    /*
+     * The file system may track holes at a finer granularity than the sparse
+     * block size, so the block holding the start of this region may already
+     * have been read with the previous one.
+     */
+    start = std::max<int64_t>(ALIGN_DOWN(start, s->block_size), prev_end);
+    end = std::min<int64_t>(ALIGN(hole, s->block_size), s->len);
+    if (start >= end) {
+      continue;
+    }
+    prev_end = end;
+
+    if (lseek64(fd, start, SEEK_SET) < 0) {
+      return -errno;
+    }
+
+    ret = sparse_file_read_normal_range(s, fd, start, end - start, true);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  if (lseek64(fd, 0, SEEK_SET) < 0) {
+    return -errno;
+  }
+#endif
+
+  return sparse_file_read_normal_range(s, fd, 0, s->len, true);
+}
+
 int sparse_file_read(struct sparse_file* s, int fd, bool sparse, bool crc) {
   if (crc && !sparse) {
     return -EINVAL;
@@ -575,3 +719,285 @@ struct sparse_file* sparse_file_import_auto(int fd, bool crc, bool verbose) {
 
   return s;
 }
+
+static int write_all(int fd, const void* buf, size_t len) {
+  const char* ptr = reinterpret_cast<const char*>(buf);
+
+  while (len > 0) {
+    ssize_t ret = write(fd, ptr, len);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -errno;
+    }
+    ptr += ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
+#if defined(__linux__)
+/* Calls copy() until len bytes have been copied, or until it fails or reaches the end of the
+ * input. Returns the number of bytes copied. */
+template <typename F>
+static int64_t copy_until_error(int64_t len, F copy) {
+  static constexpr int64_t kMaxCopy = 1 << 30;
+  int64_t copied = 0;
+
+  while (copied < len) {
+    ssize_t ret = copy(std::min(len - copied, kMaxCopy));
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) break;
+    copied += ret;
+  }
+
+  return copied;
+}
+#endif
+
+/* Copies up to len bytes from the current offset of in_fd to the current offset of out_fd
+ * without passing them through userspace. Returns the number of bytes copied, which is short if
+ * neither copy_file_range nor splice supports the two files. Errors are left for the caller to
+ * hit again with read and write. */
+static int64_t copy_in_kernel(int in_fd, int out_fd, int64_t len) {
+  int64_t copied = 0;
+
+#if defined(__linux__)
+#if defined(__NR_copy_file_range)
+  copied += copy_until_error(len - copied, [&](size_t n) {
+    return syscall(__NR_copy_file_range, in_fd, nullptr, out_fd, nullptr, n, 0);
+  });
+#endif
+  /* splice works when in_fd is a pipe, such as simg2img reading from stdin. */
+  copied += copy_until_error(len - copied, [&](size_t n) {
+    return splice(in_fd, nullptr, out_fd, nullptr, n, SPLICE_F_MOVE);
+  });
+#else
+  (void)in_fd;
+  (void)out_fd;
+  (void)len;
+#endif
+
+  return copied;
+}
+
+static int unsparse_raw_chunk(int in_fd, int out_fd, int64_t len, uint32_t* crc32) {
+  int ret;
+
+  if (!crc32) {
+    len -= copy_in_kernel(in_fd, out_fd, len);
+  }
+
+  while (len) {
+    int chunk = std::min(len, COPY_BUF_SIZE);
+    ret = read_all(in_fd, copybuf, chunk);
+    if (ret < 0) {
+      return ret;
+    }
+    if (crc32) {
+      *crc32 = sparse_crc32(*crc32, copybuf, chunk);
+    }
+    ret = write_all(out_fd, copybuf, chunk);
+    if (ret < 0) {
+      return ret;
+    }
+    len -= chunk;
+  }
+
+  return 0;
+}
+
+static int unsparse_fill_chunk(int out_fd, int64_t len, uint32_t fill_val, uint32_t* crc32) {
+  int ret;
+  uint32_t* fillbuf = (uint32_t*)copybuf;
+
+  for (unsigned int i = 0; i < COPY_BUF_SIZE / sizeof(fill_val); i++) {
+    fillbuf[i] = fill_val;
+  }
+
+  while (len) {
+    int chunk = std::min(len, COPY_BUF_SIZE);
+    if (crc32) {
+      *crc32 = sparse_crc32(*crc32, copybuf, chunk);
+    }
+    ret = write_all(out_fd, copybuf, chunk);
+    if (ret < 0) {
+      return ret;
+    }
+    len -= chunk;
+  }
+
+  return 0;
+}
+
+static int unsparse_skip_chunk(int out_fd, int64_t len, uint32_t* crc32) {
+  if (crc32) {
+    int64_t crc_len = len;
+    memset(copybuf, 0, COPY_BUF_SIZE);
+
+    while (crc_len) {
+      int chunk = std::min(crc_len, COPY_BUF_SIZE);
+      *crc32 = sparse_crc32(*crc32, copybuf, chunk);
+      crc_len -= chunk;
+    }
+  }
+
+  if (lseek64(out_fd, len, SEEK_CUR) < 0) {
+    return -errno;
+  }
+
+  return 0;
+}
+
+/* Reads and discards len bytes, which may not be seekable. */
+static int unsparse_discard(int in_fd, int64_t len) {
+  while (len) {
+    int chunk = std::min(len, COPY_BUF_SIZE);
+    int ret = read_all(in_fd, copybuf, chunk);
+    if (ret < 0) {
+      return ret;
+    }
+    len -= chunk;
+  }
+
+  return 0;
+}
+
+static int unsparse_chunk(int in_fd, int out_fd, unsigned int block_size,
+                          unsigned int chunk_data_size, chunk_header_t* chunk_header,
+                          uint32_t* crc_ptr) {
+  int ret;
+  int64_t len = (int64_t)chunk_header->chunk_sz * block_size;
+  uint32_t value;
+
+  switch (chunk_header->chunk_type) {
+    case CHUNK_TYPE_RAW:
+      if (chunk_data_size != len) {
+        return -EINVAL;
+      }
+      return unsparse_raw_chunk(in_fd, out_fd, len, crc_ptr);
+    case CHUNK_TYPE_FILL:
+      if (chunk_data_size != sizeof(value)) {
+        return -EINVAL;
+      }
+      ret = read_all(in_fd, &value, sizeof(value));
+      if (ret < 0) {
+        return ret;
+      }
+      return unsparse_fill_chunk(out_fd, len, value, crc_ptr);
+    case CHUNK_TYPE_DONT_CARE:
+      if (chunk_data_size != 0) {
+        return -EINVAL;
+      }
+      return unsparse_skip_chunk(out_fd, len, crc_ptr);
+    case CHUNK_TYPE_CRC32:
+      if (chunk_data_size != sizeof(value)) {
+        return -EINVAL;
+      }
+      ret = read_all(in_fd, &value, sizeof(value));
+      if (ret < 0) {
+        return ret;
+      }
+      if (crc_ptr != nullptr && value != *crc_ptr) {
+        return -EINVAL;
+      }
+      return 0;
+    default:
+      return -EINVAL;
+  }
+}
+
+int sparse_file_unsparse(int in_fd, int out_fd, bool verbose, bool crc) {
+  int ret;
+  sparse_header_t sparse_header;
+  chunk_header_t chunk_header;
+  uint32_t crc32 = 0;
+  uint32_t* crc_ptr = crc ? &crc32 : nullptr;
+  unsigned int cur_block = 0;
+  int64_t offset = 0;
+
+  if (!copybuf) {
+    copybuf = (char*)malloc(COPY_BUF_SIZE);
+  }
+
+  if (!copybuf) {
+    return -ENOMEM;
+  }
+
+  ret = read_all(in_fd, &sparse_header, sizeof(sparse_header));
+  if (ret < 0) {
+    verbose_error(verbose, ret, "header");
+    return ret;
+  }
+
+  if (sparse_header.magic != SPARSE_HEADER_MAGIC) {
+    verbose_error(verbose, -EINVAL, "header magic");
+    return -EINVAL;
+  }
+
+  if (sparse_header.major_version != SPARSE_HEADER_MAJOR_VER) {
+    verbose_error(verbose, -EINVAL, "header major version");
+    return -EINVAL;
+  }
+
+  if (sparse_header.file_hdr_sz < SPARSE_HEADER_LEN) {
+    return -EINVAL;
+  }
+
+  if (sparse_header.chunk_hdr_sz < CHUNK_HEADER_LEN) {
+    return -EINVAL;
+  }
+
+  /* Skip the remaining bytes in a header that is longer than we expected. */
+  ret = unsparse_discard(in_fd, sparse_header.file_hdr_sz - SPARSE_HEADER_LEN);
+  if (ret < 0) {
+    verbose_error(verbose, ret, "header");
+    return ret;
+  }
+  offset += sparse_header.file_hdr_sz;
+
+  for (unsigned int i = 0; i < sparse_header.total_chunks; i++) {
+    ret = read_all(in_fd, &chunk_header, sizeof(chunk_header));
+    if (ret == 0) {
+      ret = unsparse_discard(in_fd, sparse_header.chunk_hdr_sz - CHUNK_HEADER_LEN);
+    }
+    if (ret < 0) {
+      verbose_error(verbose, ret, "chunk header at %" PRId64, offset);
+      return ret;
+    }
+    offset += sparse_header.chunk_hdr_sz;
+
+    if (chunk_header.total_sz < sparse_header.chunk_hdr_sz) {
+      verbose_error(verbose, -EINVAL, "chunk at %" PRId64, offset);
+      return -EINVAL;
+    }
+    unsigned int chunk_data_size = chunk_header.total_sz - sparse_header.chunk_hdr_sz;
+
+    ret = unsparse_chunk(in_fd, out_fd, sparse_header.blk_sz, chunk_data_size, &chunk_header,
+                         crc_ptr);
+    if (ret < 0) {
+      verbose_error(verbose, ret, "chunk %04X at %" PRId64, chunk_header.chunk_type, offset);
+      return ret;
+    }
+    offset += chunk_data_size;
+
+    if (chunk_header.chunk_type != CHUNK_TYPE_CRC32) {
+      cur_block += chunk_header.chunk_sz;
+    }
+  }
+
+  if (sparse_header.total_blks != cur_block) {
+    verbose_error(verbose, -EINVAL, "total block count");
+    return -EINVAL;
+  }
+
+  /* Extend a regular file over a trailing don't care chunk. */
+  struct stat st;
+  if (fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (ftruncate64(out_fd, (int64_t)sparse_header.total_blks * sparse_header.blk_sz) < 0) {
+      return -errno;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <sparse/sparse.h>
+
+static constexpr unsigned int kFsBlockSize = 4096;
+static constexpr unsigned int kBlockSize = 16 * kFsBlockSize;
+
+struct Chunk {
+  unsigned int block;
+  unsigned int nr_blocks;
+};
+
+static int CollectChunk(void* priv, const void*, size_t, unsigned int block,
+                        unsigned int nr_blocks) {
+  static_cast<std::vector<Chunk>*>(priv)->push_back({block, nr_blocks});
+  return 0;
+}
+
+static void WriteAt(int fd, off64_t offset, char c) {
+  std::string data(kFsBlockSize, c);
+  ASSERT_EQ(static_cast<ssize_t>(data.size()), pwrite64(fd, data.data(), data.size(), offset));
+}
+
+// The file system reports holes in units of kFsBlockSize, which is smaller than
+// the sparse block size, so several data regions start in the same sparse block.
+TEST(SparseReadTest, HoleSmallerThanBlock) {
+  TemporaryFile in;
+  ASSERT_GE(in.fd, 0);
+  const int64_t len = 4 * kBlockSize;
+  ASSERT_EQ(0, ftruncate64(in.fd, len));
+  WriteAt(in.fd, 0, 'a');
+  WriteAt(in.fd, 2 * kFsBlockSize, 'b');
+  WriteAt(in.fd, 4 * kFsBlockSize, 'c');
+  WriteAt(in.fd, kBlockSize + 3 * kFsBlockSize, 'd');
+  WriteAt(in.fd, 3 * kBlockSize - kFsBlockSize, 'e');
+  WriteAt(in.fd, 3 * kBlockSize, 'f');
+
+  struct sparse_file* s = sparse_file_new(kBlockSize, len);
+  ASSERT_NE(nullptr, s);
+  ASSERT_EQ(0, lseek64(in.fd, 0, SEEK_SET));
+  ASSERT_EQ(0, sparse_file_read_hole(s, in.fd));
+
+  std::vector<Chunk> chunks;
+  ASSERT_EQ(0, sparse_file_foreach_chunk(s, false, false, CollectChunk, &chunks));
+  unsigned int next = 0;
+  for (const auto& chunk : chunks) {
+    EXPECT_GE(chunk.block, next);
+    next = chunk.block + chunk.nr_blocks;
+  }
+  EXPECT_LE(next, len / kBlockSize);
+
+  TemporaryFile out;
+  ASSERT_GE(out.fd, 0);
+  ASSERT_EQ(0, sparse_file_write(s, out.fd, false, false, false));
+  sparse_file_destroy(s);
+
+  std::string expected, actual;
+  ASSERT_TRUE(android::base::ReadFileToString(in.path, &expected));
+  ASSERT_TRUE(android::base::ReadFileToString(out.path, &actual));
+  EXPECT_EQ(expected, actual);
+}
+
+// gzip output is buffered until the file is closed, so a failed write is only
+// seen then.
+TEST(SparseWriteTest, GzCloseError) {
+  struct sparse_file* s = sparse_file_new(kFsBlockSize, 4 * kFsBlockSize);
+  ASSERT_NE(nullptr, s);
+  std::string data(kFsBlockSize, 'a');
+  ASSERT_EQ(0, sparse_file_add_data(s, data.data(), data.size(), 1));
+
+  int fd = open("/dev/full", O_WRONLY | O_CLOEXEC);
+  ASSERT_GE(fd, 0);
+  EXPECT_LT(sparse_file_write(s, fd, true, false, false), 0);
+  sparse_file_destroy(s);
+}